@@ -0,0 +1,41 @@
+QT += core network testlib
+QT -= gui
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+include(../QChatProtocol/QChatProtocol.pri)
+
+TARGET = qchatbench
+
+INCLUDEPATH += ../QChatServer
+
+SOURCES += \
+    main.cpp \
+    protocolbenchmark.cpp \
+    ../QChatServer/authenticator.cpp \
+    ../QChatServer/chatserver.cpp \
+    ../QChatServer/connectionregistry.cpp \
+    ../QChatServer/dedupwindow.cpp \
+    ../QChatServer/framebufferpool.cpp \
+    ../QChatServer/messagefilter.cpp \
+    ../QChatServer/serverworker.cpp \
+    ../QChatServer/threadlistener.cpp \
+    ../QChatServer/timerwheel.cpp \
+    ../QChatServer/tokenbucket.cpp \
+    ../QChatServer/utf8.cpp
+
+HEADERS += \
+    protocolbenchmark.h \
+    ../QChatServer/authenticator.h \
+    ../QChatServer/chatserver.h \
+    ../QChatServer/connectionregistry.h \
+    ../QChatServer/dedupwindow.h \
+    ../QChatServer/framebufferpool.h \
+    ../QChatServer/messagefilter.h \
+    ../QChatServer/serversettings.h \
+    ../QChatServer/serverworker.h \
+    ../QChatServer/threadlistener.h \
+    ../QChatServer/timerwheel.h \
+    ../QChatServer/tokenbucket.h \
+    ../QChatServer/utf8.h
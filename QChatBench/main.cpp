@@ -0,0 +1,29 @@
+#include "protocolbenchmark.h"
+
+#include <QCoreApplication>
+#include <QTest>
+
+static bool hasLoggerOption(const QStringList &arguments)
+{
+    static const char *const loggerOptions[] = {
+        "-o", "-txt", "-csv", "-xml", "-lightxml", "-junitxml", "-teamcity", "-tap"
+    };
+    for (const QString &argument : arguments) {
+        for (const char *option : loggerOptions) {
+            if (argument == QLatin1String(option))
+                return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    ProtocolBenchmark benchmark;
+    QStringList arguments = a.arguments();
+    // CSV by default so results can be diffed between releases
+    if (!hasLoggerOption(arguments))
+        arguments.insert(1, QStringLiteral("-csv"));
+    return QTest::qExec(&benchmark, arguments);
+}
@@ -0,0 +1,821 @@
+#include "protocolbenchmark.h"
+#include "chatserver.h"
+#include "messagecodec.h"
+#include "messagefilter.h"
+#include "protocol.h"
+#include "serversettings.h"
+#include "serverworker.h"
+#include "timerwheel.h"
+#include "utf8.h"
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QRandomGenerator>
+#include <QTcpSocket>
+#include <QTest>
+#include <QThread>
+#include <cstring>
+#include <memory>
+#include <vector>
+#ifdef Q_OS_LINUX
+#include <QFile>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+static QJsonObject chatMessage(int textSize)
+{
+    QJsonObject message;
+    message[QStringLiteral("type")] = QStringLiteral("message");
+    message[QStringLiteral("text")] = QString(textSize, QLatin1Char('x'));
+    message[QStringLiteral("sender")] = QStringLiteral("alice");
+    message[QStringLiteral("recipient")] = QStringLiteral("bob");
+    return message;
+}
+
+static QByteArray framedStream(const QByteArray &payload, int frameCount)
+{
+    QByteArray wire;
+    QDataStream stream(&wire, QIODevice::WriteOnly);
+    for (int i = 0; i < frameCount; ++i)
+        stream << payload;
+    return wire;
+}
+
+static void writeFrame(QTcpSocket *socket, const QByteArray &payload)
+{
+    QDataStream stream(socket);
+    stream << payload;
+}
+
+static bool readFrame(QTcpSocket *socket, QByteArray *payload)
+{
+    QDataStream stream(socket);
+    stream.startTransaction();
+    stream >> *payload;
+    return stream.commitTransaction();
+}
+
+// Reads frames until the one accepted, or the deadline
+template<typename Accept>
+static bool waitForFrame(QTcpSocket *socket, Accept accept, int timeoutMsecs = 5000)
+{
+    const QDeadlineTimer deadline(timeoutMsecs);
+    QByteArray payload;
+    while (!deadline.hasExpired()) {
+        while (readFrame(socket, &payload)) {
+            if (accept(payload))
+                return true;
+        }
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 10);
+    }
+    return false;
+}
+
+static bool loginPeer(QTcpSocket *socket, quint16 port, const QString &userName)
+{
+    socket->connectToHost(QHostAddress::LocalHost, port);
+    if (!socket->waitForConnected(5000))
+        return false;
+    QJsonObject login;
+    login[QStringLiteral("type")] = QStringLiteral("login");
+    login[QStringLiteral("username")] = userName;
+    login[QStringLiteral("features")] = MessageCodec::featureNames(MessageCodec::RelayFrames
+                                                                   | MessageCodec::Files);
+    writeFrame(socket, MessageCodec::encode(login, MessageCodec::Json));
+    bool success = false;
+    const bool replied = waitForFrame(socket, [&success](const QByteArray &payload) {
+        if (MessageCodec::isRelay(payload) || MessageCodec::isFileData(payload))
+            return false;
+        const QJsonObject reply = MessageCodec::decode(payload);
+        if (reply.value(QLatin1String("type")).toString() != QLatin1String("login"))
+            return false;
+        success = reply.value(QLatin1String("success")).toBool();
+        return true;
+    });
+    return replied && success;
+}
+
+#ifdef Q_OS_LINUX
+static qint64 residentBytes()
+{
+    QFile statm(QStringLiteral("/proc/self/statm"));
+    if (!statm.open(QIODevice::ReadOnly))
+        return -1;
+    const QList<QByteArray> fields = statm.readAll().split(' ');
+    if (fields.size() < 2)
+        return -1;
+    return fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE);
+}
+
+static bool raiseDescriptorLimit(rlim_t wanted)
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return false;
+    if (limit.rlim_cur >= wanted)
+        return true;
+    if (limit.rlim_max < wanted)
+        return false;
+    limit.rlim_cur = wanted;
+    return setrlimit(RLIMIT_NOFILE, &limit) == 0;
+}
+
+// Plain sockets keep the peer side out of the measured heap
+struct IdlePeers
+{
+    std::vector<int> descriptors;
+    // Non blocking peers connect all at once, like clients after an outage
+    bool blocking = true;
+    ~IdlePeers()
+    {
+        for (int descriptor : descriptors)
+            ::close(descriptor);
+    }
+    bool connectTo(quint16 port)
+    {
+        const int descriptor = ::socket(AF_INET, SOCK_STREAM | (blocking ? 0 : SOCK_NONBLOCK), 0);
+        if (descriptor < 0)
+            return false;
+        descriptors.push_back(descriptor);
+        // Spread peers over 127.0.0.0/8 so that 50k connections fit in the
+        // ephemeral port range of a single source address
+        sockaddr_in local{};
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + descriptors.size() / 20000);
+        sockaddr_in remote{};
+        remote.sin_family = AF_INET;
+        remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        remote.sin_port = htons(port);
+        if (::bind(descriptor, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0)
+            return false;
+        return ::connect(descriptor, reinterpret_cast<sockaddr *>(&remote), sizeof(remote)) == 0
+               || (!blocking && errno == EINPROGRESS);
+    }
+};
+#endif
+
+static void addFramingRows()
+{
+    QTest::addColumn<int>("textSize");
+    QTest::addColumn<int>("frameCount");
+    QTest::newRow("64B x1") << 64 << 1;
+    QTest::newRow("64B x64") << 64 << 64;
+    QTest::newRow("1KiB x64") << 1024 << 64;
+    QTest::newRow("16KiB x16") << 16384 << 16;
+}
+
+void ProtocolBenchmark::writeFrames_data()
+{
+    addFramingRows();
+}
+
+void ProtocolBenchmark::writeFrames()
+{
+    QFETCH(int, textSize);
+    QFETCH(int, frameCount);
+    const QByteArray payload = QJsonDocument(chatMessage(textSize)).toJson();
+    QByteArray wire;
+    QBENCHMARK {
+        wire.clear();
+        QBuffer buffer(&wire);
+        buffer.open(QIODevice::WriteOnly);
+        QDataStream socketStream(&buffer);
+        for (int i = 0; i < frameCount; ++i)
+            socketStream << payload;
+    }
+    QCOMPARE(wire, framedStream(payload, frameCount));
+}
+
+void ProtocolBenchmark::readFrames_data()
+{
+    addFramingRows();
+}
+
+void ProtocolBenchmark::readFrames()
+{
+    QFETCH(int, textSize);
+    QFETCH(int, frameCount);
+    const QByteArray wire = framedStream(QJsonDocument(chatMessage(textSize)).toJson(), frameCount);
+    int framesRead = 0;
+    QBENCHMARK {
+        framesRead = 0;
+        QBuffer buffer;
+        buffer.setData(wire);
+        buffer.open(QIODevice::ReadOnly);
+        QByteArray jsonData;
+        QDataStream socketStream(&buffer);
+        for (;;) {
+            socketStream.startTransaction();
+            socketStream >> jsonData;
+            if (!socketStream.commitTransaction())
+                break;
+            ++framesRead;
+        }
+    }
+    QCOMPARE(framesRead, frameCount);
+}
+
+void ProtocolBenchmark::parseJson_data()
+{
+    QTest::addColumn<int>("textSize");
+    QTest::newRow("64B") << 64;
+    QTest::newRow("1KiB") << 1024;
+    QTest::newRow("16KiB") << 16384;
+}
+
+void ProtocolBenchmark::parseJson()
+{
+    QFETCH(int, textSize);
+    const QByteArray jsonData = QJsonDocument(chatMessage(textSize)).toJson();
+    QJsonParseError parseError;
+    QJsonObject docObj;
+    QBENCHMARK {
+        docObj = QJsonDocument::fromJson(jsonData, &parseError).object();
+    }
+    QCOMPARE(parseError.error, QJsonParseError::NoError);
+    QCOMPARE(int(docObj.value(QLatin1String("text")).toString().size()), textSize);
+}
+
+void ProtocolBenchmark::serializeJson_data()
+{
+    QTest::addColumn<int>("textSize");
+    QTest::addColumn<bool>("compact");
+    QTest::newRow("64B indented") << 64 << false;
+    QTest::newRow("64B compact") << 64 << true;
+    QTest::newRow("1KiB indented") << 1024 << false;
+    QTest::newRow("1KiB compact") << 1024 << true;
+    QTest::newRow("16KiB indented") << 16384 << false;
+    QTest::newRow("16KiB compact") << 16384 << true;
+}
+
+void ProtocolBenchmark::serializeJson()
+{
+    QFETCH(int, textSize);
+    QFETCH(bool, compact);
+    const QJsonObject message = chatMessage(textSize);
+    const QJsonDocument::JsonFormat format = compact ? QJsonDocument::Compact
+                                                     : QJsonDocument::Indented;
+    QByteArray jsonData;
+    QBENCHMARK {
+        jsonData = QJsonDocument(message).toJson(format);
+    }
+    QVERIFY(jsonData.size() > textSize);
+}
+
+static void addCodecRows()
+{
+    QTest::addColumn<int>("textSize");
+    QTest::addColumn<int>("codec");
+    QTest::newRow("64B json") << 64 << int(MessageCodec::Json);
+    QTest::newRow("64B cbor") << 64 << int(MessageCodec::Cbor);
+    QTest::newRow("1KiB json") << 1024 << int(MessageCodec::Json);
+    QTest::newRow("1KiB cbor") << 1024 << int(MessageCodec::Cbor);
+    QTest::newRow("16KiB json") << 16384 << int(MessageCodec::Json);
+    QTest::newRow("16KiB cbor") << 16384 << int(MessageCodec::Cbor);
+}
+
+void ProtocolBenchmark::encodeMessage_data()
+{
+    addCodecRows();
+}
+
+void ProtocolBenchmark::encodeMessage()
+{
+    QFETCH(int, textSize);
+    QFETCH(int, codec);
+    const QJsonObject message = chatMessage(textSize);
+    QByteArray payload;
+    QBENCHMARK {
+        payload = MessageCodec::encode(message, MessageCodec::Codec(codec));
+    }
+    QCOMPARE(MessageCodec::isCbor(payload), codec == MessageCodec::Cbor);
+}
+
+void ProtocolBenchmark::decodeMessage_data()
+{
+    addCodecRows();
+}
+
+void ProtocolBenchmark::decodeMessage()
+{
+    QFETCH(int, textSize);
+    QFETCH(int, codec);
+    const QJsonObject message = chatMessage(textSize);
+    const QByteArray payload = MessageCodec::encode(message, MessageCodec::Codec(codec));
+    QJsonObject decoded;
+    bool ok = false;
+    QBENCHMARK {
+        decoded = MessageCodec::decode(payload, &ok);
+    }
+    QVERIFY(ok);
+    QCOMPARE(decoded, message);
+}
+
+void ProtocolBenchmark::compressRoster_data()
+{
+    QTest::addColumn<int>("userCount");
+    QTest::newRow("100 users") << 100;
+    QTest::newRow("1000 users") << 1000;
+    QTest::newRow("10000 users") << 10000;
+}
+
+// A login reply is the largest JSON payload the server sends
+void ProtocolBenchmark::compressRoster()
+{
+    QFETCH(int, userCount);
+    QJsonArray users;
+    QJsonArray userIds;
+    for (int i = 0; i < userCount; ++i) {
+        users.append(QStringLiteral("user%1").arg(i));
+        userIds.append(i + 1);
+    }
+    QJsonObject reply;
+    reply[QStringLiteral("type")] = QStringLiteral("login");
+    reply[QStringLiteral("success")] = true;
+    reply[QStringLiteral("users")] = users;
+    reply[QStringLiteral("userIds")] = userIds;
+    const QByteArray payload = MessageCodec::encode(reply, MessageCodec::Json);
+    QByteArray compressed;
+    QBENCHMARK {
+        compressed = MessageCodec::compress(payload);
+    }
+    qInfo("%lld bytes compressed to %lld", qlonglong(payload.size()), qlonglong(compressed.size()));
+    QByteArray original;
+    QVERIFY(MessageCodec::uncompress(compressed, &original));
+    QCOMPARE(original, payload);
+}
+
+void ProtocolBenchmark::encodedSize_data()
+{
+    addCodecRows();
+}
+
+void ProtocolBenchmark::encodedSize()
+{
+    QFETCH(int, textSize);
+    QFETCH(int, codec);
+    const QByteArray payload = MessageCodec::encode(chatMessage(textSize), MessageCodec::Codec(codec));
+    QTest::setBenchmarkResult(payload.size(), QTest::BytesAllocated);
+}
+
+void ProtocolBenchmark::routeMessage_data()
+{
+    QTest::addColumn<int>("textSize");
+    QTest::addColumn<QString>("path");
+    for (int textSize : {64, 1024, 16384}) {
+        for (const char *path : {"json", "cbor", "relay", "relay ids"}) {
+            QTest::addRow("%dB %s", textSize, path) << textSize << QString::fromLatin1(path);
+        }
+    }
+}
+
+// What the server does per relayed message: inbound payload to outbound payload
+void ProtocolBenchmark::routeMessage()
+{
+    QFETCH(int, textSize);
+    QFETCH(QString, path);
+    const QJsonObject inbound = chatMessage(textSize);
+    QByteArray outbound;
+    if (path == QLatin1String("relay")) {
+        const QByteArray payload = MessageCodec::encodeRelay(
+            QByteArrayView("bob"), inbound.value(QLatin1String("text")).toString().toUtf8());
+        const QByteArray senderName("alice");
+        QBENCHMARK {
+            MessageCodec::RelayFrame frame;
+            MessageCodec::decodeRelay(payload, &frame);
+            outbound = MessageCodec::encodeRelay(senderName, frame.text);
+        }
+    } else if (path == QLatin1String("relay ids")) {
+        const QByteArray payload = MessageCodec::encodeRelay(
+            quint32(2), inbound.value(QLatin1String("text")).toString().toUtf8());
+        const quint32 senderId = 1;
+        QBENCHMARK {
+            MessageCodec::RelayFrame frame;
+            MessageCodec::decodeRelay(payload, &frame);
+            outbound = MessageCodec::encodeRelay(senderId, frame.text);
+        }
+    } else {
+        const MessageCodec::Codec codec = MessageCodec::codecFromName(path);
+        const QByteArray payload = MessageCodec::encode(inbound, codec);
+        QBENCHMARK {
+            const QJsonObject docObj = MessageCodec::decode(payload);
+            QJsonObject message;
+            message[QStringLiteral("type")] = QStringLiteral("message");
+            message[QStringLiteral("text")] = docObj.value(QLatin1String("text")).toString().trimmed();
+            message[QStringLiteral("sender")] = QStringLiteral("alice");
+            outbound = MessageCodec::encode(message, codec);
+        }
+    }
+    QVERIFY(outbound.size() > textSize);
+}
+
+void ProtocolBenchmark::filterText_data()
+{
+    QTest::addColumn<int>("ruleCount");
+    QTest::addColumn<int>("textSize");
+    for (const int ruleCount : {10, 1000, 10000}) {
+        for (const int textSize : {1024, 64 * 1024}) {
+            const QByteArray name = QByteArray::number(ruleCount) + " rules, "
+                                    + QByteArray::number(textSize / 1024) + " KB";
+            QTest::newRow(name.constData()) << ruleCount << textSize;
+        }
+    }
+}
+
+// Text with no match, the usual case, so every byte is scanned
+void ProtocolBenchmark::filterText()
+{
+    QFETCH(int, ruleCount);
+    QFETCH(int, textSize);
+    QVector<MessageFilter::Rule> rules;
+    for (int i = 0; i < ruleCount; ++i) {
+        MessageFilter::Rule rule;
+        if (i % 2 == 0) {
+            rule.pattern = "badword" + QByteArray::number(i);
+        } else {
+            rule.pattern = "spam" + QByteArray::number(i) + ".example/";
+            rule.action = MessageFilter::Action::Block;
+        }
+        rules.append(rule);
+    }
+    const MessageFilter filter(rules);
+    const QByteArray sentence("Lorem ipsum dolor sit amet, badwords https://example.org/ 42. ");
+    QByteArray text;
+    while (text.size() < textSize)
+        text += sentence;
+    text.truncate(textSize);
+    QByteArray scratch = text;
+    MessageFilter::Verdict verdict = MessageFilter::Verdict::Pass;
+    QBENCHMARK {
+        memcpy(scratch.data(), text.constData(), size_t(text.size()));
+        verdict = filter.apply(scratch.data(), scratch.size());
+    }
+    QCOMPARE(int(verdict), int(MessageFilter::Verdict::Pass));
+}
+
+void ProtocolBenchmark::validateUtf8_data()
+{
+    QTest::addColumn<QByteArray>("text");
+    QTest::addColumn<QString>("path");
+    const QByteArray ascii = QByteArray("The quick brown fox jumps over the lazy dog. ").repeated(364);
+    const QByteArray mixed = QStringLiteral("Grüße, привет, こんにちは, 👋! ").toUtf8().repeated(315);
+    for (const char *path : {"simd", "scalar", "qstring"}) {
+        QTest::addRow("16KiB ascii %s", path) << ascii << QString::fromLatin1(path);
+        QTest::addRow("16KiB mixed %s", path) << mixed << QString::fromLatin1(path);
+    }
+}
+
+// Validation plus trimming on the bytes, against the QString round trip the
+// server used to do for every message
+void ProtocolBenchmark::validateUtf8()
+{
+    QFETCH(QByteArray, text);
+    QFETCH(QString, path);
+    qsizetype size = 0;
+    if (path == QLatin1String("simd")) {
+        QBENCHMARK {
+            if (Utf8::isValid(text))
+                size = Utf8::trimmed(text).size();
+        }
+    } else if (path == QLatin1String("scalar")) {
+        QBENCHMARK {
+            if (Utf8::isValidScalar(text))
+                size = Utf8::trimmed(text).size();
+        }
+    } else {
+        QBENCHMARK {
+            size = QString::fromUtf8(text).trimmed().toUtf8().size();
+        }
+    }
+    QVERIFY(size > 0);
+}
+
+void ProtocolBenchmark::compareType_data()
+{
+    QTest::addColumn<QString>("type");
+    QTest::addColumn<bool>("perfectHash");
+    QTest::addColumn<bool>("known");
+    for (bool perfectHash : {false, true}) {
+        const char *lookup = perfectHash ? "hash" : "compare chain";
+        QTest::addRow("exact %s", lookup) << QStringLiteral("message") << perfectHash << true;
+        QTest::addRow("upper case %s", lookup) << QStringLiteral("MESSAGE") << perfectHash << true;
+        QTest::addRow("last in chain %s", lookup) << QStringLiteral("user disconnected")
+                                                  << perfectHash << true;
+        QTest::addRow("mismatch %s", lookup) << QStringLiteral("typing") << perfectHash << false;
+    }
+}
+
+// The if/else chain of case-insensitive compares the client used to run,
+// against the shared perfect hash lookup
+void ProtocolBenchmark::compareType()
+{
+    QFETCH(QString, type);
+    QFETCH(bool, perfectHash);
+    QFETCH(bool, known);
+    QJsonObject docObj = chatMessage(64);
+    docObj[QStringLiteral("type")] = type;
+    int matches = 0;
+    int iterations = 0;
+    if (perfectHash) {
+        QBENCHMARK {
+            ++iterations;
+            const QJsonValue typeVal = docObj.value(QLatin1String("type"));
+            if (Protocol::messageType(typeVal.toString()) != Protocol::MessageType::Unknown)
+                ++matches;
+        }
+    } else {
+        static const char *const chain[] = {"login", "new user", "user disconnected", "message"};
+        QBENCHMARK {
+            ++iterations;
+            const QJsonValue typeVal = docObj.value(QLatin1String("type"));
+            for (const char *name : chain) {
+                if (typeVal.toString().compare(QLatin1String(name), Qt::CaseInsensitive) == 0) {
+                    ++matches;
+                    break;
+                }
+            }
+        }
+    }
+    QCOMPARE(matches, known ? iterations : 0);
+}
+
+void ProtocolBenchmark::broadcastFanOut_data()
+{
+    QTest::addColumn<int>("workerCount");
+    QTest::newRow("1") << 1;
+    QTest::newRow("10") << 10;
+    QTest::newRow("100") << 100;
+    QTest::newRow("1000") << 1000;
+}
+
+void ProtocolBenchmark::broadcastFanOut()
+{
+    QFETCH(int, workerCount);
+    ChatServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+    std::vector<std::unique_ptr<QTcpSocket>> peers;
+    peers.reserve(workerCount);
+    for (int i = 0; i < workerCount; ++i) {
+        peers.push_back(std::make_unique<QTcpSocket>());
+        peers.back()->connectToHost(QHostAddress::LocalHost, server.serverPort());
+        QVERIFY(server.waitForNewConnection(5000));
+        QVERIFY(peers.back()->waitForConnected(5000));
+    }
+    QCOMPARE(int(server.m_clients.size()), workerCount);
+
+    const QJsonObject message = chatMessage(64);
+    QBENCHMARK {
+        server.broadcast(message, nullptr);
+    }
+    server.stopServer();
+}
+
+void ProtocolBenchmark::idleConnectionFootprint_data()
+{
+    QTest::addColumn<int>("connectionCount");
+    QTest::newRow("10k") << 10000;
+    QTest::newRow("50k") << 50000;
+}
+
+void ProtocolBenchmark::idleConnectionFootprint()
+{
+#ifdef Q_OS_LINUX
+    QFETCH(int, connectionCount);
+    if (!raiseDescriptorLimit(rlim_t(connectionCount) * 2 + 64))
+        QSKIP("File descriptor limit is too low for this many connections");
+    ChatServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+    const qint64 residentBefore = residentBytes();
+    IdlePeers peers;
+    peers.descriptors.reserve(connectionCount);
+    for (int i = 0; i < connectionCount; ++i) {
+        QVERIFY(peers.connectTo(server.serverPort()));
+        QVERIFY(server.waitForNewConnection(5000));
+    }
+    QCOMPARE(int(server.m_clients.size()), connectionCount);
+    // Log every worker in directly: a real login storm would broadcast the
+    // roster N times and the measurement would be the socket backlog
+    for (int i = 0; i < connectionCount; ++i) {
+        ServerWorker *worker = server.m_clients.at(i);
+        const QString userName = QStringLiteral("idle%1").arg(i);
+        server.assignUserId(worker, userName);
+    }
+    QTest::qWait(500);
+    const qint64 residentAfter = residentBytes();
+    QVERIFY(residentBefore > 0 && residentAfter > 0);
+    QTest::setBenchmarkResult(qreal(residentAfter - residentBefore) / connectionCount,
+                              QTest::BytesAllocated);
+#else
+    QSKIP("Resident set size is only sampled on Linux");
+#endif
+}
+
+// Connect and drop one client at a time: once every thread has a worker,
+// connections should only be served by pooled ones
+void ProtocolBenchmark::connectionChurn()
+{
+    ChatServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+    QBENCHMARK {
+        QTcpSocket peer;
+        peer.connectToHost(QHostAddress::LocalHost, server.serverPort());
+        QVERIFY(server.waitForNewConnection(5000));
+        QVERIFY(peer.waitForConnected(5000));
+        peer.disconnectFromHost();
+        const QDeadlineTimer deadline(5000);
+        while (!server.m_clients.isEmpty() && !deadline.hasExpired())
+            QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+        QVERIFY(server.m_clients.isEmpty());
+    }
+    const ChatServer::PoolStatistics statistics = server.poolStatistics();
+    qInfo("workers: %llu pooled, %llu created; frame buffers: %llu pooled, %llu allocated",
+          statistics.workerHits, statistics.workerMisses,
+          statistics.bufferHits, statistics.bufferMisses);
+    QVERIFY(statistics.workerMisses <= quint64(qMax(QThread::idealThreadCount(), 1)));
+}
+
+void ProtocolBenchmark::acceptStorm_data()
+{
+    QTest::addColumn<bool>("perThreadListeners");
+    QTest::newRow("main thread accept") << false;
+    QTest::newRow("reuseport listeners") << true;
+}
+
+// Time until a burst of connections made at once is registered, and until
+// their disconnects are processed
+void ProtocolBenchmark::acceptStorm()
+{
+#ifdef Q_OS_LINUX
+    static constexpr int connectionCount = 1000;
+    QFETCH(bool, perThreadListeners);
+    if (!raiseDescriptorLimit(rlim_t(connectionCount) * 2 + 64))
+        QSKIP("File descriptor limit is too low for this many connections");
+    ChatServer server;
+    ServerSettings settings;
+    settings.perThreadListeners = perThreadListeners;
+    server.setSettings(settings);
+    QVERIFY(server.startServer(QHostAddress::LocalHost, 0));
+    const quint16 port = server.listeningPort();
+    QBENCHMARK {
+        {
+            IdlePeers peers;
+            peers.blocking = false;
+            peers.descriptors.reserve(connectionCount);
+            for (int i = 0; i < connectionCount; ++i)
+                QVERIFY(peers.connectTo(port));
+            const QDeadlineTimer deadline(10000);
+            while (server.m_clients.size() < connectionCount && !deadline.hasExpired())
+                QTest::qWait(1);
+            QCOMPARE(int(server.m_clients.size()), connectionCount);
+        }
+        const QDeadlineTimer deadline(10000);
+        while (!server.m_clients.isEmpty() && !deadline.hasExpired())
+            QTest::qWait(1);
+        QVERIFY(server.m_clients.isEmpty());
+    }
+    server.stopServer();
+#else
+    QSKIP("Per-thread listeners are Linux only");
+#endif
+}
+
+void ProtocolBenchmark::fileTransfer_data()
+{
+    QTest::addColumn<int>("fileSize");
+    QTest::newRow("1 MiB") << (1 << 20);
+    QTest::newRow("16 MiB") << (16 << 20);
+    QTest::newRow("64 MiB") << (64 << 20);
+}
+
+// One file from alice to bob through the server, with a chat message
+// written halfway that has to reach bob before the file does
+void ProtocolBenchmark::fileTransfer()
+{
+    static constexpr int sliceSize = 64 * 1024;
+    QFETCH(int, fileSize);
+    ChatServer server;
+    QVERIFY(server.startServer(QHostAddress::LocalHost, 0));
+    QTcpSocket alice;
+    QTcpSocket bob;
+    QVERIFY(loginPeer(&alice, server.listeningPort(), QStringLiteral("alice")));
+    QVERIFY(loginPeer(&bob, server.listeningPort(), QStringLiteral("bob")));
+
+    const QByteArray slice(sliceSize, 'f');
+    quint32 transferId = 0;
+    qint64 totalBytes = 0;
+    QElapsedTimer elapsed;
+    elapsed.start();
+    QBENCHMARK {
+        ++transferId;
+        QJsonObject offer;
+        offer[QStringLiteral("type")] = QStringLiteral("file offer");
+        offer[QStringLiteral("transferId")] = qint64(transferId);
+        offer[QStringLiteral("recipient")] = QStringLiteral("bob");
+        offer[QStringLiteral("name")] = QStringLiteral("attachment.bin");
+        offer[QStringLiteral("size")] = fileSize;
+        writeFrame(&alice, MessageCodec::encode(offer, MessageCodec::Json));
+        // Bob accepts by the server's id, and the data waits for that
+        const auto isType = [](const QByteArray &payload, QLatin1String type) {
+            return !MessageCodec::isRelay(payload) && !MessageCodec::isFileData(payload)
+                   && MessageCodec::decode(payload).value(QLatin1String("type")).toString() == type;
+        };
+        qint64 offeredId = 0;
+        QVERIFY(waitForFrame(&bob, [&](const QByteArray &payload) {
+            if (!isType(payload, QLatin1String("file offer")))
+                return false;
+            offeredId = MessageCodec::decode(payload).value(QLatin1String("transferId")).toInteger();
+            return true;
+        }));
+        QJsonObject accept;
+        accept[QStringLiteral("type")] = QStringLiteral("file accept");
+        accept[QStringLiteral("transferId")] = offeredId;
+        writeFrame(&bob, MessageCodec::encode(accept, MessageCodec::Json));
+        QVERIFY(waitForFrame(&alice, [&](const QByteArray &payload) {
+            return isType(payload, QLatin1String("file accept"));
+        }));
+        for (int written = 0; written < fileSize; written += sliceSize) {
+            if (written == fileSize / 2)
+                writeFrame(&alice, MessageCodec::encodeRelay(QByteArrayView("bob"),
+                                                             QByteArrayView("still there?")));
+            writeFrame(&alice, MessageCodec::encodeFileData(
+                                   transferId, QByteArrayView(slice).first(
+                                                   qMin(sliceSize, fileSize - written))));
+        }
+
+        qint64 received = 0;
+        bool chatFirst = false;
+        QVERIFY(waitForFrame(
+            &bob,
+            [&](const QByteArray &payload) {
+                MessageCodec::FileData fileData;
+                if (MessageCodec::decodeFileData(payload, &fileData)) {
+                    received += fileData.data.size();
+                    return received >= fileSize;
+                }
+                if (MessageCodec::isRelay(payload))
+                    chatFirst = true;
+                return false;
+            },
+            60000));
+        QCOMPARE(received, qint64(fileSize));
+        QVERIFY(chatFirst);
+        totalBytes += received;
+    }
+    qInfo("%.1f MB/s", totalBytes / 1e6 / (elapsed.nsecsElapsed() / 1e9));
+    server.stopServer();
+}
+
+void ProtocolBenchmark::timerWheel_data()
+{
+    QTest::addColumn<int>("timerCount");
+    QTest::newRow("1k") << 1000;
+    QTest::newRow("10k") << 10000;
+    QTest::newRow("100k") << 100000;
+}
+
+// Timers spread over ten minutes, the range of login and ping deadlines,
+// started and run out without waiting for the clock. Reported per timer,
+// which stays flat as the count grows once the fixed cost of walking the
+// 6000 ticks is spread thin. No timer may fire after its tick.
+void ProtocolBenchmark::timerWheel()
+{
+    QFETCH(int, timerCount);
+    static constexpr qint64 SpreadMsecs = 10 * 60 * 1000;
+    TimerWheel &wheel = TimerWheel::local();
+    QCOMPARE(wheel.activeCount(), 0);
+    int fired = 0;
+    int late = 0;
+    std::vector<std::unique_ptr<TimerWheel::Timer>> timers;
+    timers.reserve(timerCount);
+    for (int i = 0; i < timerCount; ++i) {
+        timers.push_back(std::make_unique<TimerWheel::Timer>([&wheel, &timers, &fired, &late, i]() {
+            ++fired;
+            if (wheel.m_currentTick > timers[i]->m_expiryTick)
+                ++late;
+        }));
+    }
+    QRandomGenerator random(1);
+    QElapsedTimer clock;
+    clock.start();
+    for (const std::unique_ptr<TimerWheel::Timer> &timer : timers)
+        timer->start(random.bounded(SpreadMsecs) + 1);
+    // A tick of margin for the clock moving on while the timers started
+    wheel.advanceTo(wheel.m_currentTick + SpreadMsecs / TimerWheel::TickMsecs + 2);
+    const qint64 elapsedNsecs = clock.nsecsElapsed();
+    QCOMPARE(fired, timerCount);
+    QCOMPARE(late, 0);
+    QCOMPARE(wheel.activeCount(), 0);
+    QTest::setBenchmarkResult(qreal(elapsedNsecs) / timerCount, QTest::WalltimeNanoseconds);
+}
@@ -0,0 +1,47 @@
+#ifndef PROTOCOLBENCHMARK_H
+#define PROTOCOLBENCHMARK_H
+
+#include <QObject>
+
+class ProtocolBenchmark : public QObject
+{
+    Q_OBJECT
+private slots:
+    void writeFrames_data();
+    void writeFrames();
+    void readFrames_data();
+    void readFrames();
+    void parseJson_data();
+    void parseJson();
+    void serializeJson_data();
+    void serializeJson();
+    void encodeMessage_data();
+    void encodeMessage();
+    void decodeMessage_data();
+    void decodeMessage();
+    void compressRoster_data();
+    void compressRoster();
+    void encodedSize_data();
+    void encodedSize();
+    void routeMessage_data();
+    void routeMessage();
+    void filterText_data();
+    void filterText();
+    void validateUtf8_data();
+    void validateUtf8();
+    void compareType_data();
+    void compareType();
+    void broadcastFanOut_data();
+    void broadcastFanOut();
+    void idleConnectionFootprint_data();
+    void idleConnectionFootprint();
+    void connectionChurn();
+    void acceptStorm_data();
+    void acceptStorm();
+    void fileTransfer_data();
+    void fileTransfer();
+    void timerWheel_data();
+    void timerWheel();
+};
+
+#endif // PROTOCOLBENCHMARK_H
@@ -1,25 +1,53 @@
 #include "chatclient.h"
+#include "protocol.h"
 
-#include <QJsonDocument>
+#include <QDataStream>
+#include <QDir>
+#include <QFileInfo>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QRandomGenerator>
+#include <QStandardPaths>
 #include <QStringLiteral>
+#include <QTimer>
+#include <algorithm>
+#include <utility>
 
 ChatClient::ChatClient(QObject *parent)
     : QObject{parent}
     , m_clientSocket(new QTcpSocket(this))
     , m_users(new QList<std::pair<QString, int>>())
     , m_loggedIn(false)
+    , m_codec(MessageCodec::Json)
+    , m_serverFeatures(0)
+    , m_userId(0)
+    , m_loginRetryTimer(new QTimer(this))
+    , m_nextMessageId(1)
+    , m_serverPort(0)
+    , m_lastSequence(0)
+    , m_reconnecting(false)
+    , m_reconnectAttempts(0)
+    , m_reconnectTimer(new QTimer(this))
+    , m_replayRemaining(0)
+    , m_nextTransferId(1)
 {
-    connect(m_clientSocket, &QTcpSocket::connected, this, &ChatClient::connected);
-    connect(m_clientSocket, &QTcpSocket::disconnected, this, &ChatClient::disconnected);
+    m_loginRetryTimer->setSingleShot(true);
+    connect(m_loginRetryTimer, &QTimer::timeout, this, [this]() {
+        login(m_userName);
+    });
 
-    connect(m_clientSocket, &QTcpSocket::readyRead, this, &ChatClient::onReadyRead);
+    m_reconnectTimer->setSingleShot(true);
+    connect(m_reconnectTimer, &QTimer::timeout, this, [this]() {
+        m_clientSocket->connectToHost(m_serverAddress, m_serverPort);
+    });
 
-    connect(m_clientSocket, &QAbstractSocket::errorOccurred, this, &ChatClient::error);
+    connect(m_clientSocket, &QTcpSocket::connected, this, &ChatClient::onConnected);
+    connect(m_clientSocket, &QTcpSocket::disconnected, this, &ChatClient::onDisconnected);
 
-    connect(m_clientSocket, &QTcpSocket::disconnected, this, [this]()->void{m_loggedIn = false;});
+    connect(m_clientSocket, &QTcpSocket::readyRead, this, &ChatClient::onReadyRead);
+    connect(m_clientSocket, &QTcpSocket::bytesWritten, this, &ChatClient::writeFileData);
 
+    connect(m_clientSocket, &QAbstractSocket::errorOccurred, this, &ChatClient::onErrorOccurred);
 }
 
 ChatClient::~ChatClient()
@@ -40,24 +68,131 @@ QString ChatClient::recipientName() const
 
 void ChatClient::connectToServer(const QHostAddress &address, qintptr port)
 {
+    m_serverAddress = address;
+    m_serverPort = quint16(port);
     m_clientSocket->connectToHost(address, port);
 }
 
-void ChatClient::login(const QString &userName)
+void ChatClient::onConnected()
+{
+    if (m_reconnecting)
+        login(m_userName);
+    else
+        emit connected();
+}
+
+// A drop we did not ask for keeps a resumable session: messages queue up
+// and the client reconnects behind the scenes
+void ChatClient::onDisconnected()
+{
+    // The server cancels them too, a resume does not bring them back
+    cancelFiles(tr("connection lost"));
+    // A resume replays payloads in full
+    m_chunkStreams.clear();
+    m_typingRecipient.clear();
+    m_loggedIn = false;
+    m_codec = MessageCodec::Json;
+    m_loginRetryTimer->stop();
+    if (!m_sessionToken.isEmpty()) {
+        if (!m_reconnecting) {
+            m_reconnecting = true;
+            m_reconnectAttempts = 0;
+            m_resumeDeadline.setRemainingTime(ResumeTimeoutMsecs);
+        }
+        scheduleReconnect();
+        return;
+    }
+    clearSession();
+    emit disconnected();
+}
+
+// Failed attempts to reconnect only lead to the next one
+void ChatClient::onErrorOccurred(QAbstractSocket::SocketError socketError)
+{
+    if (m_reconnecting) {
+        if (m_clientSocket->state() == QAbstractSocket::UnconnectedState)
+            scheduleReconnect();
+        return;
+    }
+    emit error(socketError);
+}
+
+void ChatClient::scheduleReconnect()
+{
+    if (m_reconnectTimer->isActive())
+        return;
+    if (m_resumeDeadline.hasExpired()) {
+        clearSession();
+        emit disconnected();
+        return;
+    }
+    const int delayMsecs = qMin(250 << qMin(m_reconnectAttempts, 5), MaxReconnectDelayMsecs);
+    ++m_reconnectAttempts;
+    m_reconnectTimer->start(delayMsecs + QRandomGenerator::global()->bounded(delayMsecs / 2 + 1));
+}
+
+void ChatClient::clearSession()
+{
+    m_reconnectTimer->stop();
+    m_loginRetryTimer->stop();
+    m_reconnecting = false;
+    m_sessionToken.clear();
+    m_lastSequence = 0;
+    m_replayRemaining = 0;
+    m_loggedIn = false;
+    m_codec = MessageCodec::Json;
+    m_serverFeatures = 0;
+    m_userId = 0;
+    m_userNames.clear();
+    m_userIds.clear();
+    m_users->clear();
+    emit updateUsersList(*m_users);
+    failPending();
+}
+
+void ChatClient::login(const QString &userName, const QString &password)
 {
+    if (userName != m_userName)
+        m_authToken.clear();
     m_userName = userName;
+    if (!password.isEmpty())
+        m_password = password;
     if (m_clientSocket->state() == QAbstractSocket::ConnectedState)
     {
-        QDataStream clientStream(m_clientSocket);
-
         QJsonObject message;
-        message[QStringLiteral("type")] = QStringLiteral("login");
+        message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Login);
         message[QStringLiteral("username")] = userName;
+        message[QStringLiteral("codecs")] = QJsonArray{MessageCodec::codecName(MessageCodec::Cbor)};
+        message[QStringLiteral("features")] = MessageCodec::featureNames(MessageCodec::RelayFrames
+                                                                          | MessageCodec::UserIds
+                                                                          | MessageCodec::Heartbeats
+                                                                          | MessageCodec::Acks
+                                                                          | MessageCodec::Resume
+                                                                          | MessageCodec::Chunks
+                                                                          | MessageCodec::Files
+                                                                          | MessageCodec::Compression
+                                                                          | MessageCodec::Events);
+        if (!m_password.isEmpty())
+            message[QStringLiteral("password")] = m_password;
+        if (!m_authToken.isEmpty())
+            message[QStringLiteral("authToken")] = m_authToken;
+        if (m_reconnecting && !m_sessionToken.isEmpty()) {
+            message[QStringLiteral("session")] = m_sessionToken;
+            message[QStringLiteral("lastSeq")] = qint64(m_lastSequence);
+        }
 
-        clientStream << QJsonDocument(message).toJson(QJsonDocument::Compact);
+        // Always JSON: the server picks our codec in its reply
+        m_codec = MessageCodec::Json;
+        sendJson(message);
     }
 }
 
+void ChatClient::sendJson(const QJsonObject &message)
+{
+    QDataStream clientStream(m_clientSocket);
+    clientStream << MessageCodec::encode(message, m_codec);
+}
+
 QString ChatClient::chatSelected(const QString &chatName)
 {
     QString name = "";
@@ -83,20 +218,109 @@ bool ChatClient::sendMessage(const QString &text)
         emit error(QAbstractSocket::TemporaryError);
         return false;
     }
-    QDataStream clientStream(m_clientSocket);
+    OutgoingMessage message{0, m_recipientName, text};
+    if (!(m_serverFeatures & MessageCodec::Acks)) {
+        transmit(message);
+        return true;
+    }
+    // Sent right away while the window has room, no waiting per message
+    message.id = m_nextMessageId++;
+    if (m_nextMessageId == 0)
+        m_nextMessageId = 1;
+    if (m_inFlight.size() < MaxInFlight && !m_reconnecting)
+        transmit(message);
+    else
+        m_outbox.enqueue(message);
+    return true;
+}
 
-    QJsonObject message;
-    message[QStringLiteral("sender")] = m_userName;
-    message[QStringLiteral("recipient")] = m_recipientName;
-    message[QStringLiteral("type")] = QStringLiteral("message");
-    message[QStringLiteral("text")] = text;
+void ChatClient::transmit(const OutgoingMessage &message)
+{
+    if (message.id != 0)
+        m_inFlight.insert(message.id, message);
+    const quint32 recipientId = m_userIds.value(message.recipient);
+    // Relay frames by name have no room for a message id
+    if ((m_serverFeatures & MessageCodec::RelayFrames) && (recipientId != 0 || message.id == 0)) {
+        QByteArray payload;
+        if (message.id != 0)
+            payload = MessageCodec::encodeRelay(recipientId, message.id, message.text.toUtf8());
+        else if (recipientId != 0)
+            payload = MessageCodec::encodeRelay(recipientId, message.text.toUtf8());
+        else
+            payload = MessageCodec::encodeRelay(message.recipient.toUtf8(), message.text.toUtf8());
+        // A name too long for the relay header goes as JSON
+        if (!payload.isNull()) {
+            QDataStream clientStream(m_clientSocket);
+            clientStream << payload;
+            return;
+        }
+    }
 
-    clientStream << QJsonDocument(message).toJson();
-    return true;
+    QJsonObject json;
+    if (recipientId != 0) {
+        json[QStringLiteral("recipientId")] = qint64(recipientId);
+    } else {
+        json[QStringLiteral("sender")] = m_userName;
+        json[QStringLiteral("recipient")] = message.recipient;
+    }
+    if (message.id != 0)
+        json[QStringLiteral("msgId")] = qint64(message.id);
+    json[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Message);
+    json[QStringLiteral("text")] = message.text;
+
+    sendJson(json);
+}
+
+// Delivered and failed are final, each frees a place in the window
+void ChatClient::ackReceived(const QJsonObject &docObj)
+{
+    for (const QJsonValueConstRef &idVal : docObj.value(QLatin1String("delivered")).toArray()) {
+        const quint32 messageId = quint32(idVal.toInteger());
+        if (m_inFlight.remove(messageId))
+            emit messageDelivered(messageId);
+    }
+    for (const QJsonValueConstRef &idVal : docObj.value(QLatin1String("failed")).toArray()) {
+        const quint32 messageId = quint32(idVal.toInteger());
+        const OutgoingMessage message = m_inFlight.take(messageId);
+        if (message.id != 0)
+            emit messageFailed(messageId, message.recipient, message.text);
+    }
+    while (m_inFlight.size() < MaxInFlight && !m_outbox.isEmpty())
+        transmit(m_outbox.dequeue());
+}
+
+// Whatever the server had not acknowledged before the drop goes out again,
+// in the order it was first sent
+void ChatClient::resendInFlight()
+{
+    QList<quint32> messageIds = m_inFlight.keys();
+    std::sort(messageIds.begin(), messageIds.end());
+    for (const quint32 messageId : messageIds)
+        transmit(m_inFlight.value(messageId));
+    while (m_inFlight.size() < MaxInFlight && !m_outbox.isEmpty())
+        transmit(m_outbox.dequeue());
+}
+
+void ChatClient::failPending()
+{
+    const QHash<quint32, OutgoingMessage> inFlight = std::exchange(m_inFlight, {});
+    const QQueue<OutgoingMessage> outbox = std::exchange(m_outbox, {});
+    for (const OutgoingMessage &message : inFlight)
+        emit messageFailed(message.id, message.recipient, message.text);
+    for (const OutgoingMessage &message : outbox)
+        emit messageFailed(message.id, message.recipient, message.text);
 }
 
 void ChatClient::disconnectFromHost()
 {
+    // Asked for, so the drop ends the session
+    m_sessionToken.clear();
+    if (m_reconnecting && m_clientSocket->state() != QAbstractSocket::ConnectedState) {
+        m_clientSocket->abort();
+        clearSession();
+        emit disconnected();
+        return;
+    }
     m_clientSocket->disconnectFromHost();
     m_users->clear();
     emit updateUsersList(*m_users);
@@ -115,6 +339,159 @@ void ChatClient::unreadMessages(const QString &sender, bool isClear)
     emit updateUsersList(*m_users);
 }
 
+bool ChatClient::sendFile(const QString &filePath)
+{
+    if (!m_loggedIn || !(m_serverFeatures & MessageCodec::Files))
+        return false;
+    const bool known = std::any_of(m_users->cbegin(), m_users->cend(),
+                                   [this](const std::pair<QString, int> &user) {
+                                       return user.first == m_recipientName;
+                                   });
+    if (!known)
+        return false;
+    QFile *file = new QFile(filePath, this);
+    if (!file->open(QIODevice::ReadOnly) || file->size() <= 0) {
+        delete file;
+        return false;
+    }
+    const OutgoingFile outgoing{m_nextTransferId++, m_recipientName,
+                                QFileInfo(filePath).fileName(), file, file->size()};
+    if (m_nextTransferId == 0)
+        m_nextTransferId = 1;
+
+    QJsonObject offer;
+    offer[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::FileOffer);
+    offer[QStringLiteral("transferId")] = qint64(outgoing.id);
+    const quint32 recipientId = m_userIds.value(outgoing.recipient);
+    if (recipientId != 0)
+        offer[QStringLiteral("recipientId")] = qint64(recipientId);
+    else
+        offer[QStringLiteral("recipient")] = outgoing.recipient;
+    offer[QStringLiteral("name")] = outgoing.name;
+    offer[QStringLiteral("size")] = outgoing.remaining;
+    sendJson(offer);
+    m_offeredFiles.insert(outgoing.id, outgoing);
+    return true;
+}
+
+// Accepted files queue up behind the one streaming
+void ChatClient::fileAcceptReceived(const QJsonObject &docObj)
+{
+    const quint32 transferId = quint32(docObj.value(QLatin1String("transferId")).toInteger());
+    const auto it = m_offeredFiles.find(transferId);
+    if (it == m_offeredFiles.end())
+        return;
+    m_outgoingFiles.append(it.value());
+    m_offeredFiles.erase(it);
+    writeFileData();
+}
+
+// Keeps a little file data ahead in the socket, so chat written meanwhile
+// waits behind at most that much
+void ChatClient::writeFileData()
+{
+    while (!m_outgoingFiles.isEmpty() && m_clientSocket->bytesToWrite() < FileWriteAheadBytes) {
+        OutgoingFile &outgoing = m_outgoingFiles.first();
+        const QByteArray slice = outgoing.file->read(qMin(outgoing.remaining, FileSliceBytes));
+        if (slice.isEmpty()) {
+            const OutgoingFile failed = m_outgoingFiles.takeFirst();
+            sendFileCancel(failed.id, false);
+            emit fileFailed(failed.recipient, failed.name, failed.file->errorString());
+            delete failed.file;
+            continue;
+        }
+        QDataStream clientStream(m_clientSocket);
+        clientStream << MessageCodec::encodeFileData(outgoing.id, slice);
+        outgoing.remaining -= slice.size();
+        if (outgoing.remaining == 0) {
+            const OutgoingFile sent = m_outgoingFiles.takeFirst();
+            emit fileSent(sent.recipient, sent.name);
+            delete sent.file;
+        }
+    }
+}
+
+void ChatClient::setTyping(bool typing)
+{
+    if (!m_loggedIn || !(m_serverFeatures & MessageCodec::Events))
+        return;
+    if (!typing || m_recipientName != m_typingRecipient) {
+        if (!m_typingRecipient.isEmpty())
+            sendEvent(QStringLiteral("typing"), false, m_typingRecipient);
+        m_typingRecipient.clear();
+    }
+    if (!typing || m_recipientName.isEmpty())
+        return;
+    if (m_typingRecipient == m_recipientName && !m_typingRefresh.hasExpired())
+        return;
+    sendEvent(QStringLiteral("typing"), true, m_recipientName);
+    m_typingRecipient = m_recipientName;
+    m_typingRefresh.setRemainingTime(TypingRefreshMsecs);
+}
+
+void ChatClient::setStatus(const QString &status)
+{
+    if (m_loggedIn && (m_serverFeatures & MessageCodec::Events))
+        sendEvent(QStringLiteral("status"), status, QString());
+}
+
+void ChatClient::sendEvent(const QString &kind, const QJsonValue &state, const QString &recipient)
+{
+    QJsonObject event;
+    event[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Event);
+    event[QStringLiteral("kind")] = kind;
+    event[QStringLiteral("state")] = state;
+    const quint32 recipientId = m_userIds.value(recipient);
+    if (recipientId != 0)
+        event[QStringLiteral("recipientId")] = qint64(recipientId);
+    else if (!recipient.isEmpty())
+        event[QStringLiteral("recipient")] = recipient;
+    sendJson(event);
+}
+
+void ChatClient::eventReceived(const QJsonObject &docObj)
+{
+    const QJsonValue senderIdVal = docObj.value(QLatin1String("senderId"));
+    const QString sender = senderIdVal.isDouble()
+                               ? m_userNames.value(quint32(senderIdVal.toInteger()))
+                               : docObj.value(QLatin1String("sender")).toString();
+    if (sender.isEmpty())
+        return;
+    const QString kind = docObj.value(QLatin1String("kind")).toString();
+    const QJsonValue state = docObj.value(QLatin1String("state"));
+    if (kind == QLatin1String("typing"))
+        emit typingChanged(sender, state.toBool());
+    else if (kind == QLatin1String("status"))
+        emit statusChanged(sender, state.toString());
+}
+
+void ChatClient::sendFileCancel(quint32 transferId, bool incoming)
+{
+    QJsonObject message;
+    message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::FileCancel);
+    message[QStringLiteral("transferId")] = qint64(transferId);
+    if (incoming)
+        message[QStringLiteral("incoming")] = true;
+    sendJson(message);
+}
+
+void ChatClient::cancelFiles(const QString &reason)
+{
+    QList<OutgoingFile> outgoingFiles = std::exchange(m_outgoingFiles, {});
+    outgoingFiles += std::exchange(m_offeredFiles, {}).values();
+    for (const OutgoingFile &outgoing : outgoingFiles) {
+        emit fileFailed(outgoing.recipient, outgoing.name, reason);
+        delete outgoing.file;
+    }
+    const QHash<quint32, IncomingFile> incomingFiles = std::exchange(m_incomingFiles, {});
+    for (const IncomingFile &incoming : incomingFiles) {
+        if (incoming.file)
+            incoming.file->remove();
+        emit fileFailed(incoming.sender, incoming.name, reason);
+        delete incoming.file;
+    }
+}
+
 void ChatClient::onReadyRead()
 {
     QByteArray jsonData;
@@ -126,22 +503,73 @@ void ChatClient::onReadyRead()
 
         socketStream >> jsonData;
         if (socketStream.commitTransaction()) {
-
-            QJsonParseError parseError;
-
-            const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData, &parseError);
-            if (parseError.error == QJsonParseError::NoError)
-                if(jsonDoc.isObject())
-                    jsonReceived(jsonDoc.object());
+            MessageCodec::Chunk chunk;
+            if (MessageCodec::decodeChunk(jsonData, &chunk)) {
+                QByteArray &stream = m_chunkStreams[chunk.stream];
+                stream.append(chunk.data);
+                if (!chunk.last)
+                    continue;
+                jsonData = std::exchange(stream, QByteArray());
+            }
+            // Counted once handled, a resume replays from the next one
+            const bool numbered = m_loggedIn && (m_serverFeatures & MessageCodec::Resume)
+                                  && !MessageCodec::isEphemeral(jsonData)
+                                  && !MessageCodec::isFileData(jsonData);
+            frameReceived(jsonData);
+            if (numbered) {
+                ++m_lastSequence;
+                if (m_replayRemaining > 0 && --m_replayRemaining == 0)
+                    resendInFlight();
+            }
         } else
             break;
     }
 }
 
-void ChatClient::usersInit(const QJsonArray &usersArray)
+void ChatClient::frameReceived(const QByteArray &payload)
 {
-    for (const QJsonValueConstRef &userName : usersArray) {
-        QString name = userName.toString();
+    if (MessageCodec::isCompressed(payload)) {
+        QByteArray original;
+        if (MessageCodec::uncompress(payload, &original))
+            frameReceived(original);
+        return;
+    }
+    if (MessageCodec::isEphemeral(payload)) {
+        bool decoded = false;
+        const QJsonObject message = MessageCodec::decodeEphemeral(payload, &decoded);
+        if (decoded && m_loggedIn)
+            jsonReceived(message);
+        return;
+    }
+    MessageCodec::FileData fileData;
+    if (MessageCodec::decodeFileData(payload, &fileData)) {
+        fileDataReceived(fileData);
+        return;
+    }
+    MessageCodec::RelayFrame relayFrame;
+    if (MessageCodec::decodeRelay(payload, &relayFrame)) {
+        if (!m_loggedIn)
+            return;
+        const QString sender = relayFrame.peerId != 0
+                                   ? m_userNames.value(relayFrame.peerId)
+                                   : QString::fromUtf8(relayFrame.peer);
+        if (!sender.isEmpty())
+            emit messageReceived(sender, QString::fromUtf8(relayFrame.text));
+        return;
+    }
+
+    bool decoded = false;
+
+    const QJsonObject message = MessageCodec::decode(payload, &decoded);
+    if (decoded)
+        jsonReceived(message);
+}
+
+void ChatClient::usersInit(const QJsonArray &usersArray, const QJsonArray &idsArray)
+{
+    for (qsizetype i = 0; i < usersArray.size(); ++i) {
+        QString name = usersArray.at(i).toString();
+        addUserId(idsArray.at(i), name);
         if (name == m_userName)
             continue;
         std::pair<QString, int> user = std::make_pair(name, 0);
@@ -150,73 +578,303 @@ void ChatClient::usersInit(const QJsonArray &usersArray)
     emit updateUsersList(*m_users);
 }
 
+void ChatClient::addUserId(const QJsonValue &idVal, const QString &userName)
+{
+    const quint32 userId = quint32(idVal.toInteger());
+    if (userId == 0 || userName.isEmpty())
+        return;
+    m_userNames.insert(userId, userName);
+    m_userIds.insert(userName, userId);
+}
 
 void ChatClient::jsonReceived(const QJsonObject &docObj)
 {
+    using Handler = void (ChatClient::*)(const QJsonObject &);
+    using HandlerTable = std::array<Handler, Protocol::MessageTypeCount>;
+    static constexpr HandlerTable handlers = [] {
+        HandlerTable handlers{};
+        handlers[int(Protocol::MessageType::Login)] = &ChatClient::loginReceived;
+        handlers[int(Protocol::MessageType::NewUser)] = &ChatClient::userJoined;
+        handlers[int(Protocol::MessageType::UserDisconnected)] = &ChatClient::userLeft;
+        handlers[int(Protocol::MessageType::Message)] = &ChatClient::textReceived;
+        handlers[int(Protocol::MessageType::Ping)] = &ChatClient::pingReceived;
+        handlers[int(Protocol::MessageType::Ack)] = &ChatClient::ackReceived;
+        handlers[int(Protocol::MessageType::FileOffer)] = &ChatClient::fileOfferReceived;
+        handlers[int(Protocol::MessageType::FileAccept)] = &ChatClient::fileAcceptReceived;
+        handlers[int(Protocol::MessageType::FileCancel)] = &ChatClient::fileCancelReceived;
+        handlers[int(Protocol::MessageType::Event)] = &ChatClient::eventReceived;
+        return handlers;
+    }();
+
     const QJsonValue typeVal = docObj.value(QLatin1String("type"));
     if (typeVal.isNull() || !typeVal.isString())
         return;
+    const Protocol::MessageType type = Protocol::messageType(typeVal.toString());
+    if (type == Protocol::MessageType::Unknown)
+        return;
+    if (const Handler handler = handlers[int(type)])
+        (this->*handler)(docObj);
+}
 
-    // login
-    if (typeVal.toString().compare(QLatin1String("login"), Qt::CaseInsensitive) == 0)
-    {
-        if (m_loggedIn) return;
+void ChatClient::loginReceived(const QJsonObject &docObj)
+{
+    if (m_loggedIn) return;
 
-        const QJsonValue resVal = docObj.value(QLatin1String("success"));
-        if (resVal.isNull() || !resVal.isBool())
+    const QJsonValue resVal = docObj.value(QLatin1String("success"));
+    if (resVal.isNull() || !resVal.isBool())
+        return;
+    const bool loginSuccess = resVal.toBool();
+    if (loginSuccess)
+    {
+        // A resumed session keeps the roster we have, anything else starts
+        // over from the one in the reply
+        const bool resumed = docObj.value(QLatin1String("resumed")).toBool();
+        const QJsonValue arrayVal = docObj.value(QLatin1String("users"));
+        if (!resumed && (arrayVal.isNull() || !arrayVal.isArray()))
             return;
-        const bool loginSuccess = resVal.toBool();
-        if (loginSuccess)
-        {
-            const QJsonValue arrayVal = docObj.value(QLatin1String("users"));
-            if (arrayVal.isNull() || !arrayVal.isArray())
-                return;
-            usersInit(arrayVal.toArray());
+        m_userId = quint32(docObj.value(QLatin1String("id")).toInteger());
+        if (!resumed) {
+            m_users->clear();
+            m_userNames.clear();
+            m_userIds.clear();
+            m_lastSequence = 0;
+            usersInit(arrayVal.toArray(), docObj.value(QLatin1String("userIds")).toArray());
+        }
 
-            m_loggedIn = true;
-            emit loggedIn();
+        const QJsonValue codecVal = docObj.value(QLatin1String("codec"));
+        if (codecVal.isString())
+            m_codec = MessageCodec::codecFromName(codecVal.toString());
+        m_serverFeatures = MessageCodec::featuresFromNames(
+            docObj.value(QLatin1String("features")).toArray());
+        m_sessionToken = docObj.value(QLatin1String("session")).toString();
+        const QJsonValue authTokenVal = docObj.value(QLatin1String("authToken"));
+        if (authTokenVal.isString())
+            m_authToken = authTokenVal.toString();
+        m_password.clear();
+        const bool reconnected = std::exchange(m_reconnecting, false);
+
+        m_loggedIn = true;
+        if (resumed) {
+            // Acks for what is in flight may be among the replayed frames
+            m_replayRemaining = docObj.value(QLatin1String("replayed")).toInt();
+            if (m_replayRemaining == 0)
+                resendInFlight();
             return;
         }
+        if (reconnected)
+            resendInFlight();
+        emit loggedIn();
+        return;
+    }
 
-        const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
-        m_loggedIn = false;
-        emit loginError(reasonVal.toString());
+    // Spread over half the delay again, so clients turned away together do
+    // not all come back at the same moment
+    const QJsonValue retryVal = docObj.value(QLatin1String("retryAfter"));
+    if (retryVal.isDouble()) {
+        const int retryMsecs = qBound(0, retryVal.toInt(), 10 * 60 * 1000);
+        m_loginRetryTimer->start(retryMsecs + QRandomGenerator::global()->bounded(retryMsecs / 2 + 1));
+        return;
+    }
 
-    // userJoined
-    } else if (typeVal.toString().compare(QLatin1String("new user"), Qt::CaseInsensitive) == 0) {
-        const QJsonValue usernameVal = docObj.value(QLatin1String("username"));
-        if (usernameVal.isNull() || !usernameVal.isString())
-            return;
+    const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
+    // Our name was taken while we were away: the session is over and the
+    // user picks another name on this connection
+    if (m_reconnecting)
+        clearSession();
+    m_loggedIn = false;
+    m_password.clear();
+    m_authToken.clear();
+    emit loginError(reasonVal.toString());
+}
 
-        std::pair<QString, int> user = std::make_pair(usernameVal.toString(), 0);
-        m_users->push_back(user);
+void ChatClient::userJoined(const QJsonObject &docObj)
+{
+    const QJsonValue usernameVal = docObj.value(QLatin1String("username"));
+    if (usernameVal.isNull() || !usernameVal.isString())
+        return;
 
-        emit updateUsersList(*m_users);
+    std::pair<QString, int> user = std::make_pair(usernameVal.toString(), 0);
+    m_users->push_back(user);
+    addUserId(docObj.value(QLatin1String("id")), user.first);
 
-    // userLeft
-    } else if (typeVal.toString().compare(QLatin1String("user disconnected"), Qt::CaseInsensitive) == 0) {
-        const QJsonValue usernameVal = docObj.value(QLatin1String("username"));
-        if (usernameVal.isNull() || !usernameVal.isString())
-            return;
+    emit updateUsersList(*m_users);
+}
 
-        for (const std::pair<QString, int> &pair : *m_users) {
-            if (pair.first == usernameVal.toString()) {
-                m_users->removeAll(pair);
-                break;
-            }
+void ChatClient::userLeft(const QJsonObject &docObj)
+{
+    const QJsonValue usernameVal = docObj.value(QLatin1String("username"));
+    if (usernameVal.isNull() || !usernameVal.isString())
+        return;
+
+    // The id keeps its name: the server sends presence ahead of chat, so
+    // messages from the user may still be on their way
+    const QString userName = usernameVal.toString();
+    m_userIds.remove(userName);
+    for (const std::pair<QString, int> &pair : *m_users) {
+        if (pair.first == userName) {
+            m_users->removeAll(pair);
+            break;
         }
+    }
 
-        emit updateUsersList(*m_users);
+    emit updateUsersList(*m_users);
+}
 
-    // message
-    } else if (typeVal.toString().compare(QLatin1String("message"), Qt::CaseInsensitive) == 0) {
-        const QJsonValue textVal = docObj.value(QLatin1String("text"));
-        const QJsonValue senderVal = docObj.value(QLatin1String("sender"));
-        if (textVal.isNull() || !textVal.isString())
-            return;
-        if (senderVal.isNull() || !senderVal.isString())
-            return;
-        emit messageReceived(senderVal.toString(), textVal.toString());
+// The server pings when we have been quiet for a while and drops us if no
+// answer comes
+void ChatClient::pingReceived(const QJsonObject &docObj)
+{
+    Q_UNUSED(docObj)
+    QJsonObject message;
+    message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Pong);
+    sendJson(message);
+}
+
+void ChatClient::textReceived(const QJsonObject &docObj)
+{
+    const QJsonValue textVal = docObj.value(QLatin1String("text"));
+    if (textVal.isNull() || !textVal.isString())
+        return;
+    const QJsonValue senderIdVal = docObj.value(QLatin1String("senderId"));
+    if (senderIdVal.isDouble()) {
+        const QString sender = m_userNames.value(quint32(senderIdVal.toInteger()));
+        if (!sender.isEmpty())
+            emit messageReceived(sender, textVal.toString());
+        return;
+    }
+    const QJsonValue senderVal = docObj.value(QLatin1String("sender"));
+    if (senderVal.isNull() || !senderVal.isString())
+        return;
+    emit messageReceived(senderVal.toString(), textVal.toString());
+}
+
+// Offers that fit within MaxIncomingBytes are put to the user, the rest are
+// declined right away
+void ChatClient::fileOfferReceived(const QJsonObject &docObj)
+{
+    const quint32 transferId = quint32(docObj.value(QLatin1String("transferId")).toInteger());
+    const qint64 size = docObj.value(QLatin1String("size")).toInteger();
+    if (transferId == 0 || size <= 0 || m_incomingFiles.contains(transferId))
+        return;
+    const QJsonValue senderIdVal = docObj.value(QLatin1String("senderId"));
+    const QString sender = senderIdVal.isDouble()
+                               ? m_userNames.value(quint32(senderIdVal.toInteger()))
+                               : docObj.value(QLatin1String("sender")).toString();
+    QString name = QFileInfo(docObj.value(QLatin1String("name")).toString()).fileName();
+    if (name.isEmpty())
+        name = QStringLiteral("attachment");
+    qint64 incomingBytes = 0;
+    for (const IncomingFile &incoming : qAsConst(m_incomingFiles))
+        incomingBytes += incoming.remaining;
+    if (size > MaxIncomingBytes - incomingBytes) {
+        sendFileCancel(transferId, true);
+        emit fileFailed(sender, name, tr("file too large"));
+        return;
+    }
+    m_incomingFiles.insert(transferId, IncomingFile{sender, name, nullptr, size});
+    emit fileOffered(transferId, sender, name, size);
+}
+
+// The file goes to the downloads folder under its own name, numbered if
+// that is taken
+void ChatClient::acceptFile(quint32 transferId)
+{
+    const auto it = m_incomingFiles.find(transferId);
+    // Cancelled by the sender meanwhile, or answered already
+    if (it == m_incomingFiles.end() || it->file)
+        return;
+    const QString name = it->name;
+    const QDir directory(QStandardPaths::writableLocation(QStandardPaths::DownloadLocation));
+    directory.mkpath(QStringLiteral("."));
+    const QFileInfo nameInfo(name);
+    QString filePath = directory.filePath(name);
+    for (int copy = 1; QFileInfo::exists(filePath); ++copy) {
+        QString numbered = nameInfo.completeBaseName() + QStringLiteral(" (%1)").arg(copy);
+        if (!nameInfo.suffix().isEmpty())
+            numbered += QLatin1Char('.') + nameInfo.suffix();
+        filePath = directory.filePath(numbered);
+    }
+    QFile *file = new QFile(filePath, this);
+    if (!file->open(QIODevice::WriteOnly)) {
+        const IncomingFile failed = m_incomingFiles.take(transferId);
+        sendFileCancel(transferId, true);
+        emit fileFailed(failed.sender, failed.name, file->errorString());
+        delete file;
+        return;
     }
+    it->file = file;
+    QJsonObject message;
+    message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::FileAccept);
+    message[QStringLiteral("transferId")] = qint64(transferId);
+    sendJson(message);
+}
 
+void ChatClient::declineFile(quint32 transferId)
+{
+    const auto it = m_incomingFiles.find(transferId);
+    if (it == m_incomingFiles.end() || it->file)
+        return;
+    m_incomingFiles.erase(it);
+    sendFileCancel(transferId, true);
+}
+
+void ChatClient::fileDataReceived(const MessageCodec::FileData &fileData)
+{
+    const auto it = m_incomingFiles.find(fileData.transferId);
+    // Cancelled on our side
+    if (it == m_incomingFiles.end())
+        return;
+    IncomingFile &incoming = it.value();
+    // Data for an offer we have not accepted counts as too much, too
+    const bool overrun = !incoming.file || fileData.data.size() > incoming.remaining;
+    if (overrun
+        || incoming.file->write(fileData.data.data(), fileData.data.size()) != fileData.data.size()) {
+        const IncomingFile failed = m_incomingFiles.take(fileData.transferId);
+        sendFileCancel(fileData.transferId, true);
+        emit fileFailed(failed.sender, failed.name,
+                        overrun ? tr("more data than offered") : failed.file->errorString());
+        if (failed.file)
+            failed.file->remove();
+        delete failed.file;
+        return;
+    }
+    incoming.remaining -= fileData.data.size();
+    if (incoming.remaining > 0)
+        return;
+    const IncomingFile received = m_incomingFiles.take(fileData.transferId);
+    received.file->close();
+    emit fileReceived(received.sender, received.file->fileName());
+    delete received.file;
+}
+
+void ChatClient::fileCancelReceived(const QJsonObject &docObj)
+{
+    const quint32 transferId = quint32(docObj.value(QLatin1String("transferId")).toInteger());
+    const QString reason = docObj.value(QLatin1String("reason")).toString();
+    if (docObj.value(QLatin1String("incoming")).toBool()) {
+        const auto it = m_incomingFiles.constFind(transferId);
+        if (it == m_incomingFiles.cend())
+            return;
+        const IncomingFile cancelled = *it;
+        m_incomingFiles.erase(it);
+        if (cancelled.file)
+            cancelled.file->remove();
+        emit fileFailed(cancelled.sender, cancelled.name, reason);
+        delete cancelled.file;
+        return;
+    }
+    if (m_offeredFiles.contains(transferId)) {
+        const OutgoingFile cancelled = m_offeredFiles.take(transferId);
+        emit fileFailed(cancelled.recipient, cancelled.name, reason);
+        delete cancelled.file;
+        return;
+    }
+    for (qsizetype i = 0; i < m_outgoingFiles.size(); ++i) {
+        if (m_outgoingFiles.at(i).id != transferId)
+            continue;
+        const OutgoingFile cancelled = m_outgoingFiles.takeAt(i);
+        emit fileFailed(cancelled.recipient, cancelled.name, reason);
+        delete cancelled.file;
+        return;
+    }
 }
@@ -1,14 +1,25 @@
 #ifndef CHATCLIENT_H
 #define CHATCLIENT_H
 
+#include "messagecodec.h"
+#include <QDeadlineTimer>
+#include <QFile>
+#include <QHash>
+#include <QHostAddress>
 #include <QObject>
+#include <QQueue>
 #include <QTcpSocket>
-class QHostAddress;
+class QTimer;
 
 class ChatClient : public QObject
 {
     Q_OBJECT
 public:
+    // Typing is refreshed this often while it goes on; events may be
+    // dropped, so a typing state not refreshed in time is over
+    static constexpr int TypingRefreshMsecs = 3000;
+    static constexpr int TypingExpiryMsecs = 2 * TypingRefreshMsecs;
+
     explicit ChatClient(QObject *parent = nullptr);
     ~ChatClient();
     QString userName() const;
@@ -17,30 +28,155 @@ public:
 
 public slots:
     void connectToServer(const QHostAddress &address, qintptr port);
-    void login(const QString &userName);
+    // Servers that check credentials want the password once; later logins
+    // go by the token the server gave back. An empty password keeps the
+    // last one.
+    void login(const QString &userName, const QString &password = QString());
     QString chatSelected(const QString &chatName);
     bool sendMessage(const QString &text);
+    // To the selected recipient, if the server takes files. The data goes
+    // out once the recipient accepted.
+    bool sendFile(const QString &filePath);
+    // Answers to fileOffered(); an accepted file is written to the
+    // downloads folder as it arrives
+    void acceptFile(quint32 transferId);
+    void declineFile(quint32 transferId);
+    // To the selected recipient, and a status to everyone, if the server
+    // takes events
+    void setTyping(bool typing);
+    void setStatus(const QString &status);
     void disconnectFromHost();
     void unreadMessages(const QString &sender, bool isClear);
 
 private slots:
     void onReadyRead();
+    void onConnected();
+    void onDisconnected();
+    void onErrorOccurred(QAbstractSocket::SocketError socketError);
+    void writeFileData();
 signals:
     void connected();
     void loggedIn();
     void loginError(const QString &reason);
     void disconnected();
     void messageReceived(const QString &sender, const QString &text);
+    // Only for servers that acknowledge messages; messages still in flight
+    // when the connection drops have failed
+    void messageDelivered(quint32 messageId);
+    void messageFailed(quint32 messageId, const QString &recipient, const QString &text);
+    // Nothing is written until the offer is accepted or declined
+    void fileOffered(quint32 transferId, const QString &sender, const QString &fileName,
+                     qint64 size);
+    void fileReceived(const QString &sender, const QString &filePath);
+    void fileSent(const QString &recipient, const QString &fileName);
+    void fileFailed(const QString &peer, const QString &fileName, const QString &reason);
+    void typingChanged(const QString &sender, bool typing);
+    void statusChanged(const QString &sender, const QString &status);
     void error(QAbstractSocket::SocketError socekError);
     void updateUsersList(const QList<std::pair<QString, int>> &userNames);
 private:
     QTcpSocket *m_clientSocket;
     QString m_userName;
+    // Only until the server lets us in
+    QString m_password;
+    QString m_authToken;
     QString m_recipientName;
     QList<std::pair<QString, int>> *m_users;
     bool m_loggedIn;
+    MessageCodec::Codec m_codec;
+    int m_serverFeatures;
+    // Ids the server assigned at login, when it speaks the UserIds feature
+    quint32 m_userId;
+    QHash<quint32, QString> m_userNames;
+    QHash<QString, quint32> m_userIds;
+    // Logs in again when a busy server asked us to retry later
+    QTimer *m_loginRetryTimer;
+    struct OutgoingMessage
+    {
+        quint32 id;
+        QString recipient;
+        QString text;
+    };
+    // Up to this many messages wait for their ack at once, the rest queue
+    static constexpr int MaxInFlight = 64;
+    quint32 m_nextMessageId;
+    QHash<quint32, OutgoingMessage> m_inFlight;
+    QQueue<OutgoingMessage> m_outbox;
+    // A server that agreed on Resume gets us back into our session after
+    // the connection drops: the frames it numbered since the login reply
+    // are counted, and we reconnect with the session token and that count
+    // for a while before giving up
+    static constexpr int ResumeTimeoutMsecs = 60 * 1000;
+    static constexpr int MaxReconnectDelayMsecs = 8000;
+    QHostAddress m_serverAddress;
+    quint16 m_serverPort;
+    QString m_sessionToken;
+    quint64 m_lastSequence;
+    bool m_reconnecting;
+    int m_reconnectAttempts;
+    QDeadlineTimer m_resumeDeadline;
+    QTimer *m_reconnectTimer;
+    // Replayed frames still to come before in-flight messages are sent again
+    int m_replayRemaining;
+    // Payloads the server is sending in chunks, by stream
+    QHash<quint8, QByteArray> m_chunkStreams;
+    // Files go out one slice at a time as the socket drains, and come in
+    // straight to disk, so neither end holds a whole file in memory
+    static constexpr qint64 FileSliceBytes = 64 * 1024;
+    static constexpr qint64 FileWriteAheadBytes = 256 * 1024;
+    // Offers beyond this many bytes still to come across all incoming
+    // files are turned down, and no file may run past its offered size
+    static constexpr qint64 MaxIncomingBytes = 512 * 1024 * 1024;
+    struct OutgoingFile
+    {
+        quint32 id;
+        QString recipient;
+        QString name;
+        QFile *file;
+        qint64 remaining;
+    };
+    struct IncomingFile
+    {
+        QString sender;
+        QString name;
+        // Null until the offer is accepted
+        QFile *file;
+        qint64 remaining;
+    };
+    quint32 m_nextTransferId;
+    // Offers the recipient has not accepted yet, by our transfer id
+    QHash<quint32, OutgoingFile> m_offeredFiles;
+    // Accepted ones, sent in order, the first one is streaming
+    QList<OutgoingFile> m_outgoingFiles;
+    // By the server's transfer id
+    QHash<quint32, IncomingFile> m_incomingFiles;
+    void fileOfferReceived(const QJsonObject &docObj);
+    void fileAcceptReceived(const QJsonObject &docObj);
+    void fileCancelReceived(const QJsonObject &docObj);
+    void fileDataReceived(const MessageCodec::FileData &fileData);
+    void sendFileCancel(quint32 transferId, bool incoming);
+    void cancelFiles(const QString &reason);
+    // Who was last told we are typing, empty once told we stopped
+    QString m_typingRecipient;
+    QDeadlineTimer m_typingRefresh;
+    void sendEvent(const QString &kind, const QJsonValue &state, const QString &recipient);
+    void eventReceived(const QJsonObject &docObj);
+    void frameReceived(const QByteArray &payload);
+    void scheduleReconnect();
+    void resendInFlight();
+    void clearSession();
+    void transmit(const OutgoingMessage &message);
+    void ackReceived(const QJsonObject &docObj);
+    void failPending();
+    void sendJson(const QJsonObject &message);
     void jsonReceived(const QJsonObject &doc);
-    void usersInit(const QJsonArray &usersArray);
+    void loginReceived(const QJsonObject &docObj);
+    void userJoined(const QJsonObject &docObj);
+    void userLeft(const QJsonObject &docObj);
+    void textReceived(const QJsonObject &docObj);
+    void pingReceived(const QJsonObject &docObj);
+    void usersInit(const QJsonArray &usersArray, const QJsonArray &idsArray);
+    void addUserId(const QJsonValue &idVal, const QString &userName);
 };
 
 #endif // CHATCLIENT_H
@@ -2,10 +2,15 @@
 #include "clientwindow.h"
 #include "qmessagebox.h"
 #include "ui_clientwindow.h"
+#include <QColor>
+#include <QDir>
+#include <QFileDialog>
+#include <QFileInfo>
 #include <QStandardItemModel>
 #include <QInputDialog>
 #include <QStringLiteral>
 #include <QMap>
+#include <QTimer>
 
 ClientWindow::ClientWindow(QWidget *parent)
     : QWidget(parent)
@@ -13,8 +18,17 @@ ClientWindow::ClientWindow(QWidget *parent)
     , m_chatClient(new ChatClient(this))
     , m_chatModels(new QMap<QString, QStandardItemModel *>())
     , m_usersModel(new QStringListModel(this))
+    , m_typingIdleTimer(new QTimer(this))
+    , m_peerStateTimer(new QTimer(this))
 {
     ui->setupUi(this);
+    m_typingIdleTimer->setSingleShot(true);
+    m_typingIdleTimer->setInterval(ChatClient::TypingRefreshMsecs);
+    m_peerStateTimer->setSingleShot(true);
+    connect(m_typingIdleTimer, &QTimer::timeout, m_chatClient, [this]() {
+        m_chatClient->setTyping(false);
+    });
+    connect(m_peerStateTimer, &QTimer::timeout, this, &ClientWindow::updatePeerState);
 
     ui->usersView->setModel(m_usersModel);
 
@@ -22,6 +36,13 @@ ClientWindow::ClientWindow(QWidget *parent)
     connect(m_chatClient, &ChatClient::loggedIn, this, &ClientWindow::loggedIn);
     connect(m_chatClient, &ChatClient::loginError, this, &ClientWindow::loginFailed);
     connect(m_chatClient, &ChatClient::messageReceived, this, &ClientWindow::messageReceived);
+    connect(m_chatClient, &ChatClient::messageFailed, this, &ClientWindow::messageFailed);
+    connect(m_chatClient, &ChatClient::fileOffered, this, &ClientWindow::fileOffered);
+    connect(m_chatClient, &ChatClient::fileReceived, this, &ClientWindow::fileReceived);
+    connect(m_chatClient, &ChatClient::fileSent, this, &ClientWindow::fileSent);
+    connect(m_chatClient, &ChatClient::fileFailed, this, &ClientWindow::fileFailed);
+    connect(m_chatClient, &ChatClient::typingChanged, this, &ClientWindow::typingChanged);
+    connect(m_chatClient, &ChatClient::statusChanged, this, &ClientWindow::statusChanged);
     connect(m_chatClient, &ChatClient::disconnected, this, &ClientWindow::disconnectedFromServer);
     connect(m_chatClient, &ChatClient::error, this, &ClientWindow::error);
 
@@ -31,6 +52,11 @@ ClientWindow::ClientWindow(QWidget *parent)
 
     connect(ui->sendButton, &QPushButton::clicked, this, &ClientWindow::sendMessage);
     connect(ui->messageEdit, &QLineEdit::returnPressed, this, &ClientWindow::sendMessage);
+    connect(ui->messageEdit, &QLineEdit::textEdited, this, &ClientWindow::messageEdited);
+    connect(ui->statusEdit, &QLineEdit::editingFinished, m_chatClient, [this]() {
+        m_chatClient->setStatus(ui->statusEdit->text());
+    });
+    connect(ui->fileButton, &QPushButton::clicked, this, &ClientWindow::sendFile);
 
     connect(ui->usersView, &QListView::clicked, this, &ClientWindow::openChat);
 }
@@ -86,14 +112,20 @@ void ClientWindow::connectedToServer()
         this, tr("Chose Username"), tr("Username"));
     if (newUsername.isEmpty())
         return m_chatClient->disconnectFromHost();
+    // Left empty for servers that let anyone in
+    bool ok = false;
+    const QString password = QInputDialog::getText(
+        this, tr("Chose Username"), tr("Password"), QLineEdit::Password, QString(), &ok);
+    if (!ok)
+        return m_chatClient->disconnectFromHost();
 
-    attemptLogin(newUsername);
+    attemptLogin(newUsername, password);
 
 }
 
-void ClientWindow::attemptLogin(const QString &userName)
+void ClientWindow::attemptLogin(const QString &userName, const QString &password)
 {
-    m_chatClient->login(userName);
+    m_chatClient->login(userName, password);
     ui->nameLabel->setText(userName);
 }
 
@@ -104,6 +136,8 @@ void ClientWindow::openChat(const QModelIndex &index)
     QString userName = m_chatClient->chatSelected(chatName);
     if (!userName.isEmpty())
     {
+        // Tells the previous peer we stopped
+        m_chatClient->setTyping(false);
         m_chatClient->unreadMessages(userName, true);
         ui->recepientLabel->setText(userName);
         if (!m_chatModels->keys().contains(userName)) {
@@ -117,7 +151,9 @@ void ClientWindow::openChat(const QModelIndex &index)
         ui->messageEdit->setEnabled(true);
         ui->messageEdit->clear();
         ui->sendButton->setEnabled(true);
+        ui->fileButton->setEnabled(true);
         ui->chatView->setEnabled(true);
+        updatePeerState();
         return;
     }
     QMessageBox::critical(this, tr("Error"), "Can't find user with name " + chatName);
@@ -125,6 +161,9 @@ void ClientWindow::openChat(const QModelIndex &index)
 
 void ClientWindow::loggedIn()
 {
+    ui->statusEdit->setEnabled(true);
+    if (!ui->statusEdit->text().isEmpty())
+        m_chatClient->setStatus(ui->statusEdit->text());
     ui->connectionBox->setCheckState(Qt::Checked);
     ui->connectionBox->setEnabled(true);
 }
@@ -181,7 +220,121 @@ void ClientWindow::sendMessage()
 
         ui->messageEdit->clear();
         ui->chatView->scrollToBottom();
+        m_typingIdleTimer->stop();
+        m_chatClient->setTyping(false);
+    }
+}
+
+void ClientWindow::messageEdited(const QString &text)
+{
+    m_chatClient->setTyping(!text.isEmpty());
+    if (text.isEmpty())
+        m_typingIdleTimer->stop();
+    else
+        m_typingIdleTimer->start();
+}
+
+void ClientWindow::typingChanged(const QString &sender, bool typing)
+{
+    if (typing)
+        m_typingUntil.insert(sender, QDeadlineTimer(ChatClient::TypingExpiryMsecs));
+    else
+        m_typingUntil.remove(sender);
+    if (sender == ui->recepientLabel->text())
+        updatePeerState();
+}
+
+void ClientWindow::statusChanged(const QString &sender, const QString &status)
+{
+    m_peerStatus.insert(sender, status);
+    if (sender == ui->recepientLabel->text())
+        updatePeerState();
+}
+
+void ClientWindow::updatePeerState()
+{
+    const QString peer = ui->recepientLabel->text();
+    const auto typing = m_typingUntil.constFind(peer);
+    if (typing != m_typingUntil.cend() && !typing->hasExpired()) {
+        ui->peerStateLabel->setText(tr("%1 is typing...").arg(peer));
+        m_peerStateTimer->start(typing->remainingTime());
+        return;
+    }
+    m_typingUntil.remove(peer);
+    m_peerStateTimer->stop();
+    ui->peerStateLabel->setText(m_peerStatus.value(peer));
+}
+
+void ClientWindow::messageFailed(quint32 messageId, const QString &recipient, const QString &text)
+{
+    Q_UNUSED(messageId)
+    appendNote(recipient, tr("Not delivered: %1").arg(text), Qt::AlignRight, QColor(Qt::red));
+}
+
+void ClientWindow::sendFile()
+{
+    const QString filePath = QFileDialog::getOpenFileName(this, tr("Send File"));
+    if (filePath.isEmpty())
+        return;
+    if (!m_chatClient->sendFile(filePath)) {
+        QMessageBox::warning(this, tr("Error"), tr("Could not send %1").arg(filePath));
+        return;
     }
+    appendNote(ui->recepientLabel->text(),
+               tr("Sending %1...").arg(QFileInfo(filePath).fileName()), Qt::AlignRight,
+               QColor(Qt::gray));
+}
+
+// The name comes from the sender, so the user sees it before anything is
+// written
+void ClientWindow::fileOffered(quint32 transferId, const QString &sender, const QString &fileName,
+                               qint64 size)
+{
+    const QString sizeText = locale().formattedDataSize(size);
+    const QMessageBox::StandardButton answer = QMessageBox::question(
+        this, tr("Incoming File"),
+        tr("%1 wants to send you %2 (%3). Save it to your downloads folder?")
+            .arg(sender, fileName, sizeText));
+    if (answer != QMessageBox::Yes) {
+        m_chatClient->declineFile(transferId);
+        appendNote(sender, tr("Declined %1").arg(fileName), Qt::AlignLeft, QColor(Qt::gray));
+        return;
+    }
+    m_chatClient->acceptFile(transferId);
+    appendNote(sender, tr("Receiving %1 (%2)...").arg(fileName, sizeText), Qt::AlignLeft,
+               QColor(Qt::gray));
+}
+
+void ClientWindow::fileReceived(const QString &sender, const QString &filePath)
+{
+    messageReceived(sender, tr("Sent you %1").arg(QDir::toNativeSeparators(filePath)));
+}
+
+void ClientWindow::fileSent(const QString &recipient, const QString &fileName)
+{
+    appendNote(recipient, tr("Sent %1").arg(fileName), Qt::AlignRight, QColor(Qt::gray));
+}
+
+void ClientWindow::fileFailed(const QString &peer, const QString &fileName, const QString &reason)
+{
+    appendNote(peer, tr("Transfer of %1 failed: %2").arg(fileName, reason), Qt::AlignRight,
+               QColor(Qt::red));
+}
+
+void ClientWindow::appendNote(const QString &peer, const QString &text, Qt::Alignment alignment,
+                              const QColor &color)
+{
+    // Chats are already gone if the connection dropped
+    QStandardItemModel *chatModel = m_chatModels->value(peer);
+    if (!chatModel)
+        return;
+    const int newRow = chatModel->rowCount();
+    chatModel->insertRow(newRow);
+    const QModelIndex index = chatModel->index(newRow, 0);
+    chatModel->setData(index, text);
+    chatModel->setData(index, int(alignment | Qt::AlignVCenter), Qt::TextAlignmentRole);
+    chatModel->setData(index, color, Qt::ForegroundRole);
+    ui->chatView->scrollToBottom();
 }
 
 void ClientWindow::disconnectedFromServer()
@@ -191,7 +344,13 @@ void ClientWindow::disconnectedFromServer()
     ui->connectionBox->setEnabled(true);
     ui->messageEdit->setEnabled(false);
     ui->sendButton->setEnabled(false);
+    ui->fileButton->setEnabled(false);
+    ui->statusEdit->setEnabled(false);
     ui->recepientLabel->setText("Friend'sName");
+    m_typingIdleTimer->stop();
+    m_typingUntil.clear();
+    m_peerStatus.clear();
+    updatePeerState();
     for (QStandardItemModel *model : m_chatModels->values())
         delete model;
     m_chatModels->clear();
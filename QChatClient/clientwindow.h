@@ -3,10 +3,14 @@
 
 #include <QWidget>
 #include <QAbstractSocket>
+#include <QDeadlineTimer>
+#include <QHash>
 #include <QStringListModel>
 
 class ChatClient;
+class QColor;
 class QStandardItemModel;
+class QTimer;
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class ClientWindow; }
@@ -25,16 +29,35 @@ private:
     ChatClient *m_chatClient;
     QMap<QString, QStandardItemModel *> *m_chatModels;
     QStringListModel *m_usersModel;
+    // Stops our typing indicator once the message edit has been left alone
+    QTimer *m_typingIdleTimer;
+    // What the open chat's peer is up to, shown under the chat
+    QHash<QString, QDeadlineTimer> m_typingUntil;
+    QHash<QString, QString> m_peerStatus;
+    QTimer *m_peerStateTimer;
+    void updatePeerState();
+    void appendNote(const QString &peer, const QString &text, Qt::Alignment alignment,
+                    const QColor &color);
 
 private slots:
     void changeConnection();
     void connectedToServer();
-    void attemptLogin(const QString &userName);
+    void attemptLogin(const QString &userName, const QString &password);
     void openChat(const QModelIndex &index);
     void loggedIn();
     void loginFailed(const QString &reason);
     void messageReceived(const QString &sender, const QString &text);
     void sendMessage();
+    void messageEdited(const QString &text);
+    void typingChanged(const QString &sender, bool typing);
+    void statusChanged(const QString &sender, const QString &status);
+    void messageFailed(quint32 messageId, const QString &recipient, const QString &text);
+    void sendFile();
+    void fileOffered(quint32 transferId, const QString &sender, const QString &fileName,
+                     qint64 size);
+    void fileReceived(const QString &sender, const QString &filePath);
+    void fileSent(const QString &recipient, const QString &fileName);
+    void fileFailed(const QString &peer, const QString &fileName, const QString &reason);
     void disconnectedFromServer();
     void updateUsersModel(const QList<std::pair<QString, int>> &userNames);
 
@@ -0,0 +1,9 @@
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += \
+    $$PWD/messagecodec.cpp
+
+HEADERS += \
+    $$PWD/messagecodec.h \
+    $$PWD/protocol.h
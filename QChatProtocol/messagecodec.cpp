@@ -0,0 +1,485 @@
+#include "messagecodec.h"
+#include "protocol.h"
+
+#include <QCborMap>
+#include <QCborStreamWriter>
+#include <QCborValue>
+#include <QJsonDocument>
+#include <QtEndian>
+#include <cstring>
+
+namespace MessageCodec
+{
+// The index of a key is its integer tag in CBOR frames. Append only:
+// reordering would break clients built against an older table.
+static const char *const knownKeys[] = {
+    "type",
+    "username",
+    "text",
+    "sender",
+    "recipient",
+    "success",
+    "reason",
+    "users",
+    "codec",
+    "codecs",
+    "features",
+    "id",
+    "senderId",
+    "recipientId",
+    "userIds",
+    "retryAfter",
+    "msgId",
+    "accepted",
+    "delivered",
+    "failed",
+    "session",
+    "lastSeq",
+    "resumed",
+    "replayed",
+    "transferId",
+    "name",
+    "size",
+    "incoming",
+    "kind",
+    "state",
+    "password",
+    "authToken"
+};
+static constexpr int knownKeyCount = int(sizeof(knownKeys) / sizeof(knownKeys[0]));
+// Anyone who reads them in a log can log in as their user, or take over
+// their session
+static const char *const secretKeys[] = {
+    "password",
+    "authToken",
+    "session"
+};
+
+static const char relayMarker = 0x01;
+static constexpr int relayHeaderSize = 1 + int(sizeof(quint16));
+static const char idRelayMarker = 0x02;
+static constexpr int idRelayHeaderSize = 1 + int(sizeof(quint32));
+static const char ackedRelayMarker = 0x03;
+static constexpr int ackedRelayHeaderSize = 1 + 2 * int(sizeof(quint32));
+static const char chunkMarker = 0x04;
+static const char lastChunkMarker = 0x05;
+static const char fileDataMarker = 0x06;
+static const char compressedMarker = 0x07;
+static const char ephemeralMarker = 0x08;
+
+static constexpr int typeKeyTag = 0;
+
+static int keyTag(const QString &key)
+{
+    for (int i = 0; i < knownKeyCount; ++i) {
+        if (key == QLatin1String(knownKeys[i]))
+            return i;
+    }
+    return -1;
+}
+
+static QString keyFromCbor(const QCborValue &key)
+{
+    if (key.isInteger()) {
+        const qint64 tag = key.toInteger();
+        if (tag >= 0 && tag < knownKeyCount)
+            return QLatin1String(knownKeys[tag]);
+        return QString();
+    }
+    return key.toString();
+}
+
+bool isRelay(const QByteArray &payload)
+{
+    return !payload.isEmpty()
+           && (payload.at(0) == relayMarker || payload.at(0) == idRelayMarker
+               || payload.at(0) == ackedRelayMarker);
+}
+
+bool isCbor(const QByteArray &payload)
+{
+    // Major type 5 (map); JSON frames always start with '{' or whitespace
+    return !payload.isEmpty() && (uchar(payload.at(0)) & 0xE0) == 0xA0;
+}
+
+QByteArray encode(const QJsonObject &message, Codec codec)
+{
+    if (codec == Json)
+        return QJsonDocument(message).toJson(QJsonDocument::Compact);
+
+    QByteArray payload;
+    QCborStreamWriter writer(&payload);
+    writer.startMap(message.size());
+    for (auto it = message.constBegin(); it != message.constEnd(); ++it) {
+        const int tag = keyTag(it.key());
+        if (tag >= 0)
+            writer.append(qint64(tag));
+        else
+            writer.append(QStringView(it.key()));
+        if (tag == typeKeyTag && it.value().isString()) {
+            // Known message types travel as their enum value
+            const Protocol::MessageType type = Protocol::messageType(it.value().toString());
+            if (type != Protocol::MessageType::Unknown) {
+                writer.append(qint64(type));
+                continue;
+            }
+        }
+        QCborValue::fromJsonValue(it.value()).toCbor(writer);
+    }
+    writer.endMap();
+    return payload;
+}
+
+QJsonObject decode(const QByteArray &payload, bool *ok)
+{
+    if (ok)
+        *ok = false;
+    if (!isCbor(payload)) {
+        QJsonParseError parseError;
+        const QJsonDocument jsonDoc = QJsonDocument::fromJson(payload, &parseError);
+        if (parseError.error != QJsonParseError::NoError || !jsonDoc.isObject())
+            return QJsonObject();
+        if (ok)
+            *ok = true;
+        return jsonDoc.object();
+    }
+
+    QCborParserError parseError;
+    const QCborValue cborValue = QCborValue::fromCbor(payload, &parseError);
+    if (parseError.error != QCborError::NoError || !cborValue.isMap())
+        return QJsonObject();
+    QJsonObject message;
+    const QCborMap map = cborValue.toMap();
+    for (auto it = map.constBegin(); it != map.constEnd(); ++it) {
+        const QString key = keyFromCbor(it.key());
+        if (key.isEmpty())
+            continue;
+        const QCborValue value = it.value();
+        if (value.isInteger() && it.key().toInteger(-1) == typeKeyTag) {
+            const qint64 type = value.toInteger();
+            if (type >= 0 && type < Protocol::MessageTypeCount)
+                message.insert(key, Protocol::typeName(Protocol::MessageType(type)));
+            continue;
+        }
+        message.insert(key, value.toJsonValue());
+    }
+    if (ok)
+        *ok = true;
+    return message;
+}
+
+QString codecName(Codec codec)
+{
+    return codec == Cbor ? QStringLiteral("cbor") : QStringLiteral("json");
+}
+
+Codec codecFromName(const QString &name, bool *ok)
+{
+    if (ok)
+        *ok = true;
+    if (name.compare(QLatin1String("cbor"), Qt::CaseInsensitive) == 0)
+        return Cbor;
+    if (ok && name.compare(QLatin1String("json"), Qt::CaseInsensitive) != 0)
+        *ok = false;
+    return Json;
+}
+
+QJsonArray featureNames(int features)
+{
+    QJsonArray names;
+    if (features & RelayFrames)
+        names.append(QStringLiteral("relay"));
+    if (features & UserIds)
+        names.append(QStringLiteral("ids"));
+    if (features & Heartbeats)
+        names.append(QStringLiteral("heartbeat"));
+    if (features & Acks)
+        names.append(QStringLiteral("acks"));
+    if (features & Resume)
+        names.append(QStringLiteral("resume"));
+    if (features & Chunks)
+        names.append(QStringLiteral("chunks"));
+    if (features & Files)
+        names.append(QStringLiteral("files"));
+    if (features & Compression)
+        names.append(QStringLiteral("deflate"));
+    if (features & Events)
+        names.append(QStringLiteral("events"));
+    return names;
+}
+
+int featuresFromNames(const QJsonArray &names)
+{
+    int features = 0;
+    for (const QJsonValueConstRef &name : names) {
+        const QString featureName = name.toString();
+        if (featureName.compare(QLatin1String("relay"), Qt::CaseInsensitive) == 0)
+            features |= RelayFrames;
+        else if (featureName.compare(QLatin1String("ids"), Qt::CaseInsensitive) == 0)
+            features |= UserIds;
+        else if (featureName.compare(QLatin1String("heartbeat"), Qt::CaseInsensitive) == 0)
+            features |= Heartbeats;
+        else if (featureName.compare(QLatin1String("acks"), Qt::CaseInsensitive) == 0)
+            features |= Acks;
+        else if (featureName.compare(QLatin1String("resume"), Qt::CaseInsensitive) == 0)
+            features |= Resume;
+        else if (featureName.compare(QLatin1String("chunks"), Qt::CaseInsensitive) == 0)
+            features |= Chunks;
+        else if (featureName.compare(QLatin1String("files"), Qt::CaseInsensitive) == 0)
+            features |= Files;
+        else if (featureName.compare(QLatin1String("deflate"), Qt::CaseInsensitive) == 0)
+            features |= Compression;
+        else if (featureName.compare(QLatin1String("events"), Qt::CaseInsensitive) == 0)
+            features |= Events;
+    }
+    return features;
+}
+
+QByteArray encodeRelay(QByteArrayView peer, QByteArrayView text)
+{
+    if (peer.size() > 0xFFFF)
+        return QByteArray();
+    QByteArray payload(relayHeaderSize + peer.size() + text.size(), Qt::Uninitialized);
+    char *out = payload.data();
+    *out++ = relayMarker;
+    qToBigEndian<quint16>(quint16(peer.size()), out);
+    out += sizeof(quint16);
+    memcpy(out, peer.data(), peer.size());
+    memcpy(out + peer.size(), text.data(), text.size());
+    return payload;
+}
+
+QByteArray encodeRelay(quint32 peerId, QByteArrayView text)
+{
+    QByteArray payload(idRelayHeaderSize + text.size(), Qt::Uninitialized);
+    char *out = payload.data();
+    *out++ = idRelayMarker;
+    qToBigEndian<quint32>(peerId, out);
+    memcpy(out + sizeof(quint32), text.data(), text.size());
+    return payload;
+}
+
+QByteArray encodeRelay(quint32 peerId, quint32 messageId, QByteArrayView text)
+{
+    QByteArray payload(ackedRelayHeaderSize + text.size(), Qt::Uninitialized);
+    char *out = payload.data();
+    *out++ = ackedRelayMarker;
+    qToBigEndian<quint32>(peerId, out);
+    qToBigEndian<quint32>(messageId, out + sizeof(quint32));
+    memcpy(out + 2 * sizeof(quint32), text.data(), text.size());
+    return payload;
+}
+
+bool decodeRelay(const QByteArray &payload, RelayFrame *frame)
+{
+    Q_ASSERT(frame);
+    if (!payload.isEmpty() && payload.at(0) == ackedRelayMarker) {
+        if (payload.size() < ackedRelayHeaderSize)
+            return false;
+        frame->peer = QByteArrayView();
+        frame->peerId = qFromBigEndian<quint32>(payload.constData() + 1);
+        frame->messageId = qFromBigEndian<quint32>(payload.constData() + 1 + sizeof(quint32));
+        frame->text = QByteArrayView(payload.constData() + ackedRelayHeaderSize,
+                                     payload.size() - ackedRelayHeaderSize);
+        return true;
+    }
+    if (!payload.isEmpty() && payload.at(0) == idRelayMarker) {
+        if (payload.size() < idRelayHeaderSize)
+            return false;
+        frame->peer = QByteArrayView();
+        frame->peerId = qFromBigEndian<quint32>(payload.constData() + 1);
+        frame->messageId = 0;
+        frame->text = QByteArrayView(payload.constData() + idRelayHeaderSize,
+                                     payload.size() - idRelayHeaderSize);
+        return true;
+    }
+    if (payload.size() < relayHeaderSize || !isRelay(payload))
+        return false;
+    const qsizetype peerSize = qFromBigEndian<quint16>(payload.constData() + 1);
+    if (payload.size() < relayHeaderSize + peerSize)
+        return false;
+    frame->peer = QByteArrayView(payload.constData() + relayHeaderSize, peerSize);
+    frame->peerId = 0;
+    frame->messageId = 0;
+    frame->text = QByteArrayView(payload.constData() + relayHeaderSize + peerSize,
+                                 payload.size() - relayHeaderSize - peerSize);
+    return true;
+}
+
+bool isFileData(const QByteArray &payload)
+{
+    return !payload.isEmpty() && payload.at(0) == fileDataMarker;
+}
+
+QByteArray encodeFileData(quint32 transferId, QByteArrayView data)
+{
+    QByteArray payload(FileDataHeaderSize + data.size(), Qt::Uninitialized);
+    char *out = payload.data();
+    *out++ = fileDataMarker;
+    qToBigEndian<quint32>(transferId, out);
+    memcpy(out + sizeof(quint32), data.data(), data.size());
+    return payload;
+}
+
+bool decodeFileData(const QByteArray &payload, FileData *fileData)
+{
+    Q_ASSERT(fileData);
+    if (payload.size() < FileDataHeaderSize || !isFileData(payload))
+        return false;
+    fileData->transferId = qFromBigEndian<quint32>(payload.constData() + 1);
+    fileData->data = QByteArrayView(payload.constData() + FileDataHeaderSize,
+                                    payload.size() - FileDataHeaderSize);
+    return true;
+}
+
+void setFileDataTransferId(QByteArray *payload, quint32 transferId)
+{
+    Q_ASSERT(payload && payload->size() >= FileDataHeaderSize && isFileData(*payload));
+    qToBigEndian<quint32>(transferId, payload->data() + 1);
+}
+
+bool isCompressed(const QByteArray &payload)
+{
+    return !payload.isEmpty() && payload.at(0) == compressedMarker;
+}
+
+QByteArray compress(const QByteArray &payload)
+{
+    Q_ASSERT(!isCompressed(payload) && payload.size() <= MaxUncompressedSize);
+    QByteArray compressed = qCompress(payload);
+    compressed.prepend(compressedMarker);
+    return compressed;
+}
+
+bool uncompress(const QByteArray &payload, QByteArray *original)
+{
+    Q_ASSERT(original);
+    if (payload.size() < CompressedHeaderSize || !isCompressed(payload))
+        return false;
+    // Checked before inflating anything, qUncompress() would allocate it
+    const quint32 size = qFromBigEndian<quint32>(payload.constData() + 1);
+    if (size == 0 || size > quint32(MaxUncompressedSize))
+        return false;
+    *original = qUncompress(reinterpret_cast<const uchar *>(payload.constData() + 1),
+                            payload.size() - 1);
+    return original->size() == qsizetype(size) && !isCompressed(*original);
+}
+
+bool isEphemeral(const QByteArray &payload)
+{
+    return !payload.isEmpty() && payload.at(0) == ephemeralMarker;
+}
+
+QByteArray encodeEphemeral(const QJsonObject &message, Codec codec)
+{
+    QByteArray payload = encode(message, codec);
+    payload.prepend(ephemeralMarker);
+    return payload;
+}
+
+QJsonObject decodeEphemeral(const QByteArray &payload, bool *ok)
+{
+    if (!isEphemeral(payload)) {
+        if (ok)
+            *ok = false;
+        return QJsonObject();
+    }
+    return decode(payload.sliced(1), ok);
+}
+
+bool isChunk(const QByteArray &payload)
+{
+    return !payload.isEmpty() && (payload.at(0) == chunkMarker || payload.at(0) == lastChunkMarker);
+}
+
+void writeChunkHeader(char *out, quint8 stream, bool last)
+{
+    out[0] = last ? lastChunkMarker : chunkMarker;
+    out[1] = char(stream);
+}
+
+bool decodeChunk(const QByteArray &payload, Chunk *chunk)
+{
+    Q_ASSERT(chunk);
+    if (payload.size() < ChunkHeaderSize || !isChunk(payload))
+        return false;
+    chunk->stream = quint8(payload.at(1));
+    chunk->last = payload.at(0) == lastChunkMarker;
+    chunk->data = QByteArrayView(payload.constData() + ChunkHeaderSize,
+                                 payload.size() - ChunkHeaderSize);
+    return true;
+}
+
+QString toDisplayString(const QByteArray &payload)
+{
+    if (isEphemeral(payload))
+        return QLatin1String("ephemeral ") + toDisplayString(payload.sliced(1));
+    if (isCompressed(payload)) {
+        if (payload.size() < CompressedHeaderSize)
+            return QStringLiteral("malformed compressed frame");
+        return QStringLiteral("compressed frame, %1 bytes of %2")
+            .arg(payload.size()).arg(qFromBigEndian<quint32>(payload.constData() + 1));
+    }
+    if (isFileData(payload)) {
+        FileData fileData;
+        if (!decodeFileData(payload, &fileData))
+            return QStringLiteral("malformed file data frame");
+        return QStringLiteral("file data, transfer %1, %2 bytes")
+            .arg(fileData.transferId).arg(fileData.data.size());
+    }
+    if (isChunk(payload)) {
+        Chunk chunk;
+        decodeChunk(payload, &chunk);
+        return QStringLiteral("%1 chunk, stream %2, %3 bytes")
+            .arg(chunk.last ? QLatin1String("last") : QLatin1String("partial"))
+            .arg(chunk.stream).arg(chunk.data.size());
+    }
+    if (isRelay(payload)) {
+        RelayFrame frame;
+        if (!decodeRelay(payload, &frame))
+            return QStringLiteral("malformed relay frame");
+        if (frame.messageId != 0)
+            return QStringLiteral("relay frame, peer id %1, message %2, %3 bytes of text")
+                .arg(frame.peerId).arg(frame.messageId).arg(frame.text.size());
+        if (frame.peerId != 0)
+            return QStringLiteral("relay frame, peer id %1, %2 bytes of text")
+                .arg(frame.peerId).arg(frame.text.size());
+        return QStringLiteral("relay frame, peer %1, %2 bytes of text")
+            .arg(QString::fromUtf8(frame.peer)).arg(frame.text.size());
+    }
+    if (isCbor(payload)) {
+        QCborValue value = QCborValue::fromCbor(payload);
+        if (value.isMap()) {
+            QCborMap map = value.toMap();
+            for (const char *key : secretKeys) {
+                const QString name = QLatin1String(key);
+                if (map.contains(keyTag(name)))
+                    map.insert(keyTag(name), QStringLiteral("***"));
+                if (map.contains(name))
+                    map.insert(name, QStringLiteral("***"));
+            }
+            value = map;
+        }
+        return value.toDiagnosticNotation();
+    }
+    // Only decoded when a credential may be in there
+    for (const char *key : secretKeys) {
+        if (payload.contains('"' + QByteArray(key) + '"')) {
+            return QString::fromUtf8(
+                QJsonDocument(redacted(decode(payload))).toJson(QJsonDocument::Compact));
+        }
+    }
+    return QString::fromUtf8(payload);
+}
+
+QJsonObject redacted(const QJsonObject &message)
+{
+    QJsonObject result = message;
+    for (const char *key : secretKeys) {
+        const QString name = QLatin1String(key);
+        if (result.contains(name))
+            result[name] = QStringLiteral("***");
+    }
+    return result;
+}
+}
@@ -0,0 +1,141 @@
+#ifndef MESSAGECODEC_H
+#define MESSAGECODEC_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QString>
+
+// Encodes chat messages for the wire. Frames carry either compact JSON text
+// or a CBOR map keyed by small integers for the well known fields; the first
+// byte tells them apart, so a receiver can always decode both.
+namespace MessageCodec
+{
+enum Codec {
+    Json,
+    Cbor
+};
+
+// Optional protocol extensions, offered by the client and confirmed by the
+// server in the "features" list of the login exchange
+enum Feature {
+    RelayFrames = 0x1,
+    UserIds = 0x2,
+    // The server pings a quiet client and expects a pong back
+    Heartbeats = 0x4,
+    // Messages carry a client chosen id and the server acknowledges them
+    Acks = 0x8,
+    // The login reply carries a "session" token. Every frame the server
+    // sends after that reply is numbered implicitly from 1; a client that
+    // reconnects logs in with the token and "lastSeq", the number of the
+    // last frame it processed, and gets the frames it missed.
+    Resume = 0x10,
+    // Large payloads may arrive in chunk frames, see below
+    Chunks = 0x20,
+    // Files sent as a "file offer", answered with a "file accept" or a
+    // "file cancel", and then file data frames, see below
+    Files = 0x40,
+    // The server may deflate large payloads, see below
+    Compression = 0x80,
+    // Typing and status "event" messages, sent in ephemeral frames
+    Events = 0x100
+};
+
+// Relay frames bypass the codecs so the server can route chat text without
+// decoding it: 0x01, the peer name length as big endian quint16, the peer
+// name and then the message text, both UTF-8. The peer is the recipient on
+// the way in (empty to broadcast) and the sender on the way out.
+// Once the UserIds feature is agreed the peer is the numeric user id the
+// server assigned at login instead: 0x02, the id as big endian quint32 and
+// the text. Id 0 is never assigned and broadcasts.
+// A client that agreed on Acks sends 0x03, the peer id and its message id,
+// both big endian quint32, and the text; the server acknowledges the
+// message id. Message id 0 means no acknowledgement.
+struct RelayFrame
+{
+    QByteArrayView peer;
+    quint32 peerId = 0;
+    quint32 messageId = 0;
+    QByteArrayView text;
+};
+
+// With Chunks agreed the server may split a payload over several frames so
+// smaller ones can go out in between: 0x04, a stream byte and a slice of
+// the payload, and 0x05 with the same stream for the last slice. Slices of
+// one stream arrive in order; the reassembled payload counts as one frame.
+struct Chunk
+{
+    quint8 stream = 0;
+    bool last = false;
+    QByteArrayView data;
+};
+static constexpr int ChunkHeaderSize = 2;
+
+// The contents of a file go in file data frames once the recipient accepted
+// its "file offer": 0x06, the transfer id as big endian quint32 and a slice of the file, in
+// order, until "size" bytes have been sent. The sender picks the id of its
+// transfers; the server gives the recipient one of its own. File data frames
+// are not numbered for a resume, a transfer ends with its connection.
+struct FileData
+{
+    quint32 transferId = 0;
+    QByteArrayView data;
+};
+static constexpr int FileDataHeaderSize = 1 + int(sizeof(quint32));
+
+// With Compression agreed a payload may arrive deflated: 0x07, the size of
+// the original payload as big endian quint32 and its zlib stream, which is
+// the layout of qCompress() behind the marker. The original payload is
+// never a compressed frame itself, and is at most MaxUncompressedSize.
+static constexpr int CompressedHeaderSize = 1 + int(sizeof(quint32));
+static constexpr qsizetype MaxUncompressedSize = 64 << 20;
+
+// Ephemeral frames carry state that only matters until the next update:
+// 0x08 and an encoded message. They are not numbered for a resume, never
+// replayed or acknowledged, and the server may drop them.
+
+QByteArray encode(const QJsonObject &message, Codec codec);
+QJsonObject decode(const QByteArray &payload, bool *ok = nullptr);
+bool isCbor(const QByteArray &payload);
+
+QString codecName(Codec codec);
+Codec codecFromName(const QString &name, bool *ok = nullptr);
+
+QJsonArray featureNames(int features);
+int featuresFromNames(const QJsonArray &names);
+
+bool isRelay(const QByteArray &payload);
+// Null when the peer name does not fit the 16-bit length of the header
+QByteArray encodeRelay(QByteArrayView peer, QByteArrayView text);
+QByteArray encodeRelay(quint32 peerId, QByteArrayView text);
+QByteArray encodeRelay(quint32 peerId, quint32 messageId, QByteArrayView text);
+bool decodeRelay(const QByteArray &payload, RelayFrame *frame);
+
+bool isFileData(const QByteArray &payload);
+QByteArray encodeFileData(quint32 transferId, QByteArrayView data);
+bool decodeFileData(const QByteArray &payload, FileData *fileData);
+// Rewrites the id of a file data frame in place
+void setFileDataTransferId(QByteArray *payload, quint32 transferId);
+
+bool isEphemeral(const QByteArray &payload);
+QByteArray encodeEphemeral(const QJsonObject &message, Codec codec);
+QJsonObject decodeEphemeral(const QByteArray &payload, bool *ok = nullptr);
+
+bool isCompressed(const QByteArray &payload);
+// Not necessarily smaller than the payload, the caller compares
+QByteArray compress(const QByteArray &payload);
+bool uncompress(const QByteArray &payload, QByteArray *original);
+
+bool isChunk(const QByteArray &payload);
+// Writes the ChunkHeaderSize bytes in front of a slice
+void writeChunkHeader(char *out, quint8 stream, bool last);
+bool decodeChunk(const QByteArray &payload, Chunk *chunk);
+
+// Human readable rendering of a payload for the server log, redacted
+QString toDisplayString(const QByteArray &payload);
+// The message with the values of its credentials replaced, for the log
+QJsonObject redacted(const QJsonObject &message);
+}
+
+#endif // MESSAGECODEC_H
@@ -0,0 +1,145 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <QLatin1String>
+#include <QString>
+#include <QStringView>
+#include <array>
+
+// Message types shared by client and server. The "type" field of a message
+// is resolved with a perfect hash computed at compile time, so dispatch costs
+// one hash of the name and one comparison however many types there are.
+namespace Protocol
+{
+enum class MessageType : quint8 {
+    Login,
+    NewUser,
+    UserDisconnected,
+    Message,
+    Ping,
+    Pong,
+    Ack,
+    FileOffer,
+    FileCancel,
+    Event,
+    FileAccept,
+    Unknown
+};
+constexpr int MessageTypeCount = int(MessageType::Unknown);
+
+// Indexed by MessageType
+constexpr const char *messageTypeNames[MessageTypeCount] = {
+    "login",
+    "new user",
+    "user disconnected",
+    "message",
+    "ping",
+    "pong",
+    "ack",
+    "file offer",
+    "file cancel",
+    "event",
+    "file accept"
+};
+
+constexpr qsizetype nameSize(const char *name)
+{
+    qsizetype size = 0;
+    while (name[size] != '\0')
+        ++size;
+    return size;
+}
+
+// FNV-1a over the ASCII lower case form, wire names are case insensitive
+template <typename Char>
+constexpr quint32 foldedHash(const Char *data, qsizetype size)
+{
+    quint32 hash = 2166136261u;
+    for (qsizetype i = 0; i < size; ++i) {
+        quint32 c = quint32(data[i]);
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+constexpr int MaxSlotCount = 64;
+
+constexpr bool isCollisionFree(int slotCount)
+{
+    std::array<bool, MaxSlotCount> used{};
+    for (const char *name : messageTypeNames) {
+        const int slot = int(foldedHash(name, nameSize(name)) % quint32(slotCount));
+        if (used[slot])
+            return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr int findSlotCount()
+{
+    int slotCount = MessageTypeCount;
+    while (slotCount < MaxSlotCount && !isCollisionFree(slotCount))
+        ++slotCount;
+    return slotCount;
+}
+
+constexpr int SlotCount = findSlotCount();
+static_assert(isCollisionFree(SlotCount), "No perfect hash for the message type names");
+
+constexpr std::array<MessageType, MaxSlotCount> buildSlots()
+{
+    std::array<MessageType, MaxSlotCount> slots{};
+    for (MessageType &slot : slots)
+        slot = MessageType::Unknown;
+    for (int i = 0; i < MessageTypeCount; ++i) {
+        const char *name = messageTypeNames[i];
+        slots[foldedHash(name, nameSize(name)) % quint32(SlotCount)] = MessageType(i);
+    }
+    return slots;
+}
+
+constexpr std::array<MessageType, MaxSlotCount> messageTypeSlots = buildSlots();
+
+constexpr std::array<qsizetype, MessageTypeCount> buildNameSizes()
+{
+    std::array<qsizetype, MessageTypeCount> sizes{};
+    for (int i = 0; i < MessageTypeCount; ++i)
+        sizes[i] = nameSize(messageTypeNames[i]);
+    return sizes;
+}
+
+constexpr std::array<qsizetype, MessageTypeCount> messageTypeNameSizes = buildNameSizes();
+
+inline QLatin1String typeName(MessageType type)
+{
+    Q_ASSERT(type != MessageType::Unknown);
+    return QLatin1String(messageTypeNames[int(type)], messageTypeNameSizes[int(type)]);
+}
+
+inline MessageType lookupMessageType(QStringView name)
+{
+    const MessageType candidate
+        = messageTypeSlots[foldedHash(name.utf16(), name.size()) % quint32(SlotCount)];
+    if (candidate == MessageType::Unknown)
+        return candidate;
+    if (name.compare(typeName(candidate), Qt::CaseInsensitive) != 0)
+        return MessageType::Unknown;
+    return candidate;
+}
+
+// foldedHash() folds ASCII only, the compare folds by Unicode rules; names
+// with other characters are case folded first so the two always agree
+inline MessageType messageType(QStringView name)
+{
+    for (QChar c : name) {
+        if (c.unicode() >= 0x80)
+            return lookupMessageType(name.toString().toCaseFolded());
+    }
+    return lookupMessageType(name);
+}
+}
+
+#endif // PROTOCOL_H
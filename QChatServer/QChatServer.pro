@@ -4,20 +4,41 @@ greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++17
 
+include(../QChatProtocol/QChatProtocol.pri)
+
 # You can make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    authenticator.cpp \
     chatserver.cpp \
+    connectionregistry.cpp \
+    dedupwindow.cpp \
+    framebufferpool.cpp \
     main.cpp \
+    messagefilter.cpp \
     serverwindow.cpp \
-    serverworker.cpp
+    serverworker.cpp \
+    threadlistener.cpp \
+    timerwheel.cpp \
+    tokenbucket.cpp \
+    utf8.cpp
 
 HEADERS += \
+    authenticator.h \
     chatserver.h \
+    connectionregistry.h \
+    dedupwindow.h \
+    framebufferpool.h \
+    messagefilter.h \
+    serversettings.h \
     serverwindow.h \
-    serverworker.h
+    serverworker.h \
+    threadlistener.h \
+    timerwheel.h \
+    tokenbucket.h \
+    utf8.h
 
 FORMS += \
     serverwindow.ui
@@ -0,0 +1,163 @@
+#include "authenticator.h"
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QPasswordDigestor>
+#include <QRandomGenerator>
+#include <QThread>
+
+static constexpr int SaltBytes = 16;
+static constexpr int KeyBytes = 32;
+
+static QByteArray randomBytes(int size)
+{
+    QByteArray bytes(size, Qt::Uninitialized);
+    QRandomGenerator::system()->fillRange(reinterpret_cast<quint32 *>(bytes.data()),
+                                          size / int(sizeof(quint32)));
+    return bytes;
+}
+
+static QByteArray deriveKey(const QByteArray &password, const QByteArray &salt, int iterations)
+{
+    return QPasswordDigestor::deriveKeyPbkdf2(QCryptographicHash::Sha256, password, salt,
+                                              iterations, KeyBytes);
+}
+
+Authenticator::Authenticator(QObject *parent)
+    : QObject(parent)
+    , m_maxQueued(256)
+    , m_dummyCredential{randomBytes(SaltBytes), DefaultIterations, randomBytes(KeyBytes)}
+    , m_cacheHits(0)
+{
+    m_clock.start();
+    setLimits(0, m_maxQueued);
+}
+
+// Results still coming are dropped with this object; see retire() for a
+// teardown that does not block
+Authenticator::~Authenticator()
+{
+    m_pool.waitForDone();
+}
+
+bool Authenticator::loadCredentials(const QString &path, QString *error)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        if (error)
+            *error = file.errorString();
+        return false;
+    }
+    QHash<QString, Credential> credentials;
+    int lineNumber = 0;
+    for (const QByteArray &rawLine : file.readAll().split('\n')) {
+        ++lineNumber;
+        const QByteArray line = rawLine.trimmed();
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+        // The name may hold colons, the other fields cannot
+        const qsizetype keyStart = line.lastIndexOf(':') + 1;
+        const qsizetype iterationsStart = keyStart > 1 ? line.lastIndexOf(':', keyStart - 2) + 1 : 0;
+        const qsizetype saltStart = iterationsStart > 1 ? line.lastIndexOf(':', iterationsStart - 2) + 1
+                                                        : 0;
+        const QString userName = QString::fromUtf8(line.left(qMax(saltStart - 1, 0))).simplified();
+        const QByteArray salt = QByteArray::fromHex(line.mid(saltStart, iterationsStart - saltStart - 1));
+        const int iterations = line.mid(iterationsStart, keyStart - iterationsStart - 1).toInt();
+        const QByteArray key = QByteArray::fromHex(line.mid(keyStart));
+        if (saltStart <= 1 || userName.isEmpty() || salt.isEmpty() || iterations <= 0
+            || key.size() != KeyBytes) {
+            if (error)
+                *error = QStringLiteral("line %1 is malformed").arg(lineNumber);
+            return false;
+        }
+        credentials.insert(userName, Credential{salt, iterations, key});
+    }
+    m_credentials = credentials;
+    return true;
+}
+
+void Authenticator::setLimits(int threads, int maxQueued)
+{
+    m_pool.setMaxThreadCount(threads > 0 ? threads : qMax(QThread::idealThreadCount() / 4, 1));
+    m_maxQueued = qMax(maxQueued, 1);
+}
+
+QByteArray Authenticator::credentialLine(const QString &userName, const QString &password,
+                                         int iterations)
+{
+    const QByteArray salt = randomBytes(SaltBytes);
+    return userName.simplified().toUtf8() + ':' + salt.toHex() + ':' + QByteArray::number(iterations)
+           + ':' + deriveKey(password.toUtf8(), salt, iterations).toHex();
+}
+
+void Authenticator::verify(quint32 handle, const QJsonObject &login)
+{
+    const QString userName = login.value(QLatin1String("username")).toString().simplified();
+    const QByteArray token = login.value(QLatin1String("authToken")).toString().toLatin1();
+    const auto cached = m_tokens.constFind(token);
+    if (!token.isEmpty() && cached != m_tokens.cend() && cached->userName == userName
+        && cached->expiresNsecs > m_clock.nsecsElapsed()) {
+        ++m_cacheHits;
+        emit finished(handle, login, Result::Accepted);
+        return;
+    }
+    if (m_pending.size() >= m_maxQueued) {
+        emit finished(handle, login, Result::Busy);
+        return;
+    }
+    m_pending.insert(handle);
+    const Credential credential = m_credentials.value(userName, m_dummyCredential);
+    const bool known = m_credentials.contains(userName);
+    const QByteArray password = login.value(QLatin1String("password")).toString().toUtf8();
+    m_pool.start([this, handle, login, credential, known, password]() {
+        const bool accepted = checkPassword(credential, password) && known;
+        QMetaObject::invokeMethod(this, [this, handle, login, accepted]() {
+            // Not after retire()
+            if (m_pending.remove(handle))
+                emit finished(handle, login, accepted ? Result::Accepted : Result::Rejected);
+        }, Qt::QueuedConnection);
+    });
+}
+
+// Results of the running checks are posted to this object before its
+// deletion is, so they all find it still there
+QList<quint32> Authenticator::retire()
+{
+    m_pool.clear();
+    setParent(nullptr);
+    QThreadPool::globalInstance()->start([this]() {
+        m_pool.waitForDone();
+        deleteLater();
+    });
+    const QList<quint32> handles = m_pending.values();
+    m_pending.clear();
+    return handles;
+}
+
+// Compares every byte, however early they differ
+bool Authenticator::checkPassword(const Credential &credential, const QByteArray &password)
+{
+    const QByteArray key = deriveKey(password, credential.salt, credential.iterations);
+    if (key.size() != credential.key.size())
+        return false;
+    quint8 difference = 0;
+    for (qsizetype i = 0; i < key.size(); ++i)
+        difference |= quint8(key.at(i) ^ credential.key.at(i));
+    return difference == 0;
+}
+
+QString Authenticator::issueToken(const QString &userName)
+{
+    const QByteArray token = randomBytes(SaltBytes).toHex();
+    m_tokens.insert(token, CachedToken{userName, m_clock.nsecsElapsed()
+                                                     + qint64(TokenLifetimeSecs) * 1000000000});
+    m_tokenOrder.enqueue(token);
+    while (m_tokenOrder.size() > TokenCacheSize)
+        m_tokens.remove(m_tokenOrder.dequeue());
+    return QString::fromLatin1(token);
+}
+
+quint64 Authenticator::cacheHits() const
+{
+    return m_cacheHits;
+}
@@ -0,0 +1,83 @@
+#ifndef AUTHENTICATOR_H
+#define AUTHENTICATOR_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QObject>
+#include <QQueue>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+
+// Checks login credentials for the ChatServer, on the ChatServer's thread.
+// Passwords are stored as PBKDF2-HMAC-SHA256 keys and checked on a pool
+// of their own, with a bounded queue, so a login storm costs CPU there
+// and never on the thread that routes messages. A client that logged in
+// gets a token good for a while, checked without the pool.
+class Authenticator : public QObject
+{
+    Q_OBJECT
+public:
+    enum class Result {
+        Accepted,
+        Rejected,
+        // Too many checks waiting, the client should retry later
+        Busy
+    };
+    static constexpr int DefaultIterations = 100000;
+    static constexpr int TokenCacheSize = 1024;
+    static constexpr int TokenLifetimeSecs = 600;
+
+    explicit Authenticator(QObject *parent = nullptr);
+    ~Authenticator();
+    // One "user:salt:iterations:key" line per user, salt and key in hex.
+    // The previous credentials stay if the file cannot be read or parsed.
+    bool loadCredentials(const QString &path, QString *error = nullptr);
+    // 0 threads picks a quarter of the cores
+    void setLimits(int threads, int maxQueued);
+    // A line for the credentials file, with a random salt
+    static QByteArray credentialLine(const QString &userName, const QString &password,
+                                     int iterations = DefaultIterations);
+    // The "authToken" of a login is tried first, then its "password".
+    // finished() follows, right away for a token or a full queue.
+    void verify(quint32 handle, const QJsonObject &login);
+    // For a user that is now logged in
+    QString issueToken(const QString &userName);
+    // Drops the checks still queued and deletes this object once the
+    // running ones are done, without waiting for them. Nothing is emitted
+    // afterwards; the handles whose checks were dropped are returned.
+    QList<quint32> retire();
+    quint64 cacheHits() const;
+signals:
+    void finished(quint32 handle, const QJsonObject &login, Authenticator::Result result);
+private:
+    struct Credential
+    {
+        QByteArray salt;
+        int iterations;
+        QByteArray key;
+    };
+    struct CachedToken
+    {
+        QString userName;
+        qint64 expiresNsecs;
+    };
+    static bool checkPassword(const Credential &credential, const QByteArray &password);
+
+    QThreadPool m_pool;
+    int m_maxQueued;
+    // Handles whose checks were handed to the pool and did not finish yet
+    QSet<quint32> m_pending;
+    QHash<QString, Credential> m_credentials;
+    // Unknown users cost a check as well, so timing does not tell them apart
+    Credential m_dummyCredential;
+    QHash<QByteArray, CachedToken> m_tokens;
+    // Oldest first, for eviction
+    QQueue<QByteArray> m_tokenOrder;
+    QElapsedTimer m_clock;
+    quint64 m_cacheHits;
+};
+
+#endif // AUTHENTICATOR_H
@@ -1,23 +1,86 @@
 #include "chatserver.h"
+#include "framebufferpool.h"
+#include "protocol.h"
 #include "serverworker.h"
+#include "threadlistener.h"
+#include "utf8.h"
+#include <QFile>
+#include <QFileSystemWatcher>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonValue>
+#include <QRandomGenerator>
+#include <QSet>
 #include <QStringLiteral>
 #include <QThread>
 #include <QTimer>
+#include <algorithm>
+#include <functional>
 
 ChatServer::ChatServer(QObject *parent)
     : QTcpServer(parent)
     , m_idealThreadCount(qMax(QThread::idealThreadCount(), 1))
+    , m_listenersRunning(false)
+    , m_listenersPort(0)
+    , m_workerPoolHits(0)
+    , m_workerPoolMisses(0)
+    , m_balanceTimer(new QTimer(this))
+    , m_lastBalanceNsecs(0)
+    , m_migrations(0)
+    , m_crossThreadDeliveries(0)
+    , m_retiredLocalDeliveries(0)
+    , m_droppedDeliveries(0)
+    , m_loginTimer(new QTimer(this))
+    , m_usersTimer(new QTimer(this))
+    , m_acceptingPaused(false)
+    , m_refusedConnections(0)
+    , m_queuedLogins(0)
+    , m_deferredLogins(0)
+    , m_pausedReads(0)
+    , m_rejectedFrames(0)
+    , m_floodDisconnects(0)
+    , m_duplicateMessages(0)
+    , m_coalescedEvents(0)
+    , m_droppedEvents(0)
+    , m_sessionTimer(new QTimer(this))
+    , m_nextFileTransferId(1)
+    , m_filterWatcher(nullptr)
+    , m_authenticator(nullptr)
+    , m_rejectedLogins(0)
 {
     m_availableThreads.reserve(m_idealThreadCount);
     m_threadsLoad.reserve(m_idealThreadCount);
+    m_idleWorkers.reserve(m_idealThreadCount);
+    m_threadProbes.reserve(m_idealThreadCount);
+    m_threadStatistics.reserve(m_idealThreadCount);
+    m_clock.start();
+    m_balanceTimer->setInterval(1000);
+    connect(m_balanceTimer, &QTimer::timeout, this, &ChatServer::balanceThreads);
+    m_balanceTimer->start();
+    m_loginTimer->setSingleShot(true);
+    connect(m_loginTimer, &QTimer::timeout, this, &ChatServer::processPendingLogins);
+    m_usersTimer->setSingleShot(true);
+    m_usersTimer->setInterval(100);
+    connect(m_usersTimer, &QTimer::timeout, this, &ChatServer::updateUsers);
+    m_sessionTimer->setSingleShot(true);
+    connect(m_sessionTimer, &QTimer::timeout, this, &ChatServer::expireSessions);
+    setSettings(m_settings);
 }
 
 ChatServer::~ChatServer()
 {
+    // Deferred deletes are still delivered while the threads finish
+    for (ServerWorker *worker : m_clients)
+        worker->deleteLater();
+    for (const QVector<ServerWorker *> &idleWorkers : qAsConst(m_idleWorkers)) {
+        for (ServerWorker *worker : idleWorkers)
+            worker->deleteLater();
+    }
+    for (QObject *probe : qAsConst(m_threadProbes))
+        probe->deleteLater();
+    for (ThreadListener *listener : qAsConst(m_listeners))
+        listener->deleteLater();
     for (QThread *singleThread : m_availableThreads) {
         singleThread->quit();
         singleThread->wait();
@@ -26,105 +89,863 @@ ChatServer::~ChatServer()
 
 void ChatServer::incomingConnection(qintptr socketDescriptor)
 {
-    ServerWorker *worker = new ServerWorker;
-    if(!worker->setSocketDescriptor(socketDescriptor))
-    {
-        worker->deleteLater();
+    if (m_clients.size() >= connectionLimit()) {
+        ++m_refusedConnections;
+        emit logMessage(QStringLiteral("Connection limit reached"));
+        QTcpSocket rejected;
+        if (rejected.setSocketDescriptor(socketDescriptor))
+            rejected.abort();
         return;
     }
-    int threadIdx = m_availableThreads.size();
-    if(threadIdx < m_idealThreadCount){
-        m_availableThreads.append(new QThread(this));
-        m_threadsLoad.append(1);
-        m_availableThreads.last()->start();
-    }
-    else {
+    int threadIdx;
+    if (m_availableThreads.size() < m_idealThreadCount) {
+        threadIdx = addThread();
+    } else {
         threadIdx = std::distance(m_threadsLoad.cbegin(),
                                   std::min_element(m_threadsLoad.cbegin(),
                                                    m_threadsLoad.cend()));
-        ++m_threadsLoad[threadIdx];
     }
+    ++m_threadsLoad[threadIdx];
 
-    worker->moveToThread(m_availableThreads.at(threadIdx));
-    connect(m_availableThreads.at(threadIdx), &QThread::finished, worker, &QObject::deleteLater);
-    connect(worker, &ServerWorker::disconnectedFromClient,
-            this, std::bind(&ChatServer::userDisconnected, this, worker, threadIdx));
-    connect(worker, &ServerWorker::error,
-            this, std::bind(&ChatServer::userError, this, worker));
-    connect(worker, &ServerWorker::jsonReceived,
-            this, std::bind(&ChatServer::jsonReceived, this, worker, std::placeholders::_1));
-    connect(worker, &ServerWorker::logMessage, this, &ChatServer::logMessage);
-    connect(this, &ChatServer::stopAllClients, worker, &ServerWorker::disconnectFromClient);
-    m_clients.append(worker);
+    // No per-connection signal wiring: the worker reports back through
+    // queued calls on this object. The socket is set up on the worker's
+    // thread, so a pooled worker never has to leave it.
+    ServerWorker *worker = acquireWorker(threadIdx);
+    const ConnectionRegistry::Handle handle = m_clients.insert(worker);
+    Q_ASSERT(handle != 0);
+    worker->setHandle(handle);
+    QMetaObject::invokeMethod(worker, [worker, socketDescriptor]() {
+        worker->start(socketDescriptor);
+    }, Qt::QueuedConnection);
+    emit logMessage(QStringLiteral("New client Connected"));
+    updateAdmission();
+}
+
+int ChatServer::addThread()
+{
+    QThread *thread = new QThread(this);
+    m_availableThreads.append(thread);
+    m_threadsLoad.append(0);
+    m_idleWorkers.append(QVector<ServerWorker *>());
+    m_threadProbes.append(new QObject);
+    m_threadProbes.last()->moveToThread(thread);
+    m_threadStatistics.append(ThreadStatistics{0, 0, 0, 0});
+    thread->start();
+    return m_availableThreads.size() - 1;
+}
+
+void ChatServer::setSettings(const ServerSettings &settings)
+{
+    m_settings = settings;
+    m_loginBucket = TokenBucket(quint32(qMax(settings.loginsPerSecond, 0)),
+                                quint32(qMax(settings.loginBurst, 1)), m_clock.nsecsElapsed());
+    // Checks still running are not waited for, their clients try again
+    if (m_authenticator) {
+        for (quint32 handle : std::exchange(m_authenticator, nullptr)->retire()) {
+            m_loginHandles.remove(handle);
+            ServerWorker *sender = m_clients.value(handle);
+            if (sender && sender->userId() == 0)
+                deferLogin(sender);
+        }
+    }
+    if (!settings.credentialsPath.isEmpty()) {
+        m_authenticator = new Authenticator(this);
+        m_authenticator->setLimits(settings.authThreads, settings.maxQueuedAuths);
+        QString error;
+        if (m_authenticator->loadCredentials(settings.credentialsPath, &error))
+            emit logMessage(QLatin1String("Credentials loaded"));
+        else
+            emit logMessage(QLatin1String("Cannot load credentials, nobody can log in: ") + error);
+        connect(m_authenticator, &Authenticator::finished, this, &ChatServer::authenticated);
+    }
+    delete std::exchange(m_filterWatcher, nullptr);
+    if (settings.filterRulesPath.isEmpty())
+        return;
+    loadFilterRules(settings.filterRulesPath);
+    m_filterWatcher = new QFileSystemWatcher({settings.filterRulesPath}, this);
+    connect(m_filterWatcher, &QFileSystemWatcher::fileChanged, this, &ChatServer::reloadFilterRules);
+}
+
+const ServerSettings &ChatServer::settings() const
+{
+    return m_settings;
+}
+
+std::shared_ptr<const MessageFilter> ChatServer::filter() const
+{
+    return std::atomic_load(&m_filter);
+}
+
+void ChatServer::setFilter(std::shared_ptr<const MessageFilter> filter)
+{
+    std::atomic_store(&m_filter, std::move(filter));
+}
+
+bool ChatServer::loadFilterRules(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        emit logMessage(QLatin1String("Cannot read filter rules: ") + file.errorString());
+        return false;
+    }
+    int badLine = 0;
+    const QVector<MessageFilter::Rule> rules = MessageFilter::parseRules(file.readAll(), &badLine);
+    if (badLine != 0) {
+        emit logMessage(QStringLiteral("Filter rules not loaded, line %1 of %2 is malformed")
+                            .arg(badLine).arg(path));
+        return false;
+    }
+    setFilter(std::make_shared<const MessageFilter>(rules));
+    emit logMessage(QStringLiteral("%1 filter rules loaded").arg(rules.size()));
+    return true;
+}
+
+// Editors often replace the file, which drops it from the watcher
+void ChatServer::reloadFilterRules()
+{
+    loadFilterRules(m_settings.filterRulesPath);
+    if (!m_filterWatcher->files().contains(m_settings.filterRulesPath))
+        m_filterWatcher->addPath(m_settings.filterRulesPath);
+}
+
+// With per-thread listeners every thread is started up front and binds its
+// own socket to the port; the first one picks the port if none was given
+bool ChatServer::startServer(const QHostAddress &address, quint16 port)
+{
+#ifdef Q_OS_LINUX
+    if (m_settings.perThreadListeners) {
+        while (m_availableThreads.size() < m_idealThreadCount)
+            addThread();
+        for (int i = m_listeners.size(); i < m_availableThreads.size(); ++i) {
+            m_listeners.append(new ThreadListener(this, i));
+            m_listeners.last()->moveToThread(m_availableThreads.at(i));
+        }
+        bool listening = true;
+        for (ThreadListener *listener : qAsConst(m_listeners)) {
+            QMetaObject::invokeMethod(listener, [listener, address, &port, &listening]() {
+                listening = listener->listenShared(address, port);
+                port = listener->serverPort();
+            }, Qt::BlockingQueuedConnection);
+            if (!listening)
+                break;
+        }
+        if (!listening) {
+            for (ThreadListener *listener : qAsConst(m_listeners))
+                QMetaObject::invokeMethod(listener, &QTcpServer::close, Qt::BlockingQueuedConnection);
+        }
+        m_listenersRunning = listening;
+        m_listenersPort = listening ? port : 0;
+        m_acceptingPaused = false;
+        updateAdmission();
+        return listening;
+    }
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(6, 3, 0)
+    // The default of 50 drops SYNs in a reconnect storm; the kernel caps
+    // this at its own maximum, as it does for the per-thread listeners
+    setListenBacklogSize(4096);
+#endif
+    if (!listen(address, port))
+        return false;
+    m_acceptingPaused = false;
+    updateAdmission();
+    return true;
+}
+
+quint16 ChatServer::listeningPort() const
+{
+    return isListening() ? serverPort() : m_listenersPort;
+}
+
+bool ChatServer::isRunning() const
+{
+    return isListening() || m_listenersRunning;
+}
+
+// A connection accepted by a ThreadListener: the worker already lives on
+// its thread with the socket set up, it only needs a handle
+void ChatServer::adoptWorker(ServerWorker *worker, int threadIdx)
+{
+    // Already accepted when the listeners were paused
+    if (m_clients.size() >= connectionLimit()) {
+        ++m_refusedConnections;
+        emit logMessage(QStringLiteral("Connection limit reached"));
+        ThreadListener *listener = m_listeners.at(threadIdx);
+        QMetaObject::invokeMethod(worker, &ServerWorker::reset, Qt::QueuedConnection);
+        QMetaObject::invokeMethod(listener, [listener, worker]() {
+            listener->recycle(worker);
+        }, Qt::QueuedConnection);
+        return;
+    }
+    ++m_threadsLoad[threadIdx];
+    worker->setThreadIndex(threadIdx);
+    const ConnectionRegistry::Handle handle = m_clients.insert(worker);
+    Q_ASSERT(handle != 0);
+    worker->setHandle(handle);
+    QMetaObject::invokeMethod(worker, &ServerWorker::activate, Qt::QueuedConnection);
     emit logMessage(QStringLiteral("New client Connected"));
+    updateAdmission();
+}
+
+int ChatServer::connectionLimit() const
+{
+    const int registryLimit = int(ConnectionRegistry::MaxConnections);
+    return m_settings.maxConnections > 0 ? qMin(m_settings.maxConnections, registryLimit)
+                                         : registryLimit;
+}
+
+// Accepting pauses while the server is at its connection limit or its login
+// queue is full; new clients then wait in the listen backlog rather than
+// add to the backlog of logins. It resumes once both are well below, so a
+// server right at the limit does not flap.
+void ChatServer::updateAdmission()
+{
+    const qsizetype connections = m_clients.size();
+    const qsizetype pendingLogins = m_pendingLogins.size();
+    const int limit = connectionLimit();
+    const int maxQueuedLogins = m_settings.maxQueuedLogins;
+    bool overloaded;
+    if (m_acceptingPaused) {
+        overloaded = connections >= limit - limit / 10
+                     || (maxQueuedLogins > 0 && pendingLogins > maxQueuedLogins / 2);
+    } else {
+        overloaded = connections >= limit
+                     || (maxQueuedLogins > 0 && pendingLogins >= maxQueuedLogins);
+    }
+    if (overloaded == m_acceptingPaused)
+        return;
+    m_acceptingPaused = overloaded;
+    setAccepting(!overloaded);
+}
+
+void ChatServer::setAccepting(bool accepting)
+{
+    if (isListening()) {
+        if (accepting)
+            resumeAccepting();
+        else
+            pauseAccepting();
+    }
+    for (ThreadListener *listener : qAsConst(m_listeners)) {
+        QMetaObject::invokeMethod(listener, [listener, accepting]() {
+            if (!listener->isListening())
+                return;
+            if (accepting)
+                listener->resumeAccepting();
+            else
+                listener->pauseAccepting();
+        }, Qt::QueuedConnection);
+    }
+    emit logMessage(accepting ? QStringLiteral("Accepting connections again")
+                              : QStringLiteral("Server busy, accepting paused"));
+}
+
+ServerWorker *ChatServer::acquireWorker(int threadIdx)
+{
+    QVector<ServerWorker *> &idleWorkers = m_idleWorkers[threadIdx];
+    if (!idleWorkers.isEmpty()) {
+        ++m_workerPoolHits;
+        return idleWorkers.takeLast();
+    }
+    ++m_workerPoolMisses;
+    ServerWorker *worker = new ServerWorker(this);
+    worker->setThreadIndex(threadIdx);
+    worker->moveToThread(m_availableThreads.at(threadIdx));
+    return worker;
+}
+
+// The reset is queued on the worker's thread ahead of any later start(), so
+// the worker can be handed out again right away
+void ChatServer::releaseWorker(ServerWorker *worker, int threadIdx)
+{
+    worker->setHandle(0);
+    if (!m_listeners.isEmpty()) {
+        // Pooled where its thread accepts; the reset runs first
+        ThreadListener *listener = m_listeners.at(threadIdx);
+        QMetaObject::invokeMethod(worker, &ServerWorker::reset, Qt::QueuedConnection);
+        QMetaObject::invokeMethod(listener, [listener, worker]() {
+            listener->recycle(worker);
+        }, Qt::QueuedConnection);
+        return;
+    }
+    QVector<ServerWorker *> &idleWorkers = m_idleWorkers[threadIdx];
+    if (idleWorkers.size() >= MaxIdleWorkersPerThread) {
+        worker->deleteLater();
+        return;
+    }
+    QMetaObject::invokeMethod(worker, &ServerWorker::reset, Qt::QueuedConnection);
+    idleWorkers.append(worker);
+}
+
+ChatServer::PoolStatistics ChatServer::poolStatistics() const
+{
+    const FrameBufferPool::Statistics buffers = FrameBufferPool::totals();
+    PoolStatistics statistics = {m_workerPoolHits, m_workerPoolMisses, buffers.hits, buffers.misses};
+    for (const ThreadListener *listener : m_listeners) {
+        statistics.workerHits += listener->poolHits();
+        statistics.workerMisses += listener->poolMisses();
+    }
+    return statistics;
+}
+
+QVector<ChatServer::ThreadStatistics> ChatServer::threadStatistics() const
+{
+    return m_threadStatistics;
+}
+
+quint64 ChatServer::migrations() const
+{
+    return m_migrations;
+}
+
+ChatServer::DeliveryStatistics ChatServer::deliveryStatistics() const
+{
+    quint64 sameThread = m_retiredLocalDeliveries;
+    for (const ServerWorker *worker : m_clients)
+        sameThread += worker->localDeliveries();
+    return {sameThread, m_crossThreadDeliveries, m_duplicateMessages.loadRelaxed(),
+            m_droppedDeliveries.loadRelaxed(), m_coalescedEvents.loadRelaxed(), m_droppedEvents.loadRelaxed()};
+}
+
+ChatServer::AdmissionStatistics ChatServer::admissionStatistics() const
+{
+    return {m_refusedConnections, m_queuedLogins, m_deferredLogins, m_rejectedLogins,
+            m_authenticator ? m_authenticator->cacheHits() : 0,
+            int(m_pendingLogins.size()), m_acceptingPaused};
+}
+
+ChatServer::FloodStatistics ChatServer::floodStatistics() const
+{
+    return {m_pausedReads.loadRelaxed(), m_rejectedFrames.loadRelaxed(),
+            m_floodDisconnects.loadRelaxed()};
+}
+
+// Evens out the work the threads actually do rather than their connection
+// counts, and keeps users who talk to each other a lot on the same thread
+// so their messages skip the server thread.
+//
+// Each pass samples the work and the most frequent peers of every
+// connection since the last pass. Frequent pairs split across threads are
+// brought together first, as long as the receiving thread stays within a
+// quarter above the average. Then the busiest connections that fit move
+// from the most loaded thread to the least loaded one until the two would
+// be about level. A connection doing more than the difference on its own
+// stays put, moving it would only move the hot spot, and pairs brought
+// together are not split again.
+void ChatServer::balanceThreads()
+{
+    static constexpr quint64 MinImbalance = 256;
+    static constexpr int MaxMigrationsPerPass = 16;
+    static constexpr quint32 MinConversation = 8;
+    // A frame costs about as much as copying a KiB
+    const auto workCost = [](const ServerWorker::Work &work) {
+        return quint64(work.frames) + work.bytes / 1024;
+    };
+
+    probeThreads();
+    const qint64 now = m_clock.nsecsElapsed();
+    const qint64 elapsedNsecs = qMax<qint64>(now - m_lastBalanceNsecs, 1);
+    m_lastBalanceNsecs = now;
+
+    // Older conversations fade by half each pass
+    for (auto it = m_conversations.begin(); it != m_conversations.end();) {
+        it.value() /= 2;
+        if (it.value() == 0)
+            it = m_conversations.erase(it);
+        else
+            ++it;
+    }
+    const int threadCount = m_availableThreads.size();
+    QVector<ServerWorker::Work> threadWork(threadCount, ServerWorker::Work{0, 0});
+    QVector<quint64> threadCost(threadCount, 0);
+    QVector<std::pair<quint64, ServerWorker *>> workerCosts;
+    workerCosts.reserve(m_clients.size());
+    QHash<ServerWorker *, quint64> costByWorker;
+    costByWorker.reserve(m_clients.size());
+    quint64 totalCost = 0;
+    for (ServerWorker *worker : m_clients) {
+        const ServerWorker::Work work = worker->takeWork();
+        const int threadIdx = worker->threadIndex();
+        const quint64 cost = workCost(work);
+        threadWork[threadIdx].frames += work.frames;
+        threadWork[threadIdx].bytes += work.bytes;
+        threadCost[threadIdx] += cost;
+        totalCost += cost;
+        workerCosts.append(std::make_pair(cost, worker));
+        costByWorker.insert(worker, cost);
+
+        ServerWorker::PeerCount peers[ServerWorker::PeerSlots];
+        const int peerCount = worker->takePeers(peers);
+        for (int i = 0; i < peerCount; ++i) {
+            const quint32 low = qMin(worker->handle(), peers[i].handle);
+            const quint32 high = qMax(worker->handle(), peers[i].handle);
+            m_conversations[(quint64(low) << 32) | high] += peers[i].messages;
+        }
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        ThreadStatistics &statistics = m_threadStatistics[i];
+        statistics.connections = m_threadsLoad.at(i);
+        statistics.framesPerSecond = threadWork.at(i).frames * 1000000000 / elapsedNsecs;
+        statistics.bytesPerSecond = threadWork.at(i).bytes * 1000000000 / elapsedNsecs;
+    }
+    if (threadCount < 2)
+        return;
+
+    QVector<std::pair<quint32, quint64>> conversations;
+    for (auto it = m_conversations.cbegin(); it != m_conversations.cend(); ++it) {
+        if (it.value() >= MinConversation)
+            conversations.append(std::make_pair(it.value(), it.key()));
+    }
+    std::sort(conversations.begin(), conversations.end(), std::greater<>());
+    const quint64 costLimit = totalCost / threadCount * 5 / 4 + MinImbalance;
+    QSet<ServerWorker *> anchored;
+    int migrated = 0;
+    for (const auto &[messages, key] : qAsConst(conversations)) {
+        Q_UNUSED(messages)
+        ServerWorker *first = m_clients.value(quint32(key >> 32));
+        ServerWorker *second = m_clients.value(quint32(key));
+        if (!first || !second)
+            continue;
+        if (first->threadIndex() == second->threadIndex()) {
+            anchored.insert(first);
+            anchored.insert(second);
+            continue;
+        }
+        if (migrated == MaxMigrationsPerPass)
+            break;
+        // Move the lighter of the two if it fits, else the heavier
+        if (costByWorker.value(first) > costByWorker.value(second))
+            std::swap(first, second);
+        for (ServerWorker *mover : {first, second}) {
+            ServerWorker *partner = mover == first ? second : first;
+            const quint64 cost = costByWorker.value(mover);
+            const int targetIdx = partner->threadIndex();
+            if (anchored.contains(mover) || threadCost.at(targetIdx) + cost > costLimit)
+                continue;
+            threadCost[mover->threadIndex()] -= cost;
+            threadCost[targetIdx] += cost;
+            migrateWorker(mover, targetIdx);
+            anchored.insert(first);
+            anchored.insert(second);
+            ++migrated;
+            break;
+        }
+    }
+
+    const auto [idlest, busiest] = std::minmax_element(threadCost.cbegin(), threadCost.cend());
+    if (*busiest < *idlest + MinImbalance || *busiest * 4 < *idlest * 5)
+        return;
+    const int busiestIdx = int(std::distance(threadCost.cbegin(), busiest));
+    const int idlestIdx = int(std::distance(threadCost.cbegin(), idlest));
+    quint64 excess = (*busiest - *idlest) / 2;
+    std::sort(workerCosts.begin(), workerCosts.end(), std::greater<>());
+    for (const auto &[cost, worker] : qAsConst(workerCosts)) {
+        if (migrated == MaxMigrationsPerPass || cost == 0)
+            break;
+        if (worker->threadIndex() != busiestIdx || cost > excess || anchored.contains(worker))
+            continue;
+        migrateWorker(worker, idlestIdx);
+        excess -= cost;
+        ++migrated;
+    }
+}
+
+// moveToThread() has to run on the worker's current thread. Events already
+// posted to the worker, queued sends included, are carried over to the new
+// thread in order, so nothing in flight is lost or reordered.
+void ChatServer::migrateWorker(ServerWorker *worker, int threadIdx)
+{
+    const int fromIdx = worker->threadIndex();
+    Q_ASSERT(fromIdx != threadIdx);
+    --m_threadsLoad[fromIdx];
+    ++m_threadsLoad[threadIdx];
+    worker->setThreadIndex(threadIdx);
+    QThread *target = m_availableThreads.at(threadIdx);
+    QMetaObject::invokeMethod(worker, [worker, target]() {
+        worker->moveTo(target);
+    }, Qt::QueuedConnection);
+    ++m_migrations;
+}
+
+// Times how long a queued call waits on each thread
+void ChatServer::probeThreads()
+{
+    for (int i = 0; i < m_threadProbes.size(); ++i) {
+        const qint64 postedNsecs = m_clock.nsecsElapsed();
+        QMetaObject::invokeMethod(m_threadProbes.at(i), [this, i, postedNsecs]() {
+            const qint64 lagUsecs = (m_clock.nsecsElapsed() - postedNsecs) / 1000;
+            QMetaObject::invokeMethod(this, [this, i, lagUsecs]() {
+                m_threadStatistics[i].loopLagUsecs = lagUsecs;
+            }, Qt::QueuedConnection);
+        }, Qt::QueuedConnection);
+    }
 }
 
+// The handle is checked again when a delivery runs: a released worker has
+// its handle cleared and a reused one carries a new generation, so
+// anything queued for a connection that went away is dropped and counted
 void ChatServer::sendJson(ServerWorker *destination, const QJsonObject &message)
 {
     Q_ASSERT(destination);
-    QTimer::singleShot(0, destination,
-                       std::bind(&ServerWorker::sendJson, destination, message));
+    const ConnectionRegistry::Handle handle = destination->handle();
+    QTimer::singleShot(0, destination, [this, destination, handle, message]() {
+        if (destination->handle() == handle)
+            destination->sendJson(message);
+        else
+            m_droppedDeliveries.fetchAndAddRelaxed(1);
+    });
+}
+
+const QByteArray &ChatServer::payloadFor(const ServerWorker *worker, const QByteArray &payload,
+                                        QByteArray *compressed) const
+{
+    Q_ASSERT(worker && compressed);
+    if (!worker->wantsCompressed(payload.size()))
+        return payload;
+    if (compressed->isNull())
+        *compressed = MessageCodec::compress(payload);
+    // Incompressible payloads are tried once and then sent as they are
+    return compressed->size() < payload.size() ? *compressed : payload;
+}
+
+void ChatServer::sendFrame(ServerWorker *destination, const QByteArray &payload,
+                           quint32 senderHandle, quint32 messageId, ServerWorker::Lane lane)
+{
+    Q_ASSERT(destination);
+    const ConnectionRegistry::Handle handle = destination->handle();
+    QTimer::singleShot(0, destination, [this, destination, handle, payload, senderHandle, messageId,
+                                        lane]() {
+        const bool delivered = destination->handle() == handle;
+        if (delivered)
+            destination->sendFrame(payload, lane);
+        else
+            m_droppedDeliveries.fetchAndAddRelaxed(1);
+        if (messageId == 0 || (delivered && destination->holdAck(senderHandle, messageId)))
+            return;
+        // The sender may be gone too, so it is looked up again by handle
+        const ServerWorker::AckOutcome outcome = delivered ? ServerWorker::AckOutcome::Delivered
+                                                           : ServerWorker::AckOutcome::Failed;
+        QMetaObject::invokeMethod(this, [this, senderHandle, outcome, messageId]() {
+            acknowledge(senderHandle, outcome, messageId);
+        }, Qt::QueuedConnection);
+    });
 }
 
+void ChatServer::acknowledge(quint32 senderHandle, ServerWorker::AckOutcome outcome,
+                             quint32 messageId)
+{
+    if (messageId == 0)
+        return;
+    if (m_pendingAcks.isEmpty())
+        QMetaObject::invokeMethod(this, &ChatServer::flushAcks, Qt::QueuedConnection);
+    m_pendingAcks[senderHandle].append(outcome, messageId);
+}
+
+// The sender's worker forgets the failed ids before the client hears of
+// them, so a resend is routed again rather than taken for a duplicate
+void ChatServer::flushAcks()
+{
+    for (auto it = m_pendingAcks.cbegin(); it != m_pendingAcks.cend(); ++it) {
+        ServerWorker *sender = m_clients.value(it.key());
+        if (!sender)
+            continue;
+        if (it.value().failed.isEmpty()) {
+            sendJson(sender, it.value().toJson());
+            continue;
+        }
+        const quint32 handle = it.key();
+        const QVector<quint32> failed = it.value().failed;
+        const QJsonObject message = it.value().toJson();
+        QTimer::singleShot(0, sender, [this, sender, handle, failed, message]() {
+            if (sender->handle() != handle) {
+                m_droppedDeliveries.fetchAndAddRelaxed(1);
+                return;
+            }
+            sender->forgetMessages(failed);
+            sender->sendJson(message);
+        });
+    }
+    m_pendingAcks.clear();
+}
+
+void ChatServer::acknowledgeHeld(const QVector<quint64> &heldAcks, ServerWorker::AckOutcome outcome)
+{
+    for (quint64 heldAck : heldAcks)
+        acknowledge(quint32(heldAck >> 32), outcome, quint32(heldAck));
+}
+
+// Posted after the deliveries the message made, so on a shared thread the
+// sender hears of it only once they are queued there
+void ChatServer::messageRouted(quint32 senderHandle)
+{
+    ServerWorker *sender = m_clients.value(senderHandle);
+    if (!sender)
+        return;
+    QTimer::singleShot(0, sender, [sender, senderHandle]() {
+        if (sender->handle() == senderHandle)
+            sender->messageRouted();
+    });
+}
+
+// To logged in users only, the roster is nobody else's business
 void ChatServer::broadcast(const QJsonObject &message, ServerWorker *exclude)
 {
+    const ServerWorker::Lane lane = ServerWorker::laneFor(message);
+    // Encode and compress once per codec in use and share the bytes between
+    // recipients
+    QByteArray payloads[2];
+    QByteArray compressedPayloads[2];
     for (ServerWorker *worker : m_clients) {
         Q_ASSERT(worker);
-        if (worker == exclude)
+        if (worker == exclude || worker->userId() == 0)
             continue;
-        sendJson(worker, message);
+        const MessageCodec::Codec codec = worker->codec();
+        if (payloads[codec].isNull())
+            payloads[codec] = MessageCodec::encode(message, codec);
+        sendFrame(worker, payloadFor(worker, payloads[codec], &compressedPayloads[codec]), 0, 0,
+                  lane);
     }
 }
 
-void ChatServer::broadcast(const QJsonObject &message, const QString &recipientName)
+void ChatServer::jsonReceived(quint32 senderHandle, const QJsonObject &json)
+{
+    ServerWorker *sender = m_clients.value(senderHandle);
+    if (!sender)
+        return;
+    emit logMessage(QLatin1String("JSON received ")
+                    + QString::fromUtf8(QJsonDocument(MessageCodec::redacted(json)).toJson()));
+    using Handler = void (ChatServer::*)(ServerWorker *, const QJsonObject &);
+    using HandlerTable = std::array<Handler, Protocol::MessageTypeCount>;
+    // What a client may send depends on whether it has logged in yet
+    static constexpr HandlerTable loggedOutHandlers = [] {
+        HandlerTable handlers{};
+        handlers[int(Protocol::MessageType::Login)] = &ChatServer::handleLogin;
+        return handlers;
+    }();
+    static constexpr HandlerTable loggedInHandlers = [] {
+        HandlerTable handlers{};
+        handlers[int(Protocol::MessageType::Message)] = &ChatServer::handleMessage;
+        handlers[int(Protocol::MessageType::FileOffer)] = &ChatServer::handleFileOffer;
+        handlers[int(Protocol::MessageType::FileAccept)] = &ChatServer::handleFileAccept;
+        handlers[int(Protocol::MessageType::FileCancel)] = &ChatServer::handleFileCancel;
+        handlers[int(Protocol::MessageType::Event)] = &ChatServer::handleEvent;
+        return handlers;
+    }();
+
+    const QJsonValue typeVal = json.value(QLatin1String("type"));
+    if (!typeVal.isString())
+        return;
+    const Protocol::MessageType type = Protocol::messageType(typeVal.toString());
+    if (type == Protocol::MessageType::Unknown)
+        return;
+    const HandlerTable &handlers = sender->userId() == 0 ? loggedOutHandlers
+                                                         : loggedInHandlers;
+    if (const Handler handler = handlers[int(type)])
+        (this->*handler)(sender, json);
+}
+
+void ChatServer::relayReceived(quint32 senderHandle, const QByteArray &payload)
 {
+    ServerWorker *sender = m_clients.value(senderHandle);
+    if (!sender)
+        return;
+    emit logMessage(QLatin1String("Relay received ") + MessageCodec::toDisplayString(payload));
+    if (sender->userId() == 0)
+        return;
+    MessageCodec::RelayFrame frame;
+    if (!MessageCodec::decodeRelay(payload, &frame))
+        return;
+    const quint32 messageId = frame.messageId;
+    if (!Utf8::isValid(frame.peer) || !Utf8::isValid(frame.text)) {
+        emit logMessage(QLatin1String("Invalid UTF-8 from ") + sender->userName());
+        return acknowledge(senderHandle, ServerWorker::AckOutcome::Failed, messageId);
+    }
+    ServerWorker *recipient = nullptr;
+    if (frame.peerId != 0) {
+        recipient = userById(frame.peerId);
+    } else if (frame.peer.isEmpty()) {
+        return routeText(sender, nullptr, frame.text, messageId);
+    } else {
+        const QByteArrayView recipientName = Utf8::trimmed(frame.peer);
+        if (!recipientName.isEmpty())
+            recipient = userByName(QString::fromUtf8(recipientName));
+    }
+    if (!recipient)
+        return acknowledge(senderHandle, ServerWorker::AckOutcome::Failed, messageId);
+    routeText(sender, recipient, frame.text, messageId);
+}
+
+// Message text stays validated UTF-8 from here on. Relay capable recipients
+// get the sender header plus the original bytes; only clients without relay
+// support cost a conversion and an encode. Each payload variant (sender by
+// name or by id, relay or codec) is built once and shared.
+void ChatServer::routeText(ServerWorker *sender, ServerWorker *recipient, QByteArrayView text,
+                           quint32 messageId)
+{
+    Q_ASSERT(sender);
+    const quint32 senderHandle = sender->handle();
+    text = Utf8::trimmed(text);
+    if (text.isEmpty())
+        return acknowledge(senderHandle, ServerWorker::AckOutcome::Failed, messageId);
+    const quint32 senderId = sender->userId();
+    const QByteArray &senderName = sender->userNameUtf8();
+    QByteArray relayPayloads[2];
+    QByteArray codecPayloads[2][2];
+    QByteArray compressedRelayPayloads[2];
+    QByteArray compressedCodecPayloads[2][2];
+    const auto deliver = [&](ServerWorker *worker, quint32 receiptId) {
+        const int features = worker->features();
+        const bool byId = features & MessageCodec::UserIds;
+        if (features & MessageCodec::RelayFrames) {
+            QByteArray &relayPayload = relayPayloads[byId];
+            if (relayPayload.isNull()) {
+                relayPayload = byId ? MessageCodec::encodeRelay(senderId, text)
+                                    : MessageCodec::encodeRelay(senderName, text);
+            }
+            // A name too long for the relay header goes in the codec instead
+            if (!relayPayload.isNull()) {
+                sendFrame(worker, payloadFor(worker, relayPayload, &compressedRelayPayloads[byId]),
+                          senderHandle, receiptId);
+                ++m_crossThreadDeliveries;
+                return;
+            }
+        }
+        const MessageCodec::Codec codec = worker->codec();
+        QByteArray &codecPayload = codecPayloads[byId][codec];
+        if (codecPayload.isNull()) {
+            QJsonObject message;
+            message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Message);
+            message[QStringLiteral("text")] = QString::fromUtf8(text);
+            if (byId)
+                message[QStringLiteral("senderId")] = qint64(senderId);
+            else
+                message[QStringLiteral("sender")] = QString::fromUtf8(senderName);
+            codecPayload = MessageCodec::encode(message, codec);
+        }
+        sendFrame(worker, payloadFor(worker, codecPayload, &compressedCodecPayloads[byId][codec]),
+                  senderHandle, receiptId);
+        ++m_crossThreadDeliveries;
+    };
+
+    if (recipient) {
+        sender->notePeer(recipient->handle());
+        acknowledge(senderHandle, ServerWorker::AckOutcome::Accepted, messageId);
+        return deliver(recipient, messageId);
+    }
+    QVector<bool> recipientThreads(m_threadProbes.size(), false);
     for (ServerWorker *worker : m_clients) {
-        if (worker->userName() == recipientName)
-        {
-            Q_ASSERT(worker);
-            sendJson(worker, message);
-            return;
+        if (worker != sender && worker->userId() != 0) {
+            deliver(worker, 0);
+            recipientThreads[worker->threadIndex()] = true;
         }
     }
-
+    if (messageId == 0)
+        return;
+    // Each recipient thread's probe runs behind the deliveries posted there,
+    // the last one to run acknowledges
+    const int threadCount = int(recipientThreads.count(true));
+    if (threadCount == 0)
+        return acknowledge(senderHandle, ServerWorker::AckOutcome::Delivered, messageId);
+    const auto remaining = std::make_shared<QAtomicInt>(threadCount);
+    for (int i = 0; i < recipientThreads.size(); ++i) {
+        if (!recipientThreads.at(i))
+            continue;
+        QMetaObject::invokeMethod(m_threadProbes.at(i), [this, remaining, senderHandle, messageId]() {
+            if (remaining->deref())
+                return;
+            QMetaObject::invokeMethod(this, [this, senderHandle, messageId]() {
+                acknowledge(senderHandle, ServerWorker::AckOutcome::Delivered, messageId);
+            }, Qt::QueuedConnection);
+        }, Qt::QueuedConnection);
+    }
 }
 
-void ChatServer::jsonReceived(ServerWorker *sender, const QJsonObject &json)
+// A client with a session is kept for the resume window; its worker goes
+// on buffering what is sent to it and the others are not told yet
+void ChatServer::userDisconnected(quint32 senderHandle)
 {
-    Q_ASSERT(sender);
-    emit logMessage(QLatin1String("JSON received ")
-                    + QString::fromUtf8(QJsonDocument(json).toJson()));
-    if (sender->userName().isEmpty())
-        return jsonFromLoggedOut(sender, json);
-    jsonFromLoggedIn(sender, json);
+    ServerWorker *sender = m_clients.value(senderHandle);
+    if (!sender)
+        return;
+    // Even a resumed session starts its files over
+    cancelFileTransfers(senderHandle);
+    const auto session = m_sessions.find(senderHandle);
+    if (session != m_sessions.end() && session->detachedUntilNsecs == 0 && !session->previous) {
+        const qint64 windowNsecs = qint64(m_settings.resumeWindowSecs) * 1000000000;
+        session->detachedUntilNsecs = m_clock.nsecsElapsed() + windowNsecs;
+        m_detachedSessions.enqueue({session->detachedUntilNsecs, senderHandle});
+        // Otherwise an earlier session expires first
+        if (!m_sessionTimer->isActive())
+            m_sessionTimer->start(m_settings.resumeWindowSecs * 1000);
+        emit logMessage(sender->userName() + QLatin1String(" dropped off, session kept"));
+        return;
+    }
+    removeConnection(sender);
 }
 
-void ChatServer::userDisconnected(ServerWorker *sender, int threadIdx)
+void ChatServer::removeConnection(ServerWorker *sender)
 {
+    const quint32 senderHandle = sender->handle();
+    const auto session = m_sessions.constFind(senderHandle);
+    if (session != m_sessions.cend()) {
+        m_sessionTokens.remove(session->token);
+        m_sessions.erase(session);
+    }
+    const int threadIdx = sender->threadIndex();
     --m_threadsLoad[threadIdx];
-    m_clients.removeAll(sender);
-    const QString userName = sender->userName();
-    if(!userName.isEmpty()) {
+    m_retiredLocalDeliveries += sender->localDeliveries();
+    m_clients.remove(senderHandle);
+    const quint32 userId = sender->userId();
+    if (userId != 0) {
+        const QString &userName = sender->userName();
+        releaseUserId(sender);
         QJsonObject disconnectedMessage;
         disconnectedMessage[QStringLiteral("type")]
-            = QStringLiteral("user disconnected");
+            = Protocol::typeName(Protocol::MessageType::UserDisconnected);
         disconnectedMessage[QStringLiteral("username")] = userName;
+        disconnectedMessage[QStringLiteral("id")] = qint64(userId);
         broadcast(disconnectedMessage, nullptr);
         emit logMessage(userName + QLatin1String(" disconnected"));
-        updateUsers();
+        if (!m_usersTimer->isActive())
+            m_usersTimer->start();
+    }
+    releaseWorker(sender, threadIdx);
+    updateAdmission();
+}
+
+void ChatServer::expireSessions()
+{
+    const qint64 now = m_clock.nsecsElapsed();
+    while (!m_detachedSessions.isEmpty() && m_detachedSessions.head().first <= now) {
+        const auto [deadline, userId] = m_detachedSessions.dequeue();
+        // Gone, or resumed and maybe detached again since
+        const auto session = m_sessions.constFind(userId);
+        if (session == m_sessions.cend() || session->detachedUntilNsecs != deadline)
+            continue;
+        if (ServerWorker *worker = m_clients.value(userId))
+            removeConnection(worker);
+    }
+    if (!m_detachedSessions.isEmpty()) {
+        const qint64 waitNsecs = m_detachedSessions.head().first - now;
+        m_sessionTimer->start(int(qMax<qint64>((waitNsecs + 999999) / 1000000, 1)));
     }
-    sender->deleteLater();
 }
 
-void ChatServer::userError(ServerWorker *sender)
+void ChatServer::userError(quint32 senderHandle)
 {
-    Q_UNUSED(sender)
+    const ServerWorker *sender = m_clients.value(senderHandle);
+    if (!sender)
+        return;
     emit logMessage(QLatin1String("Client ") + sender->userName() + QLatin1String(" Error"));
 }
 
 void ChatServer::stopServer()
 {
-    emit stopAllClients();
+    for (ServerWorker *worker : m_clients)
+        QMetaObject::invokeMethod(worker, &ServerWorker::disconnectFromClient, Qt::QueuedConnection);
+    for (ThreadListener *listener : qAsConst(m_listeners))
+        QMetaObject::invokeMethod(listener, &QTcpServer::close, Qt::BlockingQueuedConnection);
+    m_listenersRunning = false;
     close();
 }
 
@@ -138,73 +959,605 @@ QStringList ChatServer::updateUsers()
     return userNames;
 }
 
-void ChatServer::jsonFromLoggedOut(ServerWorker *sender, const QJsonObject &docObj)
+quint32 ChatServer::assignUserId(ServerWorker *worker, const QString &userName)
+{
+    Q_ASSERT(worker && worker->userId() == 0);
+    const quint32 userId = worker->handle();
+    m_userIds.insert(userName.toCaseFolded(), userId);
+    worker->setIdentity(userName, userId);
+    return userId;
+}
+
+void ChatServer::releaseUserId(ServerWorker *worker)
+{
+    Q_ASSERT(worker->userId() != 0);
+    m_userIds.remove(worker->userName().toCaseFolded());
+}
+
+ServerWorker *ChatServer::userById(quint32 userId) const
+{
+    ServerWorker *worker = m_clients.value(userId);
+    return worker && worker->userId() != 0 ? worker : nullptr;
+}
+
+ServerWorker *ChatServer::userByName(const QString &userName) const
+{
+    return userById(m_userIds.value(userName.toCaseFolded()));
+}
+
+void ChatServer::handleLogin(ServerWorker *sender, const QJsonObject &docObj)
 {
     Q_ASSERT(sender);
-    const QJsonValue typeVal = docObj.value(QLatin1String("type"));
-    if (typeVal.isNull() || !typeVal.isString())
+    if (m_loginHandles.contains(sender->handle()))
         return;
-    if (typeVal.toString().compare(QLatin1String("login"), Qt::CaseInsensitive) != 0)
+    // A resume brings back a user the others never saw leave, so it does
+    // not wait for the rate limit; its session token stands for the password
+    if (docObj.contains(QLatin1String("session")) && resumeSession(sender, docObj))
         return;
+    admitLogin(sender, docObj);
+}
+
+// Past the rate limit, so that bounds the password checks too
+void ChatServer::checkLogin(ServerWorker *sender, const QJsonObject &docObj)
+{
+    if (!m_authenticator) {
+        acceptLogin(sender, docObj);
+        return;
+    }
+    m_loginHandles.insert(sender->handle());
+    m_authenticator->verify(sender->handle(), docObj);
+}
+
+// Password checks run on the Authenticator's own pool; a client that left
+// or logged in meanwhile is not answered again
+void ChatServer::authenticated(quint32 handle, const QJsonObject &login,
+                               Authenticator::Result result)
+{
+    m_loginHandles.remove(handle);
+    ServerWorker *sender = m_clients.value(handle);
+    if (!sender || sender->userId() != 0)
+        return;
+    switch (result) {
+    case Authenticator::Result::Accepted:
+        acceptLogin(sender, login);
+        break;
+    case Authenticator::Result::Rejected: {
+        ++m_rejectedLogins;
+        emit logMessage(QLatin1String("Invalid credentials for ")
+                        + login.value(QLatin1String("username")).toString());
+        QJsonObject message;
+        message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Login);
+        message[QStringLiteral("success")] = false;
+        message[QStringLiteral("reason")] = QStringLiteral("invalid credentials");
+        sendJson(sender, message);
+        break;
+    }
+    case Authenticator::Result::Busy:
+        deferLogin(sender);
+        break;
+    }
+}
+
+// Every login costs a roster for the new user and a broadcast to everyone
+// else, so after a restart they are let through at a steady rate rather
+// than all at once. Logins over the rate wait their turn in order.
+void ChatServer::admitLogin(ServerWorker *sender, const QJsonObject &docObj)
+{
+    if (m_pendingLogins.isEmpty() && m_loginBucket.tryTake(m_clock.nsecsElapsed())) {
+        checkLogin(sender, docObj);
+        return;
+    }
+    if (m_settings.maxQueuedLogins > 0 && m_pendingLogins.size() < m_settings.maxQueuedLogins) {
+        m_loginHandles.insert(sender->handle());
+        m_pendingLogins.enqueue(PendingLogin{sender->handle(), docObj});
+        ++m_queuedLogins;
+        if (!m_loginTimer->isActive())
+            processPendingLogins();
+        updateAdmission();
+        return;
+    }
+    deferLogin(sender);
+}
+
+void ChatServer::processPendingLogins()
+{
+    const qint64 now = m_clock.nsecsElapsed();
+    while (!m_pendingLogins.isEmpty()) {
+        const quint32 handle = m_pendingLogins.head().handle;
+        ServerWorker *sender = m_clients.value(handle);
+        // Gone or logged in by an earlier request, no token spent on it
+        if (!sender || sender->userId() != 0) {
+            m_loginHandles.remove(handle);
+            m_pendingLogins.dequeue();
+            continue;
+        }
+        if (!m_loginBucket.tryTake(now))
+            break;
+        m_loginHandles.remove(handle);
+        checkLogin(sender, m_pendingLogins.dequeue().login);
+    }
+    if (!m_pendingLogins.isEmpty()) {
+        const qint64 waitNsecs = m_loginBucket.nsecsUntilAvailable(now);
+        m_loginTimer->start(int(qMax<qint64>((waitNsecs + 999999) / 1000000, 1)));
+    }
+    updateAdmission();
+}
+
+// The queue is full: the client is told how long the queue takes to drain
+// and logs in again after that
+void ChatServer::deferLogin(ServerWorker *sender)
+{
+    static constexpr qint64 MinRetryMsecs = 1000;
+    const qint64 perSecond = qMax(m_settings.loginsPerSecond, 1);
+    const qint64 retryMsecs = qMax(MinRetryMsecs, qint64(m_pendingLogins.size() + 1) * 1000 / perSecond);
+    ++m_deferredLogins;
+    QJsonObject message;
+    message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Login);
+    message[QStringLiteral("success")] = false;
+    message[QStringLiteral("reason")] = QStringLiteral("server busy");
+    message[QStringLiteral("retryAfter")] = retryMsecs;
+    sendJson(sender, message);
+}
+
+void ChatServer::acceptLogin(ServerWorker *sender, const QJsonObject &docObj)
+{
+    Q_ASSERT(sender);
     const QJsonValue usernameVal = docObj.value(QLatin1String("username"));
     if (usernameVal.isNull() || !usernameVal.isString())
         return;
     const QString newUserName = usernameVal.toString().simplified();
     if (newUserName.isEmpty())
         return;
-    for (ServerWorker *worker : qAsConst(m_clients)) {
-        if (worker == sender)
-            continue;
-        if (worker->userName().compare(newUserName, Qt::CaseInsensitive) == 0) {
-            QJsonObject message;
-            message[QStringLiteral("type")] = QStringLiteral("login");
-            message[QStringLiteral("success")] = false;
-            message[QStringLiteral("reason")] = QStringLiteral("duplicate username");
-            sendJson(sender, message);
-            return;
+    ServerWorker *existing = userByName(newUserName);
+    if (existing) {
+        // A detached session under that name: its client started over
+        // rather than resuming, so the session ends as if it had expired
+        const auto session = m_sessions.constFind(existing->handle());
+        if (session != m_sessions.cend() && session->detachedUntilNsecs != 0 && !session->previous) {
+            removeConnection(existing);
+            existing = nullptr;
         }
     }
-    sender->setUserName(newUserName);
-    QJsonObject successMessage;
-    successMessage[QStringLiteral("type")] = QStringLiteral("login");
-    successMessage[QStringLiteral("success")] = true;
-    successMessage[QStringLiteral("users")] = QJsonArray::fromStringList(updateUsers());
-    sendJson(sender, successMessage);
+    if (existing) {
+        QJsonObject message;
+        message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Login);
+        message[QStringLiteral("success")] = false;
+        message[QStringLiteral("reason")] = QStringLiteral("duplicate username");
+        sendJson(sender, message);
+        return;
+    }
+    // Clients list the codecs they understand; anyone else stays on JSON
+    MessageCodec::Codec codec = MessageCodec::Json;
+    const QJsonArray codecsArray = docObj.value(QLatin1String("codecs")).toArray();
+    for (const QJsonValueConstRef &codecVal : codecsArray) {
+        bool known = false;
+        const MessageCodec::Codec offered = MessageCodec::codecFromName(codecVal.toString(), &known);
+        if (known && offered == MessageCodec::Cbor) {
+            codec = offered;
+            break;
+        }
+    }
+    int features = MessageCodec::featuresFromNames(
+        docObj.value(QLatin1String("features")).toArray());
+    if (m_settings.resumeWindowSecs <= 0 || m_settings.replayFrames <= 0)
+        features &= ~MessageCodec::Resume;
+    if (m_settings.compressMinBytes <= 0)
+        features &= ~MessageCodec::Compression;
+    const quint32 userId = assignUserId(sender, newUserName);
+    sender->setCodec(codec);
+    sender->setFeatures(features);
+    QJsonObject successMessage = loginReply(sender, true);
+    if (features & MessageCodec::Resume) {
+        quint64 words[2];
+        QRandomGenerator::system()->fillRange(words);
+        const QByteArray token = QByteArray(reinterpret_cast<const char *>(words), sizeof(words)).toHex();
+        m_sessions.insert(userId, Session{token, 0, nullptr});
+        m_sessionTokens.insert(token, userId);
+        successMessage[QStringLiteral("session")] = QString::fromLatin1(token);
+    }
+    if (m_authenticator)
+        successMessage[QStringLiteral("authToken")] = m_authenticator->issueToken(newUserName);
+    sendLoginReply(sender, successMessage);
     QJsonObject connectedMessage;
-    connectedMessage[QStringLiteral("type")] = QStringLiteral("new user");
+    connectedMessage[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::NewUser);
     connectedMessage[QStringLiteral("username")] = newUserName;
+    connectedMessage[QStringLiteral("id")] = qint64(userId);
     broadcast(connectedMessage, sender);
 
-    updateUsers();
+    if (!m_usersTimer->isActive())
+        m_usersTimer->start();
 }
 
-void ChatServer::jsonFromLoggedIn(ServerWorker *sender, const QJsonObject &docObj)
+QJsonObject ChatServer::loginReply(const ServerWorker *user, bool withRoster) const
 {
-    Q_ASSERT(sender);
-    const QJsonValue typeVal = docObj.value(QLatin1String("type"));
-    if (typeVal.isNull() || !typeVal.isString())
-        return;
-    if (typeVal.toString().compare(QLatin1String("message"), Qt::CaseInsensitive) != 0)
+    QJsonObject reply;
+    reply[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Login);
+    reply[QStringLiteral("success")] = true;
+    const int features = user->features();
+    if (withRoster) {
+        QJsonArray users;
+        QJsonArray userIds;
+        for (const ServerWorker *worker : m_clients) {
+            if (worker->userId() == 0)
+                continue;
+            users.append(worker->userName());
+            userIds.append(qint64(worker->userId()));
+        }
+        reply[QStringLiteral("users")] = users;
+        if (features & MessageCodec::UserIds)
+            reply[QStringLiteral("userIds")] = userIds;
+    }
+    if (features & MessageCodec::UserIds)
+        reply[QStringLiteral("id")] = qint64(user->userId());
+    if (user->codec() != MessageCodec::Json)
+        reply[QStringLiteral("codec")] = MessageCodec::codecName(user->codec());
+    if (features != 0)
+        reply[QStringLiteral("features")] = MessageCodec::featureNames(features);
+    return reply;
+}
+
+// Frames are numbered from the one after the reply, so the session starts
+// in the same call on the worker's thread
+void ChatServer::sendLoginReply(ServerWorker *destination, const QJsonObject &reply)
+{
+    Q_ASSERT(destination);
+    const ConnectionRegistry::Handle handle = destination->handle();
+    const bool resumable = destination->features() & MessageCodec::Resume;
+    QTimer::singleShot(0, destination, [this, destination, handle, reply, resumable]() {
+        if (destination->handle() != handle) {
+            m_droppedDeliveries.fetchAndAddRelaxed(1);
+            return;
+        }
+        destination->sendJson(reply);
+        if (resumable)
+            destination->startSession();
+    });
+}
+
+// The new connection takes over the detached one's handle, and with it the
+// user id and everything already queued for it. The old worker is asked
+// for the frames the client missed ahead of the new one entering the
+// thread table, so on a shared thread the two are never listed together.
+bool ChatServer::resumeSession(ServerWorker *sender, const QJsonObject &docObj)
+{
+    const QByteArray token = docObj.value(QLatin1String("session")).toString().toLatin1();
+    const quint32 userId = m_sessionTokens.value(token);
+    const auto session = m_sessions.find(userId);
+    if (session == m_sessions.end() || session->previous)
+        return false;
+    ServerWorker *previous = m_clients.value(userId);
+    Q_ASSERT(previous);
+    const QString userName = docObj.value(QLatin1String("username")).toString().simplified();
+    if (userName.toCaseFolded() != previous->userName().toCaseFolded())
+        return false;
+    if (session->detachedUntilNsecs == 0) {
+        // The old connection is likely dead without the server knowing yet:
+        // drop it, its session gets detached, and the client comes back
+        // shortly. Not a deferred login, the server is not busy.
+        static constexpr qint64 ResumeRetryMsecs = 500;
+        QMetaObject::invokeMethod(previous, &ServerWorker::abortConnection, Qt::QueuedConnection);
+        QJsonObject message;
+        message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Login);
+        message[QStringLiteral("success")] = false;
+        message[QStringLiteral("reason")] = QStringLiteral("session still attached");
+        message[QStringLiteral("retryAfter")] = ResumeRetryMsecs;
+        sendJson(sender, message);
+        return true;
+    }
+    const quint64 lastSequence = quint64(docObj.value(QLatin1String("lastSeq")).toInteger());
+    --m_threadsLoad[previous->threadIndex()];
+    m_retiredLocalDeliveries += previous->localDeliveries();
+    m_clients.remove(sender->handle());
+    m_clients.replace(userId, sender);
+    sender->setHandle(userId);
+    sender->setIdentity(previous->userName(), userId);
+    sender->setCodec(previous->codec());
+    sender->setFeatures(previous->features());
+    session->detachedUntilNsecs = 0;
+    session->previous = previous;
+    QMetaObject::invokeMethod(previous, [this, previous, userId, lastSequence]() {
+        QVector<QByteArray> replay;
+        DedupWindow messageIds;
+        const bool complete = previous->exportSession(lastSequence, &replay, &messageIds);
+        const QVector<quint64> heldAcks = previous->takeHeldAcks();
+        QMetaObject::invokeMethod(this, [this, previous, userId, complete, replay, lastSequence,
+                                         messageIds, heldAcks]() {
+            finishResume(previous, userId, complete, replay, lastSequence, messageIds, heldAcks);
+        }, Qt::QueuedConnection);
+    }, Qt::QueuedConnection);
+    QMetaObject::invokeMethod(sender, &ServerWorker::beginResume, Qt::QueuedConnection);
+    emit logMessage(previous->userName() + QLatin1String(" resumed their session"));
+    return true;
+}
+
+// Without the client's last frame in the buffer the resume falls back to a
+// fresh login reply with the roster; the others still never saw a change.
+// Messages that arrived while the client was away are delivered with the
+// replay, or lost with it.
+void ChatServer::finishResume(ServerWorker *previous, quint32 userId, bool complete,
+                              const QVector<QByteArray> &replay, quint64 lastSequence,
+                              const DedupWindow &messageIds, const QVector<quint64> &heldAcks)
+{
+    releaseWorker(previous, previous->threadIndex());
+    const auto session = m_sessions.find(userId);
+    ServerWorker *sender = m_clients.value(userId);
+    if (session == m_sessions.end() || session->previous != previous || !sender) {
+        acknowledgeHeld(heldAcks, ServerWorker::AckOutcome::Failed);
         return;
+    }
+    session->previous = nullptr;
+    acknowledgeHeld(heldAcks, complete ? ServerWorker::AckOutcome::Delivered
+                                       : ServerWorker::AckOutcome::Failed);
+    QJsonObject reply = loginReply(sender, !complete);
+    if (complete) {
+        reply[QStringLiteral("resumed")] = true;
+        reply[QStringLiteral("replayed")] = replay.size();
+    } else {
+        emit logMessage(sender->userName() + QLatin1String(" missed too much to resume"));
+    }
+    reply[QStringLiteral("session")] = QString::fromLatin1(session->token);
+    const ConnectionRegistry::Handle handle = sender->handle();
+    const QVector<QByteArray> frames = complete ? replay : QVector<QByteArray>();
+    const quint64 sequence = complete ? lastSequence : 0;
+    QTimer::singleShot(0, sender, [this, sender, handle, reply, frames, sequence, messageIds]() {
+        if (sender->handle() == handle)
+            sender->completeResume(reply, frames, sequence, messageIds);
+        else
+            m_droppedDeliveries.fetchAndAddRelaxed(1);
+    });
+}
+
+void ChatServer::handleMessage(ServerWorker *sender, const QJsonObject &docObj)
+{
+    Q_ASSERT(sender);
+    const quint32 senderHandle = sender->handle();
+    const quint32 messageId = quint32(docObj.value(QLatin1String("msgId")).toInteger());
     const QJsonValue textVal = docObj.value(QLatin1String("text"));
     if (textVal.isNull() || !textVal.isString())
-        return;
-    const QString text = textVal.toString().trimmed();
-    if (text.isEmpty())
-        return;
-    QJsonObject message;
-    message[QStringLiteral("type")] = QStringLiteral("message");
-    message[QStringLiteral("text")] = text;
-    message[QStringLiteral("sender")] = sender->userName();
+        return acknowledge(senderHandle, ServerWorker::AckOutcome::Failed, messageId);
+    const QByteArray text = textVal.toString().toUtf8();
 
+    ServerWorker *recipient = nullptr;
+    const QJsonValue recipientIdVal = docObj.value(QLatin1String("recipientId"));
     const QJsonValue recipientVal = docObj.value(QLatin1String("recipient"));
-    if (recipientVal.isNull() || !recipientVal.isString())
-        broadcast(message, sender);
-    else {
+    if (recipientIdVal.isDouble()) {
+        recipient = userById(quint32(recipientIdVal.toInteger()));
+    } else if (recipientVal.isNull() || !recipientVal.isString()) {
+        return routeText(sender, nullptr, text, messageId);
+    } else {
         const QString recipientName = recipientVal.toString().trimmed();
-        broadcast(message, recipientName);
+        if (!recipientName.isEmpty())
+            recipient = userByName(recipientName);
     }
+    if (!recipient)
+        return acknowledge(senderHandle, ServerWorker::AckOutcome::Failed, messageId);
+    routeText(sender, recipient, text, messageId);
+}
+
+// Files go to one recipient that agreed on Files, and the data follows once
+// the recipient accepted the offer; either side may cancel at any point
+void ChatServer::handleFileOffer(ServerWorker *sender, const QJsonObject &docObj)
+{
+    Q_ASSERT(sender);
+    const quint32 transferId = quint32(docObj.value(QLatin1String("transferId")).toInteger());
+    if (transferId == 0)
+        return;
+    const quint64 key = (quint64(sender->handle()) << 32) | transferId;
+    if (m_fileTransfers.contains(key))
+        return sendFileCancel(sender, transferId, false, QStringLiteral("duplicate transfer id"));
+    const QString name = docObj.value(QLatin1String("name")).toString();
+    const qint64 size = docObj.value(QLatin1String("size")).toInteger();
+    if (name.isEmpty() || size <= 0)
+        return sendFileCancel(sender, transferId, false, QStringLiteral("invalid offer"));
+    ServerWorker *recipient = nullptr;
+    const QJsonValue recipientIdVal = docObj.value(QLatin1String("recipientId"));
+    if (recipientIdVal.isDouble())
+        recipient = userById(quint32(recipientIdVal.toInteger()));
+    else
+        recipient = userByName(docObj.value(QLatin1String("recipient")).toString().trimmed());
+    if (!recipient || recipient == sender)
+        return sendFileCancel(sender, transferId, false, QStringLiteral("unknown recipient"));
+    if (!(recipient->features() & MessageCodec::Files))
+        return sendFileCancel(sender, transferId, false, QStringLiteral("recipient cannot receive files"));
 
+    quint32 id = m_nextFileTransferId++;
+    while (id == 0 || m_fileTransferKeys.contains(id))
+        id = m_nextFileTransferId++;
+    m_fileTransfers.insert(key, FileTransfer{id, recipient->handle(), quint64(size), false});
+    m_fileTransferKeys.insert(id, key);
+    QJsonObject offer;
+    offer[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::FileOffer);
+    offer[QStringLiteral("transferId")] = qint64(id);
+    if (recipient->features() & MessageCodec::UserIds)
+        offer[QStringLiteral("senderId")] = qint64(sender->userId());
+    else
+        offer[QStringLiteral("sender")] = sender->userName();
+    offer[QStringLiteral("name")] = name;
+    offer[QStringLiteral("size")] = size;
+    sendJson(recipient, offer);
+    emit logMessage(sender->userName() + QLatin1String(" sends ") + name + QLatin1String(" to ")
+                    + recipient->userName());
 }
 
+// The recipient accepts by the server's id, the sender hears of it by its own
+void ChatServer::handleFileAccept(ServerWorker *sender, const QJsonObject &docObj)
+{
+    Q_ASSERT(sender);
+    const quint32 transferId = quint32(docObj.value(QLatin1String("transferId")).toInteger());
+    const quint64 key = m_fileTransferKeys.value(transferId);
+    const auto transfer = m_fileTransfers.find(key);
+    if (transfer == m_fileTransfers.end() || transfer->recipientHandle != sender->handle()
+        || transfer->accepted) {
+        return;
+    }
+    transfer->accepted = true;
+    if (ServerWorker *fileSender = m_clients.value(quint32(key >> 32))) {
+        QJsonObject message;
+        message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::FileAccept);
+        message[QStringLiteral("transferId")] = qint64(quint32(key));
+        sendJson(fileSender, message);
+    }
+}
 
+// Slices are handed on as they come: nothing of the file is kept here, and
+// the recipient's worker spills what its client cannot take yet
+void ChatServer::fileDataReceived(quint32 senderHandle, QByteArray payload)
+{
+    MessageCodec::FileData fileData;
+    if (!m_clients.value(senderHandle) || !MessageCodec::decodeFileData(payload, &fileData))
+        return;
+    const auto transfer = m_fileTransfers.find((quint64(senderHandle) << 32) | fileData.transferId);
+    // Cancelled, and the sender has not heard yet
+    if (transfer == m_fileTransfers.end())
+        return;
+    ServerWorker *recipient = m_clients.value(transfer->recipientHandle);
+    Q_ASSERT(recipient);
+    if (!transfer->accepted || quint64(fileData.data.size()) > transfer->remaining) {
+        const QString reason = transfer->accepted ? QStringLiteral("more data than offered")
+                                                  : QStringLiteral("data before accept");
+        sendFileCancel(m_clients.value(senderHandle), fileData.transferId, false, reason);
+        sendFileCancel(recipient, transfer->id, true, reason);
+        m_fileTransferKeys.remove(transfer->id);
+        m_fileTransfers.erase(transfer);
+        return;
+    }
+    transfer->remaining -= quint64(fileData.data.size());
+    const ConnectionRegistry::Handle handle = transfer->recipientHandle;
+    MessageCodec::setFileDataTransferId(&payload, transfer->id);
+    QTimer::singleShot(0, recipient, [this, recipient, handle, payload = std::move(payload)]() {
+        if (recipient->handle() == handle)
+            recipient->relayFileData(payload);
+        else
+            m_droppedDeliveries.fetchAndAddRelaxed(1);
+    });
+    if (transfer->remaining == 0) {
+        m_fileTransferKeys.remove(transfer->id);
+        m_fileTransfers.erase(transfer);
+    }
+}
+
+// The sender cancels by its own id, the recipient by the server's, marked
+// "incoming"
+void ChatServer::handleFileCancel(ServerWorker *sender, const QJsonObject &docObj)
+{
+    Q_ASSERT(sender);
+    const quint32 transferId = quint32(docObj.value(QLatin1String("transferId")).toInteger());
+    const bool incoming = docObj.value(QLatin1String("incoming")).toBool();
+    const quint64 key = incoming ? m_fileTransferKeys.value(transferId)
+                                 : (quint64(sender->handle()) << 32) | transferId;
+    const auto transfer = m_fileTransfers.constFind(key);
+    if (transfer == m_fileTransfers.cend())
+        return;
+    if (incoming) {
+        if (transfer->recipientHandle != sender->handle())
+            return;
+        if (ServerWorker *fileSender = m_clients.value(quint32(key >> 32)))
+            sendFileCancel(fileSender, quint32(key), false, QStringLiteral("cancelled by recipient"));
+    } else if (ServerWorker *recipient = m_clients.value(transfer->recipientHandle)) {
+        sendFileCancel(recipient, transfer->id, true, QStringLiteral("cancelled by sender"));
+    }
+    m_fileTransferKeys.remove(transfer->id);
+    m_fileTransfers.erase(transfer);
+}
+
+void ChatServer::sendFileCancel(ServerWorker *destination, quint32 transferId, bool incoming,
+                                const QString &reason)
+{
+    QJsonObject message;
+    message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::FileCancel);
+    message[QStringLiteral("transferId")] = qint64(transferId);
+    if (incoming)
+        message[QStringLiteral("incoming")] = true;
+    message[QStringLiteral("reason")] = reason;
+    sendJson(destination, message);
+}
+
+void ChatServer::cancelFileTransfers(quint32 handle)
+{
+    for (auto it = m_fileTransfers.begin(); it != m_fileTransfers.end();) {
+        const quint32 senderHandle = quint32(it.key() >> 32);
+        if (senderHandle == handle) {
+            if (ServerWorker *recipient = m_clients.value(it->recipientHandle))
+                sendFileCancel(recipient, it->id, true, QStringLiteral("sender left"));
+        } else if (it->recipientHandle == handle) {
+            if (ServerWorker *fileSender = m_clients.value(senderHandle))
+                sendFileCancel(fileSender, quint32(it.key()), false, QStringLiteral("recipient left"));
+        } else {
+            ++it;
+            continue;
+        }
+        m_fileTransferKeys.remove(it->id);
+        it = m_fileTransfers.erase(it);
+    }
+}
+
+// Typing and status updates only matter until the next one: each recipient
+// keeps the latest per sender and kind, nothing is acknowledged or kept for
+// a resume, and clients that are behind are skipped
+void ChatServer::handleEvent(ServerWorker *sender, const QJsonObject &docObj)
+{
+    Q_ASSERT(sender);
+    static constexpr qsizetype maxStateSize = 128;
+    static const QLatin1String kinds[] = {QLatin1String("typing"), QLatin1String("status")};
+    const QString kind = docObj.value(QLatin1String("kind")).toString();
+    const auto kindIt = std::find(std::cbegin(kinds), std::cend(kinds), kind);
+    if (kindIt == std::cend(kinds))
+        return;
+    const QJsonValue state = docObj.value(QLatin1String("state"));
+    if (!state.isBool() && !(state.isString() && state.toString().size() <= maxStateSize))
+        return;
+    ServerWorker *recipient = nullptr;
+    const QJsonValue recipientIdVal = docObj.value(QLatin1String("recipientId"));
+    const QJsonValue recipientVal = docObj.value(QLatin1String("recipient"));
+    if (recipientIdVal.isDouble())
+        recipient = userById(quint32(recipientIdVal.toInteger()));
+    else if (recipientVal.isString())
+        recipient = userByName(recipientVal.toString().trimmed());
+    if ((recipientIdVal.isDouble() || recipientVal.isString()) && (!recipient || recipient == sender))
+        return;
+
+    const quint64 key = (quint64(sender->userId()) << 32) | quint64(kindIt - std::cbegin(kinds));
+    QByteArray payloads[2][2];
+    const auto deliver = [&](ServerWorker *worker) {
+        const int features = worker->features();
+        if (!(features & MessageCodec::Events))
+            return;
+        if (worker->eventsBlocked()) {
+            m_droppedEvents.fetchAndAddRelaxed(1);
+            return;
+        }
+        const bool byId = features & MessageCodec::UserIds;
+        const MessageCodec::Codec codec = worker->codec();
+        QByteArray &payload = payloads[byId][codec];
+        if (payload.isNull()) {
+            QJsonObject event;
+            event[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Event);
+            event[QStringLiteral("kind")] = kind;
+            event[QStringLiteral("state")] = state;
+            if (byId)
+                event[QStringLiteral("senderId")] = qint64(sender->userId());
+            else
+                event[QStringLiteral("sender")] = sender->userName();
+            payload = MessageCodec::encodeEphemeral(event, codec);
+        }
+        sendEvent(worker, key, payload);
+    };
+    if (recipient)
+        return deliver(recipient);
+    for (ServerWorker *worker : m_clients) {
+        if (worker != sender && worker->userId() != 0)
+            deliver(worker);
+    }
+}
+
+void ChatServer::sendEvent(ServerWorker *destination, quint64 key, const QByteArray &payload)
+{
+    Q_ASSERT(destination);
+    const ConnectionRegistry::Handle handle = destination->handle();
+    QTimer::singleShot(0, destination, [this, destination, handle, key, payload]() {
+        if (destination->handle() == handle)
+            destination->sendEvent(key, payload);
+        else
+            m_droppedDeliveries.fetchAndAddRelaxed(1);
+    });
+}
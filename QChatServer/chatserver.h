@@ -1,42 +1,279 @@
 #ifndef CHATSERVER_H
 #define CHATSERVER_H
 
+#include "authenticator.h"
+#include "connectionregistry.h"
+#include "messagefilter.h"
+#include "serversettings.h"
+#include "serverworker.h"
+#include "tokenbucket.h"
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QQueue>
+#include <QSet>
 #include <QTcpServer>
 #include <QVector>
+#include <memory>
+class QFileSystemWatcher;
 class QThread;
-class ServerWorker;
-class QJsonObject;
+class QTimer;
+class ThreadListener;
 class ChatServer : public QTcpServer
 {
     Q_OBJECT
+    friend class ServerWorker;
+    friend class ThreadListener;
+    friend class ProtocolBenchmark;
 public:
+    static constexpr int MaxIdleWorkersPerThread = 256;
+
+    struct PoolStatistics
+    {
+        quint64 workerHits;
+        quint64 workerMisses;
+        quint64 bufferHits;
+        quint64 bufferMisses;
+    };
+
+    // As measured by the last balancing pass
+    struct ThreadStatistics
+    {
+        int connections;
+        quint64 framesPerSecond;
+        quint64 bytesPerSecond;
+        qint64 loopLagUsecs;
+    };
+
+    struct DeliveryStatistics
+    {
+        // Relay frames a worker handed straight to a peer on its own thread
+        quint64 sameThread;
+        // Frames routed through the server thread
+        quint64 crossThread;
+        // Resent messages dropped before routing
+        quint64 duplicates;
+        // Frames that reached a worker after its connection was released
+        quint64 stale;
+        // Ephemeral events replaced by a newer one before going out, and
+        // dropped for clients that were behind
+        quint64 coalescedEvents;
+        quint64 droppedEvents;
+    };
+
+    // Inbound frames over a connection's limits
+    struct FloodStatistics
+    {
+        // Times a worker stopped reading until the client was within limits
+        quint64 pausedReads;
+        quint64 rejectedFrames;
+        quint64 disconnects;
+    };
+
+    struct AdmissionStatistics
+    {
+        quint64 refusedConnections;
+        // Logins that had to wait for the rate limit
+        quint64 queuedLogins;
+        // Logins answered with a retry delay
+        quint64 deferredLogins;
+        // Logins with a password or token that did not match
+        quint64 rejectedLogins;
+        // Logins let in on a token, without a password check
+        quint64 cachedLogins;
+        int pendingLogins;
+        bool acceptingPaused;
+    };
+
     ChatServer(QObject *parent = nullptr);
     ~ChatServer();
+    // Settings are fixed while the server runs, workers read them from
+    // their own threads
+    void setSettings(const ServerSettings &settings);
+    const ServerSettings &settings() const;
+    // listen(), or the per-thread listeners when the settings ask for them
+    bool startServer(const QHostAddress &address, quint16 port);
+    bool isRunning() const;
+    quint16 listeningPort() const;
+    PoolStatistics poolStatistics() const;
+    QVector<ThreadStatistics> threadStatistics() const;
+    quint64 migrations() const;
+    DeliveryStatistics deliveryStatistics() const;
+    AdmissionStatistics admissionStatistics() const;
+    FloodStatistics floodStatistics() const;
+    // Applied by each worker on its own thread before a message is routed.
+    // Swapped as a whole, a worker finishes a message with the filter it
+    // started with. Null delivers messages as they are.
+    std::shared_ptr<const MessageFilter> filter() const;
+    void setFilter(std::shared_ptr<const MessageFilter> filter);
+    // Keeps the current filter if the file cannot be read or parsed
+    bool loadFilterRules(const QString &path);
 protected:
     void incomingConnection(qintptr socketDescriptor) override;
 private:
+    ServerSettings m_settings;
     const int m_idealThreadCount;
     QVector<QThread *> m_availableThreads;
     QVector<int> m_threadsLoad;
-    QVector<ServerWorker *> m_clients;
+    // Workers of closed connections, reset and kept on their thread for reuse
+    QVector<QVector<ServerWorker *>> m_idleWorkers;
+    // One per thread while the per-thread listeners are in use
+    QVector<ThreadListener *> m_listeners;
+    bool m_listenersRunning;
+    quint16 m_listenersPort;
+    quint64 m_workerPoolHits;
+    quint64 m_workerPoolMisses;
+    // One plain object per thread, to time how long queued calls wait there
+    QVector<QObject *> m_threadProbes;
+    QVector<ThreadStatistics> m_threadStatistics;
+    QTimer *m_balanceTimer;
+    QElapsedTimer m_clock;
+    qint64 m_lastBalanceNsecs;
+    quint64 m_migrations;
+    // Decaying message counts between pairs of connections, keyed by the
+    // lower handle in the high half and the higher one in the low half
+    QHash<quint64, quint32> m_conversations;
+    quint64 m_crossThreadDeliveries;
+    quint64 m_retiredLocalDeliveries;
+    // A user's id is the registry handle of their connection
+    ConnectionRegistry m_clients;
+    QHash<QString, quint32> m_userIds;
+    QAtomicInteger<quint64> m_droppedDeliveries;
+    struct PendingLogin
+    {
+        quint32 handle;
+        QJsonObject login;
+    };
+    TokenBucket m_loginBucket;
+    QQueue<PendingLogin> m_pendingLogins;
+    // Connections whose login waits for the rate limit or a password check;
+    // any other login they send meanwhile is ignored
+    QSet<quint32> m_loginHandles;
+    QTimer *m_loginTimer;
+    // The users list shown in the window is rebuilt at most once per tick
+    QTimer *m_usersTimer;
+    bool m_acceptingPaused;
+    quint64 m_refusedConnections;
+    quint64 m_queuedLogins;
+    quint64 m_deferredLogins;
+    // Acks decided on this thread, by sender handle, sent once per pass
+    QHash<quint32, ServerWorker::Acks> m_pendingAcks;
+    // Counted by the workers on their threads
+    QAtomicInteger<quint64> m_pausedReads;
+    QAtomicInteger<quint64> m_rejectedFrames;
+    QAtomicInteger<quint64> m_floodDisconnects;
+    QAtomicInteger<quint64> m_duplicateMessages;
+    QAtomicInteger<quint64> m_coalescedEvents;
+    QAtomicInteger<quint64> m_droppedEvents;
+    // Sessions of clients that agreed on Resume, by user id. One whose
+    // client dropped off stays registered, unseen by the others, until it is
+    // resumed or its window runs out.
+    struct Session
+    {
+        QByteArray token;
+        // 0 while a client is attached
+        qint64 detachedUntilNsecs;
+        // Hands its frames over to the worker of a resume in progress
+        ServerWorker *previous;
+    };
+    QHash<quint32, Session> m_sessions;
+    QHash<QByteArray, quint32> m_sessionTokens;
+    // Deadline and user id in detach order, which is expiry order too
+    QQueue<std::pair<qint64, quint32>> m_detachedSessions;
+    QTimer *m_sessionTimer;
+    // File transfers in progress, by sender handle in the high half and the
+    // sender's transfer id in the low half. The recipient knows a transfer
+    // by the server's id.
+    struct FileTransfer
+    {
+        quint32 id;
+        quint32 recipientHandle;
+        quint64 remaining;
+        // The recipient agreed, the data may come
+        bool accepted;
+    };
+    QHash<quint64, FileTransfer> m_fileTransfers;
+    QHash<quint32, quint64> m_fileTransferKeys;
+    quint32 m_nextFileTransferId;
+    // Only through std::atomic_load() and std::atomic_store()
+    std::shared_ptr<const MessageFilter> m_filter;
+    QFileSystemWatcher *m_filterWatcher;
+    // Null while logins need no password
+    Authenticator *m_authenticator;
+    quint64 m_rejectedLogins;
 
 private slots:
     void broadcast(const QJsonObject &message, ServerWorker *exclude);
-    void broadcast(const QJsonObject &message, const QString &recipientName);
-    void jsonReceived(ServerWorker *sender, const QJsonObject &json);
-    void userDisconnected(ServerWorker *sender, int threadIdx);
-    void userError(ServerWorker *sender);
+    void jsonReceived(quint32 senderHandle, const QJsonObject &json);
+    void relayReceived(quint32 senderHandle, const QByteArray &payload);
+    // Takes the payload by value to rewrite the transfer id without a copy
+    void fileDataReceived(quint32 senderHandle, QByteArray payload);
+    void userDisconnected(quint32 senderHandle);
+    void userError(quint32 senderHandle);
+    void balanceThreads();
+    void processPendingLogins();
+    void flushAcks();
+    void expireSessions();
+    void reloadFilterRules();
+    void authenticated(quint32 handle, const QJsonObject &login, Authenticator::Result result);
 public slots:
     void stopServer();
 private:
     QStringList updateUsers();
-    void jsonFromLoggedOut(ServerWorker *sender, const QJsonObject &docObj);
-    void jsonFromLoggedIn(ServerWorker *sender, const QJsonObject &docObj);
+    int connectionLimit() const;
+    void updateAdmission();
+    void setAccepting(bool accepting);
+    int addThread();
+    void adoptWorker(ServerWorker *worker, int threadIdx);
+    ServerWorker *acquireWorker(int threadIdx);
+    void releaseWorker(ServerWorker *worker, int threadIdx);
+    void migrateWorker(ServerWorker *worker, int threadIdx);
+    void probeThreads();
+    quint32 assignUserId(ServerWorker *worker, const QString &userName);
+    void releaseUserId(ServerWorker *worker);
+    ServerWorker *userById(quint32 userId) const;
+    ServerWorker *userByName(const QString &userName) const;
+    void handleLogin(ServerWorker *sender, const QJsonObject &docObj);
+    void admitLogin(ServerWorker *sender, const QJsonObject &docObj);
+    void checkLogin(ServerWorker *sender, const QJsonObject &docObj);
+    void acceptLogin(ServerWorker *sender, const QJsonObject &docObj);
+    void deferLogin(ServerWorker *sender);
+    QJsonObject loginReply(const ServerWorker *user, bool withRoster) const;
+    void sendLoginReply(ServerWorker *destination, const QJsonObject &reply);
+    bool resumeSession(ServerWorker *sender, const QJsonObject &docObj);
+    void finishResume(ServerWorker *previous, quint32 userId, bool complete,
+                      const QVector<QByteArray> &replay, quint64 lastSequence,
+                      const DedupWindow &messageIds, const QVector<quint64> &heldAcks);
+    void removeConnection(ServerWorker *worker);
+    void handleMessage(ServerWorker *sender, const QJsonObject &docObj);
+    void handleFileOffer(ServerWorker *sender, const QJsonObject &docObj);
+    void handleFileAccept(ServerWorker *sender, const QJsonObject &docObj);
+    void handleFileCancel(ServerWorker *sender, const QJsonObject &docObj);
+    void handleEvent(ServerWorker *sender, const QJsonObject &docObj);
+    void sendEvent(ServerWorker *destination, quint64 key, const QByteArray &payload);
+    void sendFileCancel(ServerWorker *destination, quint32 transferId, bool incoming,
+                        const QString &reason);
+    void cancelFileTransfers(quint32 handle);
+    void routeText(ServerWorker *sender, ServerWorker *recipient, QByteArrayView text,
+                   quint32 messageId);
+    void acknowledge(quint32 senderHandle, ServerWorker::AckOutcome outcome, quint32 messageId);
+    void messageRouted(quint32 senderHandle);
+    // Acks a detached recipient held back, see ServerWorker::holdAck()
+    void acknowledgeHeld(const QVector<quint64> &heldAcks, ServerWorker::AckOutcome outcome);
     void sendJson(ServerWorker *destination, const QJsonObject &message);
+    // What the worker gets of a payload shared between recipients: the
+    // compressed frame, made on first use, if the worker agreed on it
+    const QByteArray &payloadFor(const ServerWorker *worker, const QByteArray &payload,
+                                 QByteArray *compressed) const;
+    // With a message id, the sender learns whether the frame reached the
+    // recipient's socket
+    void sendFrame(ServerWorker *destination, const QByteArray &payload,
+                   quint32 senderHandle = 0, quint32 messageId = 0,
+                   ServerWorker::Lane lane = ServerWorker::Lane::Interactive);
 signals:
     void updateUsersList(const QStringList &users);
     void logMessage(const QString &msg);
-    void stopAllClients();
 };
 
 #endif // CHATSERVER_H
@@ -0,0 +1,88 @@
+#include "connectionregistry.h"
+
+ConnectionRegistry::ConnectionRegistry()
+    : m_freeHead(NoSlot)
+    , m_freeTail(NoSlot)
+{}
+
+void ConnectionRegistry::reserve(qsizetype size)
+{
+    m_slots.reserve(size);
+    m_workers.reserve(size);
+    m_workerSlots.reserve(size);
+}
+
+ConnectionRegistry::Handle ConnectionRegistry::insert(ServerWorker *worker)
+{
+    Q_ASSERT(worker);
+    quint32 index;
+    if (m_freeHead != NoSlot) {
+        index = m_freeHead;
+        m_freeHead = m_slots.at(index).position;
+        if (m_freeHead == NoSlot)
+            m_freeTail = NoSlot;
+    } else {
+        if (quint32(m_slots.size()) == MaxConnections)
+            return 0;
+        index = quint32(m_slots.size());
+        // Generation 0 is skipped so that 0 is never a valid handle
+        m_slots.append(Slot{1, 0});
+    }
+    Slot &slot = m_slots[index];
+    slot.position = quint32(m_workers.size());
+    m_workers.append(worker);
+    m_workerSlots.append(index);
+    return (slot.generation << IndexBits) | index;
+}
+
+bool ConnectionRegistry::remove(Handle handle)
+{
+    if (!value(handle))
+        return false;
+    const quint32 index = handle & IndexMask;
+    Slot &slot = m_slots[index];
+
+    // Swap the last worker into the hole to keep the array dense
+    const quint32 lastPosition = quint32(m_workers.size() - 1);
+    if (slot.position != lastPosition) {
+        const quint32 movedIndex = m_workerSlots.at(lastPosition);
+        m_workers[slot.position] = m_workers.at(lastPosition);
+        m_workerSlots[slot.position] = movedIndex;
+        m_slots[movedIndex].position = slot.position;
+    }
+    m_workers.removeLast();
+    m_workerSlots.removeLast();
+
+    slot.generation = slot.generation + 1 == GenerationCount ? 1 : slot.generation + 1;
+    slot.position = NoSlot;
+    if (m_freeTail == NoSlot)
+        m_freeHead = index;
+    else
+        m_slots[m_freeTail].position = index;
+    m_freeTail = index;
+    return true;
+}
+
+bool ConnectionRegistry::replace(Handle handle, ServerWorker *worker)
+{
+    Q_ASSERT(worker);
+    if (!value(handle))
+        return false;
+    m_workers[m_slots.at(handle & IndexMask).position] = worker;
+    return true;
+}
+
+ServerWorker *ConnectionRegistry::value(Handle handle) const
+{
+    const quint32 index = handle & IndexMask;
+    if (index >= quint32(m_slots.size()))
+        return nullptr;
+    const Slot &slot = m_slots.at(index);
+    // A free slot already carries the generation of its next handle, so the
+    // dense back reference is what proves the slot is in use
+    if (slot.generation != handle >> IndexBits || slot.position >= quint32(m_workers.size())
+        || m_workerSlots.at(slot.position) != index) {
+        return nullptr;
+    }
+    return m_workers.at(slot.position);
+}
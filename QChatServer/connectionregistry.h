@@ -0,0 +1,56 @@
+#ifndef CONNECTIONREGISTRY_H
+#define CONNECTIONREGISTRY_H
+
+#include <QVector>
+
+class ServerWorker;
+
+// Slot map of the live connections. A handle packs the slot index with a
+// generation that changes whenever the slot is freed, so a handle held by a
+// queued delivery or a client stops resolving once its connection is gone,
+// even if the slot has been reused. Insert, remove and lookup are O(1) and
+// the workers are kept in a dense array for iteration.
+class ConnectionRegistry
+{
+public:
+    using Handle = quint32;
+    static constexpr int IndexBits = 20;
+    static constexpr quint32 MaxConnections = 1u << IndexBits;
+
+    ConnectionRegistry();
+    void reserve(qsizetype size);
+    // Returns 0, never a valid handle, when the registry is full
+    Handle insert(ServerWorker *worker);
+    bool remove(Handle handle);
+    // Puts another worker behind a live handle, for a resumed session
+    bool replace(Handle handle, ServerWorker *worker);
+    ServerWorker *value(Handle handle) const;
+
+    qsizetype size() const { return m_workers.size(); }
+    bool isEmpty() const { return m_workers.isEmpty(); }
+    // Dense order changes when connections are removed
+    ServerWorker *at(qsizetype i) const { return m_workers.at(i); }
+    QVector<ServerWorker *>::const_iterator begin() const { return m_workers.cbegin(); }
+    QVector<ServerWorker *>::const_iterator end() const { return m_workers.cend(); }
+
+private:
+    static constexpr quint32 IndexMask = MaxConnections - 1;
+    static constexpr quint32 GenerationCount = 1u << (32 - IndexBits);
+    static constexpr quint32 NoSlot = ~0u;
+
+    struct Slot
+    {
+        quint32 generation;
+        // Dense index while in use, next free slot while free
+        quint32 position;
+    };
+    QVector<Slot> m_slots;
+    QVector<ServerWorker *> m_workers;
+    QVector<quint32> m_workerSlots;
+    // Freed slots are reused oldest first, so a stale handle has to survive
+    // a whole round of reconnects before its generation can come back
+    quint32 m_freeHead;
+    quint32 m_freeTail;
+};
+
+#endif // CONNECTIONREGISTRY_H
@@ -0,0 +1,49 @@
+#include "dedupwindow.h"
+
+DedupWindow::DedupWindow()
+{
+    clear();
+}
+
+bool DedupWindow::insert(quint32 messageId)
+{
+    Q_ASSERT(messageId != 0);
+    const quint32 bit = messageId % Size;
+    quint64 &word = m_bits[bit / WordBits];
+    const quint64 mask = quint64(1) << (bit % WordBits);
+    // Serial number arithmetic, so the window carries on across the wrap
+    const qint32 ahead = qint32(messageId - m_highest);
+    if (m_highest == 0 || ahead > 0) {
+        if (m_highest == 0 || ahead >= Size) {
+            m_bits.fill(0);
+        } else {
+            // The bits of the ids skipped over belong to older ids
+            for (quint32 id = m_highest + 1; id != messageId; ++id) {
+                const quint32 skipped = id % Size;
+                m_bits[skipped / WordBits] &= ~(quint64(1) << (skipped % WordBits));
+            }
+        }
+        m_highest = messageId;
+        word |= mask;
+        return true;
+    }
+    if (-qint64(ahead) >= Size || (word & mask))
+        return false;
+    word |= mask;
+    return true;
+}
+
+void DedupWindow::forget(quint32 messageId)
+{
+    const qint32 behind = qint32(m_highest - messageId);
+    if (messageId == 0 || behind < 0 || behind >= Size)
+        return;
+    const quint32 bit = messageId % Size;
+    m_bits[bit / WordBits] &= ~(quint64(1) << (bit % WordBits));
+}
+
+void DedupWindow::clear()
+{
+    m_bits.fill(0);
+    m_highest = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef DEDUPWINDOW_H
+#define DEDUPWINDOW_H
+
+#include <QtGlobal>
+#include <array>
+
+// The last Size message ids of one sender, as a bitmap sliding behind the
+// highest id seen. Ids grow by one per message and wrap around; 0 is never
+// used. An id too far behind the window cannot be told apart from a
+// duplicate and counts as one. Not thread safe.
+class DedupWindow
+{
+public:
+    static constexpr int Size = 1024;
+
+    DedupWindow();
+    // False if the id was seen before
+    bool insert(quint32 messageId);
+    // Lets the id through again, for a message that failed
+    void forget(quint32 messageId);
+    void clear();
+
+private:
+    static constexpr int WordBits = 64;
+
+    std::array<quint64, Size / WordBits> m_bits;
+    quint32 m_highest;
+};
+
+#endif // DEDUPWINDOW_H
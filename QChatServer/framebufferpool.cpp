@@ -0,0 +1,88 @@
+#include "framebufferpool.h"
+
+#include <QList>
+#include <QMutex>
+
+namespace
+{
+QMutex poolsMutex;
+QList<const FrameBufferPool *> pools;
+// Counts of pools whose thread has already finished
+FrameBufferPool::Statistics retired = {0, 0};
+}
+
+FrameBufferPool::FrameBufferPool()
+    : m_hits(0)
+    , m_misses(0)
+{
+    QMutexLocker locker(&poolsMutex);
+    pools.append(this);
+}
+
+FrameBufferPool::~FrameBufferPool()
+{
+    QMutexLocker locker(&poolsMutex);
+    pools.removeOne(this);
+    retired.hits += m_hits.loadRelaxed();
+    retired.misses += m_misses.loadRelaxed();
+}
+
+FrameBufferPool &FrameBufferPool::local()
+{
+    static thread_local FrameBufferPool pool;
+    return pool;
+}
+
+FrameBufferPool::Statistics FrameBufferPool::totals()
+{
+    QMutexLocker locker(&poolsMutex);
+    Statistics total = retired;
+    for (const FrameBufferPool *pool : qAsConst(pools)) {
+        const Statistics statistics = pool->statistics();
+        total.hits += statistics.hits;
+        total.misses += statistics.misses;
+    }
+    return total;
+}
+
+QByteArray FrameBufferPool::acquire(qsizetype size)
+{
+    int sizeClass = 0;
+    while (sizeClass < ClassCount && classSize(sizeClass) < size)
+        ++sizeClass;
+    if (sizeClass == ClassCount) {
+        m_misses.fetchAndAddRelaxed(1);
+        return QByteArray(size, Qt::Uninitialized);
+    }
+    // Oldest first: it is the most likely to have left the socket by now
+    QQueue<QByteArray> &buffers = m_buffers[sizeClass];
+    if (!buffers.isEmpty() && buffers.head().isDetached()) {
+        QByteArray buffer = buffers.dequeue();
+        buffer.resize(size);
+        m_hits.fetchAndAddRelaxed(1);
+        return buffer;
+    }
+    m_misses.fetchAndAddRelaxed(1);
+    QByteArray buffer;
+    buffer.reserve(classSize(sizeClass));
+    buffer.resize(size);
+    return buffer;
+}
+
+void FrameBufferPool::release(QByteArray &&buffer)
+{
+    const qsizetype capacity = buffer.capacity();
+    if (capacity < classSize(0) || capacity >= 2 * classSize(ClassCount - 1))
+        return;
+    int sizeClass = ClassCount - 1;
+    while (classSize(sizeClass) > capacity)
+        --sizeClass;
+    QQueue<QByteArray> &buffers = m_buffers[sizeClass];
+    if (buffers.size() < MaxBuffersPerClass)
+        buffers.enqueue(std::move(buffer));
+}
+
+FrameBufferPool::Statistics FrameBufferPool::statistics() const
+{
+    return {m_hits.loadRelaxed(), m_misses.loadRelaxed()};
+}
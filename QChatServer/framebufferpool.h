@@ -0,0 +1,46 @@
+#ifndef FRAMEBUFFERPOOL_H
+#define FRAMEBUFFERPOOL_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QQueue>
+#include <array>
+
+// Recycles frame buffers by power of two size class. Each thread has its
+// own pool, so acquire and release never lock. A released buffer may still
+// be referenced, typically by a socket write buffer; it is only handed out
+// again once that reference is gone.
+class FrameBufferPool
+{
+public:
+    struct Statistics
+    {
+        quint64 hits;
+        quint64 misses;
+    };
+
+    static FrameBufferPool &local();
+    // Summed over the pools of all threads
+    static Statistics totals();
+
+    QByteArray acquire(qsizetype size);
+    void release(QByteArray &&buffer);
+    Statistics statistics() const;
+
+private:
+    FrameBufferPool();
+    ~FrameBufferPool();
+    Q_DISABLE_COPY(FrameBufferPool)
+
+    // 256 bytes to 64 KiB; larger frames bypass the pool
+    static constexpr int MinClassShift = 8;
+    static constexpr int ClassCount = 9;
+    static constexpr int MaxBuffersPerClass = 32;
+    static constexpr qsizetype classSize(int sizeClass) { return qsizetype(1) << (MinClassShift + sizeClass); }
+
+    std::array<QQueue<QByteArray>, ClassCount> m_buffers;
+    QAtomicInteger<quint64> m_hits;
+    QAtomicInteger<quint64> m_misses;
+};
+
+#endif // FRAMEBUFFERPOOL_H
@@ -1,11 +1,151 @@
+#include "authenticator.h"
+#include "serversettings.h"
 #include "serverwindow.h"
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QTextStream>
 
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
-    ServerWindow w;
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("QChat server"));
+    parser.addHelpOption();
+    const QCommandLineOption reusePortOption(
+        QStringLiteral("reuse-port"),
+        QStringLiteral("Accept on every worker thread through SO_REUSEPORT (Linux only)."));
+    parser.addOption(reusePortOption);
+    ServerSettings settings;
+    const QCommandLineOption maxConnectionsOption(
+        QStringLiteral("max-connections"),
+        QStringLiteral("Refuse connections beyond <count>, 0 for no limit."),
+        QStringLiteral("count"), QString::number(settings.maxConnections));
+    const QCommandLineOption loginRateOption(
+        QStringLiteral("login-rate"),
+        QStringLiteral("Handle at most <count> logins per second, 0 for no limit."),
+        QStringLiteral("count"), QString::number(settings.loginsPerSecond));
+    const QCommandLineOption loginBurstOption(
+        QStringLiteral("login-burst"),
+        QStringLiteral("Let up to <count> logins through at once before the rate applies."),
+        QStringLiteral("count"), QString::number(settings.loginBurst));
+    const QCommandLineOption loginQueueOption(
+        QStringLiteral("login-queue"),
+        QStringLiteral("Queue up to <count> logins over the rate, tell the rest to retry later."),
+        QStringLiteral("count"), QString::number(settings.maxQueuedLogins));
+    parser.addOptions({maxConnectionsOption, loginRateOption, loginBurstOption, loginQueueOption});
+    const QCommandLineOption messageRateOption(
+        QStringLiteral("message-rate"),
+        QStringLiteral("Let each client send <count> frames per second, 0 for no limit."),
+        QStringLiteral("count"), QString::number(settings.messagesPerSecond));
+    const QCommandLineOption messageBurstOption(
+        QStringLiteral("message-burst"),
+        QStringLiteral("Let each client send bursts of up to <count> frames."),
+        QStringLiteral("count"), QString::number(settings.messageBurst));
+    const QCommandLineOption byteRateOption(
+        QStringLiteral("byte-rate"),
+        QStringLiteral("Let each client send <bytes> per second, 0 for no limit."),
+        QStringLiteral("bytes"), QString::number(settings.bytesPerSecond));
+    const QCommandLineOption byteBurstOption(
+        QStringLiteral("byte-burst"),
+        QStringLiteral("Let each client send bursts of up to <bytes>."),
+        QStringLiteral("bytes"), QString::number(settings.byteBurst));
+    const QCommandLineOption floodPolicyOption(
+        QStringLiteral("flood-policy"),
+        QStringLiteral("What to do with a client over its limits: delay, reject or disconnect."),
+        QStringLiteral("policy"), QStringLiteral("delay"));
+    const QCommandLineOption maxFrameOption(
+        QStringLiteral("max-frame"),
+        QStringLiteral("Drop clients that send a frame over <bytes>, 0 for no limit."),
+        QStringLiteral("bytes"), QString::number(settings.maxFrameBytes));
+    parser.addOptions({messageRateOption, messageBurstOption, byteRateOption, byteBurstOption,
+                       floodPolicyOption, maxFrameOption});
+    const QCommandLineOption pingIntervalOption(
+        QStringLiteral("ping-interval"),
+        QStringLiteral("Ping clients quiet for <seconds>, 0 to never ping."),
+        QStringLiteral("seconds"), QString::number(settings.pingIntervalSecs));
+    const QCommandLineOption pongTimeoutOption(
+        QStringLiteral("pong-timeout"),
+        QStringLiteral("Drop clients that do not answer a ping within <seconds>."),
+        QStringLiteral("seconds"), QString::number(settings.pongTimeoutSecs));
+    const QCommandLineOption loginTimeoutOption(
+        QStringLiteral("login-timeout"),
+        QStringLiteral("Drop connections that have not logged in after <seconds>, 0 to wait forever."),
+        QStringLiteral("seconds"), QString::number(settings.loginTimeoutSecs));
+    parser.addOptions({pingIntervalOption, pongTimeoutOption, loginTimeoutOption});
+    const QCommandLineOption resumeWindowOption(
+        QStringLiteral("resume-window"),
+        QStringLiteral("Keep the session of a client that dropped off for <seconds>, 0 to turn resume off."),
+        QStringLiteral("seconds"), QString::number(settings.resumeWindowSecs));
+    const QCommandLineOption replayFramesOption(
+        QStringLiteral("replay-frames"),
+        QStringLiteral("Replay at most the last <count> frames to a resumed client."),
+        QStringLiteral("count"), QString::number(settings.replayFrames));
+    parser.addOptions({resumeWindowOption, replayFramesOption});
+    const QCommandLineOption compressMinOption(
+        QStringLiteral("compress-min"),
+        QStringLiteral("Deflate payloads of at least <bytes> for clients that support it, 0 to turn compression off."),
+        QStringLiteral("bytes"), QString::number(settings.compressMinBytes));
+    parser.addOption(compressMinOption);
+    const QCommandLineOption filterRulesOption(
+        QStringLiteral("filter-rules"),
+        QStringLiteral("Mask or block message text matching the rules in <file>, one \"mask <pattern>\" or \"block <pattern>\" per line."),
+        QStringLiteral("file"));
+    parser.addOption(filterRulesOption);
+    const QCommandLineOption credentialsOption(
+        QStringLiteral("credentials"),
+        QStringLiteral("Only let in users whose password matches <file>, one \"user:salt:iterations:key\" per line."),
+        QStringLiteral("file"));
+    const QCommandLineOption authThreadsOption(
+        QStringLiteral("auth-threads"),
+        QStringLiteral("Check passwords on <count> threads, 0 for a quarter of the cores."),
+        QStringLiteral("count"), QString::number(settings.authThreads));
+    const QCommandLineOption authQueueOption(
+        QStringLiteral("auth-queue"),
+        QStringLiteral("Let up to <count> password checks wait, tell the rest to retry later."),
+        QStringLiteral("count"), QString::number(settings.maxQueuedAuths));
+    const QCommandLineOption hashPasswordOption(
+        QStringLiteral("hash-password"),
+        QStringLiteral("Read a password from standard input and print the credentials line for <user>."),
+        QStringLiteral("user"));
+    parser.addOptions({credentialsOption, authThreadsOption, authQueueOption, hashPasswordOption});
+    parser.process(a);
+
+    if (parser.isSet(hashPasswordOption)) {
+        const QString password = QTextStream(stdin).readLine();
+        QTextStream(stdout) << Authenticator::credentialLine(parser.value(hashPasswordOption), password)
+                            << Qt::endl;
+        return 0;
+    }
+
+    settings.perThreadListeners = parser.isSet(reusePortOption);
+    settings.maxConnections = parser.value(maxConnectionsOption).toInt();
+    settings.loginsPerSecond = parser.value(loginRateOption).toInt();
+    settings.loginBurst = parser.value(loginBurstOption).toInt();
+    settings.maxQueuedLogins = parser.value(loginQueueOption).toInt();
+    settings.messagesPerSecond = parser.value(messageRateOption).toInt();
+    settings.messageBurst = parser.value(messageBurstOption).toInt();
+    settings.bytesPerSecond = parser.value(byteRateOption).toInt();
+    settings.byteBurst = parser.value(byteBurstOption).toInt();
+    settings.maxFrameBytes = parser.value(maxFrameOption).toInt();
+    settings.pingIntervalSecs = parser.value(pingIntervalOption).toInt();
+    settings.pongTimeoutSecs = parser.value(pongTimeoutOption).toInt();
+    settings.loginTimeoutSecs = parser.value(loginTimeoutOption).toInt();
+    settings.resumeWindowSecs = parser.value(resumeWindowOption).toInt();
+    settings.replayFrames = parser.value(replayFramesOption).toInt();
+    settings.compressMinBytes = parser.value(compressMinOption).toInt();
+    settings.filterRulesPath = parser.value(filterRulesOption);
+    settings.credentialsPath = parser.value(credentialsOption);
+    settings.authThreads = parser.value(authThreadsOption).toInt();
+    settings.maxQueuedAuths = parser.value(authQueueOption).toInt();
+    const QString floodPolicy = parser.value(floodPolicyOption);
+    if (floodPolicy == QLatin1String("reject"))
+        settings.floodPolicy = ServerSettings::FloodPolicy::RejectFrames;
+    else if (floodPolicy == QLatin1String("disconnect"))
+        settings.floodPolicy = ServerSettings::FloodPolicy::Disconnect;
+    else if (floodPolicy != QLatin1String("delay"))
+        parser.showHelp(1);
+    ServerWindow w(settings);
     w.show();
     return a.exec();
 }
@@ -0,0 +1,174 @@
+#include "messagefilter.h"
+
+#include <QQueue>
+#include <cstring>
+#include <utility>
+
+static char foldCase(char c)
+{
+    return c >= 'A' && c <= 'Z' ? char(c + ('a' - 'A')) : c;
+}
+
+static bool isAsciiAlnum(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+// Bytes of multi-byte characters count as word bytes, so a pattern never
+// matches inside a word of another script
+static bool isWordByte(char c)
+{
+    return isAsciiAlnum(c) || quint8(c) >= 0x80;
+}
+
+MessageFilter::MessageFilter(const QVector<Rule> &rules)
+    : m_rules(rules)
+    , m_classCount(1)
+    , m_hits(new QAtomicInteger<quint64>[qMax<qsizetype>(rules.size(), 1)])
+{
+    m_byteClasses.fill(0);
+    m_wholeWords.reserve(m_rules.size());
+    for (Rule &rule : m_rules) {
+        rule.pattern = rule.pattern.toLower();
+        bool wholeWord = !rule.pattern.isEmpty();
+        for (const char c : std::as_const(rule.pattern)) {
+            wholeWord = wholeWord && isAsciiAlnum(c);
+            quint16 &byteClass = m_byteClasses[quint8(c)];
+            if (byteClass == 0)
+                byteClass = quint16(m_classCount++);
+        }
+        m_wholeWords.append(wholeWord);
+    }
+    for (char c = 'A'; c <= 'Z'; ++c)
+        m_byteClasses[quint8(c)] = m_byteClasses[quint8(foldCase(c))];
+
+    // The trie, with -1 for missing edges
+    const auto addState = [this]() {
+        m_transitions.resize(m_transitions.size() + m_classCount, -1);
+        m_stateRules.append(-1);
+        return qint32(m_stateRules.size() - 1);
+    };
+    addState();
+    for (qsizetype i = 0; i < m_rules.size(); ++i) {
+        const QByteArray &pattern = m_rules.at(i).pattern;
+        if (pattern.isEmpty())
+            continue;
+        qint32 state = 0;
+        for (const char c : pattern) {
+            const qsizetype edge = qsizetype(state) * m_classCount + m_byteClasses[quint8(c)];
+            if (m_transitions.at(edge) < 0) {
+                const qint32 next = addState();
+                m_transitions[edge] = next;
+            }
+            state = m_transitions.at(edge);
+        }
+        // A repeated pattern keeps its first rule
+        if (m_stateRules.at(state) < 0)
+            m_stateRules[state] = qint32(i);
+    }
+
+    // Breadth first, every missing edge is replaced by the one its failure
+    // state takes, so matching is a single lookup per byte
+    const qsizetype stateCount = m_stateRules.size();
+    QVector<qint32> failures(stateCount, 0);
+    m_nextMatches.fill(-1, stateCount);
+    m_firstMatches.fill(-1, stateCount);
+    QQueue<qint32> pending;
+    for (int c = 0; c < m_classCount; ++c) {
+        qint32 &edge = m_transitions[c];
+        if (edge < 0)
+            edge = 0;
+        else
+            pending.enqueue(edge);
+    }
+    while (!pending.isEmpty()) {
+        const qint32 state = pending.dequeue();
+        const qint32 failure = failures.at(state);
+        m_nextMatches[state] = m_firstMatches.at(failure);
+        m_firstMatches[state] = m_stateRules.at(state) >= 0 ? state : m_nextMatches.at(state);
+        const qsizetype row = qsizetype(state) * m_classCount;
+        const qsizetype failureRow = qsizetype(failure) * m_classCount;
+        for (int c = 0; c < m_classCount; ++c) {
+            qint32 &edge = m_transitions[row + c];
+            if (edge < 0) {
+                edge = m_transitions.at(failureRow + c);
+            } else {
+                failures[edge] = m_transitions.at(failureRow + c);
+                pending.enqueue(edge);
+            }
+        }
+    }
+}
+
+QVector<MessageFilter::Rule> MessageFilter::parseRules(const QByteArray &text, int *badLine)
+{
+    QVector<Rule> rules;
+    int lineNumber = 0;
+    for (const QByteArray &rawLine : text.split('\n')) {
+        ++lineNumber;
+        const QByteArray line = rawLine.trimmed();
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+        const qsizetype space = line.indexOf(' ');
+        const QByteArray action = line.left(space);
+        const QByteArray pattern = space < 0 ? QByteArray() : line.mid(space + 1).trimmed();
+        Rule rule;
+        rule.pattern = pattern;
+        if (action == "block")
+            rule.action = Action::Block;
+        else if (action != "mask")
+            rule.pattern.clear();
+        if (rule.pattern.isEmpty()) {
+            if (badLine)
+                *badLine = lineNumber;
+            return QVector<Rule>();
+        }
+        rules.append(rule);
+    }
+    if (badLine)
+        *badLine = 0;
+    return rules;
+}
+
+int MessageFilter::ruleCount() const
+{
+    return int(m_rules.size());
+}
+
+const MessageFilter::Rule &MessageFilter::rule(int index) const
+{
+    return m_rules.at(index);
+}
+
+quint64 MessageFilter::hits(int index) const
+{
+    Q_ASSERT(index >= 0 && index < m_rules.size());
+    return m_hits[index].loadRelaxed();
+}
+
+MessageFilter::Verdict MessageFilter::apply(char *text, qsizetype size) const
+{
+    Verdict verdict = Verdict::Pass;
+    const qint32 *transitions = m_transitions.constData();
+    const qint32 *firstMatches = m_firstMatches.constData();
+    qint32 state = 0;
+    for (qsizetype i = 0; i < size; ++i) {
+        state = transitions[qsizetype(state) * m_classCount + m_byteClasses[quint8(text[i])]];
+        for (qint32 match = firstMatches[state]; match >= 0; match = m_nextMatches.at(match)) {
+            const qint32 ruleIndex = m_stateRules.at(match);
+            const Rule &rule = m_rules.at(ruleIndex);
+            const qsizetype start = i + 1 - rule.pattern.size();
+            if (m_wholeWords.at(ruleIndex)
+                && ((start > 0 && isWordByte(text[start - 1]))
+                    || (i + 1 < size && isWordByte(text[i + 1])))) {
+                continue;
+            }
+            m_hits[ruleIndex].fetchAndAddRelaxed(1);
+            if (rule.action == Action::Block)
+                return Verdict::Blocked;
+            memset(text + start, '*', size_t(rule.pattern.size()));
+            verdict = Verdict::Masked;
+        }
+    }
+    return verdict;
+}
@@ -0,0 +1,66 @@
+#ifndef MESSAGEFILTER_H
+#define MESSAGEFILTER_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QVector>
+#include <array>
+#include <memory>
+
+// Words and links that must not be delivered, found in one pass over the
+// UTF-8 text by an Aho-Corasick automaton compiled up front. ASCII letters
+// match either case. A pattern of only letters and digits matches whole
+// words, anything else, like a link, matches anywhere. A filter never
+// changes once built, so any thread may apply it; the rule hit counters
+// are atomic.
+class MessageFilter
+{
+public:
+    enum class Action {
+        // The match is replaced by as many '*'
+        Mask,
+        // The message is not delivered
+        Block
+    };
+    struct Rule
+    {
+        QByteArray pattern;
+        Action action = Action::Mask;
+    };
+    enum class Verdict {
+        Pass,
+        Masked,
+        Blocked
+    };
+
+    explicit MessageFilter(const QVector<Rule> &rules);
+    // One rule per line, "block" or "mask" and the pattern after a space.
+    // Blank lines and lines starting with '#' are skipped. On a malformed
+    // line *badLine is its number, from 1.
+    static QVector<Rule> parseRules(const QByteArray &text, int *badLine = nullptr);
+
+    int ruleCount() const;
+    const Rule &rule(int index) const;
+    quint64 hits(int index) const;
+    // Masks in place and stops at the first blocked match, so the text is
+    // only of use if the verdict is not Blocked
+    Verdict apply(char *text, qsizetype size) const;
+
+private:
+    QVector<Rule> m_rules;
+    QVector<bool> m_wholeWords;
+    // Bytes no pattern uses share class 0
+    std::array<quint16, 256> m_byteClasses;
+    int m_classCount;
+    // Complete transition table, a row of m_classCount per state
+    QVector<qint32> m_transitions;
+    // Rule ending in each state, -1 if none, and the next state down the
+    // failure links that ends one
+    QVector<qint32> m_stateRules;
+    QVector<qint32> m_nextMatches;
+    // First state at or below each state that ends a rule
+    QVector<qint32> m_firstMatches;
+    std::unique_ptr<QAtomicInteger<quint64>[]> m_hits;
+};
+
+#endif // MESSAGEFILTER_H
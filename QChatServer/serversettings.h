@@ -0,0 +1,72 @@
+#ifndef SERVERSETTINGS_H
+#define SERVERSETTINGS_H
+
+#include <QString>
+
+// Server options, set from the command line
+struct ServerSettings
+{
+    // What a worker does with a client sending faster than its limits
+    enum class FloodPolicy {
+        // Stop reading the socket until the client is within its limits
+        // again, TCP flow control then holds the client back
+        DelayReading,
+        // Drop the frames over the limit
+        RejectFrames,
+        Disconnect
+    };
+
+    // Linux only: every worker thread accepts on its own SO_REUSEPORT socket
+    // and the kernel spreads the connections, instead of all accepts going
+    // through the ChatServer thread
+    bool perThreadListeners = false;
+    // Connections beyond this are refused and accepting pauses until the
+    // count drops again; 0 leaves only the registry's own limit
+    int maxConnections = 0;
+    // Logins handled per second, with bursts of up to loginBurst; 0 turns
+    // the limit off
+    int loginsPerSecond = 500;
+    int loginBurst = 100;
+    // Logins over the rate wait in a queue; once it is full clients are
+    // told to retry later
+    int maxQueuedLogins = 5000;
+    // Inbound limits per connection, in frames and in bytes including
+    // framing; 0 turns a limit off. Off by default: a byte rate low enough to
+    // hold back a flood also holds back every file transfer.
+    int messagesPerSecond = 0;
+    int messageBurst = 200;
+    int bytesPerSecond = 0;
+    int byteBurst = 4 << 20;
+    // A client announcing a larger frame is dropped before any of it is
+    // buffered; 0 takes frames of any size
+    int maxFrameBytes = 1 << 20;
+    FloodPolicy floodPolicy = FloodPolicy::DelayReading;
+    // A client that offered heartbeats and stays quiet this long is
+    // pinged, and dropped if it does not answer in time; 0 turns pings off
+    int pingIntervalSecs = 30;
+    int pongTimeoutSecs = 10;
+    // Connections that have not logged in by then are dropped; 0 waits
+    // forever. Off by default: the stock client connects before it asks
+    // for the user's name and password.
+    int loginTimeoutSecs = 0;
+    // A client that offered resume and drops off keeps its session this
+    // long, with the last replayFrames frames sent to it, so it can pick
+    // up where it left; 0 turns resume off
+    int resumeWindowSecs = 60;
+    int replayFrames = 256;
+    // Payloads of at least this many bytes are deflated for clients that
+    // agreed on compression; 0 turns compression off
+    int compressMinBytes = 1024;
+    // Rules for MessageFilter, reloaded whenever the file changes; empty
+    // delivers messages unfiltered
+    QString filterRulesPath;
+    // Logins must give a password matching this Authenticator credentials
+    // file; empty lets anyone in under any free name. Passwords are checked
+    // on authThreads threads, 0 for a quarter of the cores, and once
+    // maxQueuedAuths checks wait clients are told to retry later
+    QString credentialsPath;
+    int authThreads = 0;
+    int maxQueuedAuths = 256;
+};
+
+#endif // SERVERSETTINGS_H
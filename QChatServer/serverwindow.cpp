@@ -3,7 +3,7 @@
 #include "ui_serverwindow.h"
 #include <QMessageBox>
 
-ServerWindow::ServerWindow(QWidget *parent)
+ServerWindow::ServerWindow(const ServerSettings &settings, QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::ServerWindow)
     , m_chatServer(new ChatServer(this))
@@ -11,6 +11,7 @@ ServerWindow::ServerWindow(QWidget *parent)
 {
     ui->setupUi(this);
     ui->sessionsView->setModel(m_clientsModel);
+    m_chatServer->setSettings(settings);
 
     connect(m_chatServer, &ChatServer::updateUsersList, this, &ServerWindow::updateClientsModel);
 
@@ -32,13 +33,13 @@ void ServerWindow::toggleStartServer()
         logMessage(QStringLiteral("Port is unvalible"));
         return;
     }
-    if(m_chatServer->isListening()){
+    if(m_chatServer->isRunning()){
         m_chatServer->stopServer();
         ui->startStopButton->setText(tr("Start Server"));
         ui->portEdit->setEnabled(true);
         logMessage(QStringLiteral("Server Stopped"));
     } else {
-        if(!m_chatServer->listen(QHostAddress::Any, port)){
+        if(!m_chatServer->startServer(QHostAddress::Any, port)){
             QMessageBox::critical(this, tr("Error"), tr("Unable to start the server"));
             return;
         }
@@ -1,6 +1,7 @@
 #ifndef SERVERWINDOW_H
 #define SERVERWINDOW_H
 
+#include "serversettings.h"
 #include <QMainWindow>
 #include <QStringListModel>
 
@@ -14,7 +15,7 @@ class ServerWindow : public QMainWindow
     Q_OBJECT
 
 public:
-    ServerWindow(QWidget *parent = nullptr);
+    explicit ServerWindow(const ServerSettings &settings, QWidget *parent = nullptr);
     ~ServerWindow();
 
 private:
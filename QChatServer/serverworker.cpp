@@ -1,44 +1,650 @@
 #include "serverworker.h"
+#include "chatserver.h"
+#include "framebufferpool.h"
+#include "protocol.h"
+#include "utf8.h"
 
-#include <QJsonDocument>
+#include <QDeadlineTimer>
+#include <QHash>
+#include <QJsonArray>
 #include <QJsonObject>
+#include <QSignalBlocker>
+#include <QTemporaryFile>
+#include <QThread>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <utility>
 
-ServerWorker::ServerWorker(QObject *parent)
+// Connected workers living on the current thread, by handle. A relay frame
+// for one of them is delivered right here without a trip through the server.
+static thread_local QHash<quint32, ServerWorker *> threadWorkers;
+
+ServerWorker::ServerWorker(ChatServer *server, QObject *parent)
     : QObject{parent}
+    , m_server(server)
     , m_serverSocket(new QTcpSocket(this))
+    , m_handle(0)
+    , m_threadIndex(-1)
+    , m_frames(0)
+    , m_bytes(0)
+    , m_localDeliveries(0)
+    , m_serverMessages(0)
+    , m_tableHandle(0)
+    , m_identity(nullptr)
+    , m_codec(MessageCodec::Json)
+    , m_features(0)
+    , m_floodPolicy(ServerSettings::FloodPolicy::DelayReading)
+    , m_maxFrameBytes(0)
+    , m_resumeTimer([this]() { resumeReading(); })
+    , m_idleTimer([this]() { onIdleTimeout(); })
+    , m_loginTimer([this]() { onLoginTimeout(); })
+    , m_pingIntervalMsecs(0)
+    , m_pongTimeoutMsecs(0)
+    , m_heardFrom(false)
+    , m_pingSent(false)
+    , m_sessionActive(false)
+    , m_detached(false)
+    , m_resuming(false)
+    , m_sequence(0)
+    , m_maxReplayFrames(0)
+    , m_queuedBytes(0)
+    , m_interactiveStreak(0)
+    , m_fileBytesQueued(0)
+    , m_spill(nullptr)
+    , m_spillReadPos(0)
+    , m_refilling(false)
+    , m_eventsBlocked(0)
 {
+    m_laneOffsets.fill(0);
     connect(m_serverSocket, &QTcpSocket::readyRead, this, &ServerWorker::receiveJson);
-    connect(m_serverSocket, &QTcpSocket::disconnected, this, &ServerWorker::disconnectedFromClient);
-    connect(m_serverSocket, &QTcpSocket::errorOccurred, this, &ServerWorker::error);
+    connect(m_serverSocket, &QTcpSocket::bytesWritten, this, &ServerWorker::writeFrames);
+    connect(m_serverSocket, &QTcpSocket::disconnected, this, &ServerWorker::onDisconnected);
+    connect(m_serverSocket, &QTcpSocket::errorOccurred, this, &ServerWorker::onErrorOccurred);
 }
 
 bool ServerWorker::setSocketDescriptor(qintptr socketDescriptor)
 {
-    return m_serverSocket->setSocketDescriptor(socketDescriptor);
+    if (!m_serverSocket->setSocketDescriptor(socketDescriptor))
+        return false;
+    // The kernel's own probes, for clients without heartbeats
+    m_serverSocket->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+    return true;
+}
+
+ServerWorker::~ServerWorker()
+{
+    leaveThreadTable();
+    delete m_identity.loadRelaxed();
+}
+
+quint32 ServerWorker::handle() const
+{
+    return m_handle.loadRelaxed();
+}
+
+void ServerWorker::setHandle(quint32 handle)
+{
+    m_handle.storeRelaxed(handle);
+}
+
+int ServerWorker::threadIndex() const
+{
+    return m_threadIndex;
+}
+
+void ServerWorker::setThreadIndex(int threadIndex)
+{
+    m_threadIndex = threadIndex;
+}
+
+ServerWorker::Work ServerWorker::takeWork()
+{
+    return {m_frames.fetchAndStoreRelaxed(0), m_bytes.fetchAndStoreRelaxed(0)};
+}
+
+// Both the server thread (routing) and this worker's thread (local
+// deliveries) note peers while the balancing pass takes them, so every slot
+// update is a compare and swap
+void ServerWorker::notePeer(quint32 peerHandle)
+{
+    static constexpr quint64 CountMask = 0xFFFFFFFF;
+    const quint64 peerKey = quint64(peerHandle) << 32;
+    for (;;) {
+        QAtomicInteger<quint64> *emptySlot = nullptr;
+        QAtomicInteger<quint64> *quietestSlot = nullptr;
+        quint64 quietestValue = 0;
+        bool contended = false;
+        for (QAtomicInteger<quint64> &slot : m_peers) {
+            const quint64 value = slot.loadRelaxed();
+            if ((value & ~CountMask) == peerKey && value != 0) {
+                if ((value & CountMask) == CountMask || slot.testAndSetRelaxed(value, value + 1))
+                    return;
+                contended = true;
+                break;
+            }
+            if (value == 0) {
+                if (!emptySlot)
+                    emptySlot = &slot;
+            } else if (!quietestSlot || (value & CountMask) < (quietestValue & CountMask)) {
+                quietestSlot = &slot;
+                quietestValue = value;
+            }
+        }
+        if (contended)
+            continue;
+        // A new peer takes a free slot, or evicts the least active one
+        if (emptySlot ? emptySlot->testAndSetRelaxed(0, peerKey | 1)
+                      : quietestSlot->testAndSetRelaxed(quietestValue, peerKey | 1)) {
+            return;
+        }
+    }
+}
+
+int ServerWorker::takePeers(PeerCount *peers)
+{
+    int count = 0;
+    for (QAtomicInteger<quint64> &slot : m_peers) {
+        const quint64 value = slot.fetchAndStoreRelaxed(0);
+        if (value != 0)
+            peers[count++] = PeerCount{quint32(value >> 32), quint32(value)};
+    }
+    return count;
+}
+
+quint64 ServerWorker::localDeliveries() const
+{
+    return m_localDeliveries.loadRelaxed();
+}
+
+void ServerWorker::messageRouted()
+{
+    Q_ASSERT(m_serverMessages > 0);
+    --m_serverMessages;
+}
+
+void ServerWorker::start(qintptr socketDescriptor)
+{
+    if (!setSocketDescriptor(socketDescriptor)) {
+        onDisconnected();
+        return;
+    }
+    resetInboundLimits();
+    startTimers();
+    enterThreadTable();
+}
+
+void ServerWorker::activate()
+{
+    resetInboundLimits();
+    startTimers();
+    enterThreadTable();
+    if (m_serverSocket->state() == QAbstractSocket::ConnectedState)
+        receiveJson();
+    else
+        onDisconnected();
+}
+
+// Only ever called on the worker's current thread, the table and the timer
+// wheel are per thread. Timers are started again on the new thread with
+// what was left of them.
+void ServerWorker::moveTo(QThread *thread)
+{
+    const bool listed = m_tableHandle != 0;
+    leaveThreadTable();
+    const qint64 resumeMsecs = m_resumeTimer.remainingMsecs();
+    const qint64 idleMsecs = m_idleTimer.remainingMsecs();
+    const qint64 loginMsecs = m_loginTimer.remainingMsecs();
+    m_resumeTimer.stop();
+    m_idleTimer.stop();
+    m_loginTimer.stop();
+    moveToThread(thread);
+    QMetaObject::invokeMethod(this, [this, listed, resumeMsecs, idleMsecs, loginMsecs]() {
+        if (listed)
+            enterThreadTable();
+        if (resumeMsecs >= 0)
+            m_resumeTimer.start(resumeMsecs);
+        if (idleMsecs >= 0)
+            m_idleTimer.start(idleMsecs);
+        if (loginMsecs >= 0)
+            m_loginTimer.start(loginMsecs);
+    }, Qt::QueuedConnection);
+}
+
+void ServerWorker::enterThreadTable()
+{
+    leaveThreadTable();
+    m_tableHandle = m_handle.loadRelaxed();
+    if (m_tableHandle != 0)
+        threadWorkers.insert(m_tableHandle, this);
+}
+
+void ServerWorker::leaveThreadTable()
+{
+    if (m_tableHandle == 0)
+        return;
+    threadWorkers.remove(m_tableHandle);
+    m_tableHandle = 0;
+}
+
+void ServerWorker::reset()
+{
+    // The server may already have handed this worker a new connection, so
+    // aborting the old one must not report a disconnect
+    const QSignalBlocker blocker(m_serverSocket);
+    m_serverSocket->abort();
+    m_serverSocket->setReadBufferSize(0);
+    m_resumeTimer.stop();
+    m_idleTimer.stop();
+    m_loginTimer.stop();
+    leaveThreadTable();
+    if (const Identity *identity = m_identity.fetchAndStoreAcquire(nullptr)) {
+        QMetaObject::invokeMethod(m_server, [identity]() {
+            delete identity;
+        }, Qt::QueuedConnection);
+    }
+    m_codec.storeRelaxed(MessageCodec::Json);
+    m_features.storeRelaxed(0);
+    takeWork();
+    for (QAtomicInteger<quint64> &slot : m_peers)
+        slot.storeRelaxed(0);
+    m_localDeliveries.storeRelaxed(0);
+    m_serverMessages = 0;
+    m_acks = Acks();
+    m_messageIds.clear();
+    m_sessionActive = false;
+    m_detached = false;
+    m_resuming = false;
+    m_sequence = 0;
+    m_replay.clear();
+    m_heldFrames.clear();
+    if (!m_heldAcks.isEmpty()) {
+        ChatServer *server = m_server;
+        QMetaObject::invokeMethod(server, [server, heldAcks = std::exchange(m_heldAcks, {})]() {
+            server->acknowledgeHeld(heldAcks, AckOutcome::Failed);
+        }, Qt::QueuedConnection);
+    }
+    for (QQueue<OutboundFrame> &lane : m_lanes)
+        lane.clear();
+    m_queuedBytes = 0;
+    m_laneOffsets.fill(0);
+    m_interactiveStreak = 0;
+    m_fileBytesQueued = 0;
+    dropSpill();
+    m_pendingEvents.clear();
+    m_eventsBlocked.storeRelaxed(0);
+}
+
+const QString &ServerWorker::userName() const
+{
+    static const QString noName;
+    const Identity *identity = m_identity.loadAcquire();
+    return identity ? identity->userName : noName;
+}
+
+const QByteArray &ServerWorker::userNameUtf8() const
+{
+    static const QByteArray noName;
+    const Identity *identity = m_identity.loadAcquire();
+    return identity ? identity->userNameUtf8 : noName;
+}
+
+quint32 ServerWorker::userId() const
+{
+    const Identity *identity = m_identity.loadAcquire();
+    return identity ? identity->userId : 0;
+}
+
+void ServerWorker::setIdentity(const QString &userName, quint32 userId)
+{
+    Q_ASSERT(userId != 0);
+    const Identity *identity = new Identity{userName, userName.toUtf8(), userId};
+    if (!m_identity.testAndSetRelease(nullptr, identity)) {
+        Q_ASSERT_X(false, "ServerWorker::setIdentity", "identity already set");
+        delete identity;
+    }
+}
+
+MessageCodec::Codec ServerWorker::codec() const
+{
+    return MessageCodec::Codec(m_codec.loadRelaxed());
+}
+
+void ServerWorker::setCodec(MessageCodec::Codec codec)
+{
+    m_codec.storeRelaxed(codec);
 }
 
-QString ServerWorker::userName() const
+int ServerWorker::features() const
 {
-    m_userNameLock.lockForRead();
-    const QString result = m_userName;
-    m_userNameLock.unlock();
-    return result;
+    return m_features.loadRelaxed();
 }
 
-void ServerWorker::setUserName(const QString &userName)
+void ServerWorker::setFeatures(int features)
 {
-    m_userNameLock.lockForWrite();
-    m_userName = userName;
-    m_userNameLock.unlock();
+    m_features.storeRelaxed(features);
+}
+
+bool ServerWorker::wantsCompressed(qsizetype payloadSize) const
+{
+    const int minBytes = m_server->settings().compressMinBytes;
+    return (features() & MessageCodec::Compression) && minBytes > 0 && payloadSize >= minBytes
+           && payloadSize <= MessageCodec::MaxUncompressedSize;
+}
+
+// The socket's own buffer is kept below this, the rest waits in the lanes
+// where later control frames can still overtake it
+static constexpr qint64 SocketLowWaterBytes = 64 * 1024;
+// Payloads over this go out in chunks to clients that take them
+static constexpr qsizetype ChunkBytes = 16 * 1024;
+// Interactive payloads over this are demoted to the bulk lane
+static constexpr qsizetype BulkPayloadBytes = 64 * 1024;
+static constexpr int InteractivePerBulk = 4;
+// File data a client may have waiting in the lanes before the rest spills
+static constexpr qint64 FileWindowBytes = 1024 * 1024;
+// A client this far behind on everything but file data gets no events
+static constexpr qint64 EventBacklogBytes = 256 * 1024;
+
+ServerWorker::Lane ServerWorker::laneFor(const QJsonObject &message)
+{
+    const Protocol::MessageType type = Protocol::messageType(
+        message.value(QLatin1String("type")).toString());
+    return type == Protocol::MessageType::Message ? Lane::Interactive : Lane::Control;
 }
 
 void ServerWorker::sendJson(const QJsonObject &json)
 {
-    const QByteArray jsonData = QJsonDocument(json).toJson();
-    emit logMessage(QLatin1String("Sending to ") + userName()
-                    + QLatin1String(" - ") + QString::fromUtf8(jsonData));
-    QDataStream socketStream(m_serverSocket);
-    socketStream << jsonData;
+    sendFrame(compressedIfSmaller(MessageCodec::encode(json, codec())), laneFor(json));
+}
+
+QByteArray ServerWorker::compressedIfSmaller(QByteArray payload) const
+{
+    if (wantsCompressed(payload.size())) {
+        QByteArray compressed = MessageCodec::compress(payload);
+        if (compressed.size() < payload.size())
+            return compressed;
+    }
+    return payload;
+}
+
+void ServerWorker::sendFrame(const QByteArray &payload, Lane lane)
+{
+    if (m_resuming) {
+        m_heldFrames.append(payload);
+        return;
+    }
+    if (m_detached) {
+        numberFrame(payload);
+        return;
+    }
+    emit m_server->logMessage(QLatin1String("Sending to ") + userName()
+                              + QLatin1String(" - ") + MessageCodec::toDisplayString(payload));
+    if (lane == Lane::Interactive && payload.size() > BulkPayloadBytes)
+        lane = Lane::Bulk;
+    m_lanes[int(lane)].enqueue(OutboundFrame{payload, m_sessionActive});
+    m_queuedBytes += payload.size();
+    if (MessageCodec::isFileData(payload))
+        m_fileBytesQueued += payload.size();
+    writeFrames();
+}
+
+void ServerWorker::relayFileData(const QByteArray &payload)
+{
+    // The transfer was cancelled with the connection
+    if (m_detached)
+        return;
+    if (!m_spill && (m_resuming || m_fileBytesQueued < FileWindowBytes)) {
+        sendFrame(payload, Lane::Bulk);
+        return;
+    }
+    if (!m_spill) {
+        m_spill = new QTemporaryFile(this);
+        if (!m_spill->open()) {
+            emit m_server->logMessage(QLatin1String("Cannot spill file data for ") + userName()
+                                      + QLatin1String(": ") + m_spill->errorString());
+            dropSpill();
+            sendFrame(payload, Lane::Bulk);
+            return;
+        }
+    }
+    // Same layout as a frame on the wire
+    char header[sizeof(quint32)];
+    qToBigEndian<quint32>(quint32(payload.size()), header);
+    m_spill->seek(m_spill->size());
+    if (m_spill->write(header, sizeof(header)) != qint64(sizeof(header))
+        || m_spill->write(payload) != payload.size()) {
+        emit m_server->logMessage(QLatin1String("Lost file data for ") + userName()
+                                  + QLatin1String(": ") + m_spill->errorString());
+    }
+}
+
+// Reads spilled records back in order while the lanes have room. Sending
+// may drain the lanes right away, so writeFrames() must not call back in.
+void ServerWorker::refillFileData()
+{
+    m_refilling = true;
+    while (m_spill && m_fileBytesQueued < FileWindowBytes) {
+        m_spill->seek(m_spillReadPos);
+        char header[sizeof(quint32)];
+        if (m_spill->read(header, sizeof(header)) != qint64(sizeof(header))) {
+            dropSpill();
+            break;
+        }
+        const quint32 size = qFromBigEndian<quint32>(header);
+        const QByteArray payload = m_spill->read(size);
+        if (payload.size() != qsizetype(size)) {
+            dropSpill();
+            break;
+        }
+        m_spillReadPos += sizeof(header) + size;
+        if (m_spillReadPos >= m_spill->size())
+            dropSpill();
+        sendFrame(payload, Lane::Bulk);
+    }
+    m_refilling = false;
+}
+
+void ServerWorker::dropSpill()
+{
+    delete m_spill;
+    m_spill = nullptr;
+    m_spillReadPos = 0;
+}
+
+// Frames use the QDataStream << QByteArray layout, each built in one array
+// for QIODevice::write(const QByteArray &): what the socket cannot send at
+// once is kept in its write buffer as a shared reference to that array,
+// not copied. The pool hands a buffer out again only once the socket has
+// let go of it. A frame is numbered for a resume once it is out in full,
+// which is the order the client sees.
+void ServerWorker::writeFrames()
+{
+    const bool chunked = features() & MessageCodec::Chunks;
+    FrameBufferPool &pool = FrameBufferPool::local();
+    while (m_serverSocket->bytesToWrite() < SocketLowWaterBytes) {
+        // Events wait for real messages but not for bulk data
+        if (!m_pendingEvents.isEmpty() && m_lanes[int(Lane::Control)].isEmpty()
+            && m_lanes[int(Lane::Interactive)].isEmpty()) {
+            writeEvents();
+            continue;
+        }
+        if (!hasQueuedFrames())
+            break;
+        const int lane = nextLane();
+        const OutboundFrame &outbound = m_lanes[lane].head();
+        const QByteArray &payload = outbound.payload;
+        qsizetype &offset = m_laneOffsets[lane];
+        QByteArray frame;
+        if (chunked && (offset > 0 || payload.size() > ChunkBytes)) {
+            // The lane is the stream, each lane has one payload in chunks
+            // at a time
+            const qsizetype size = qMin(payload.size() - offset, ChunkBytes);
+            const bool last = offset + size == payload.size();
+            frame = pool.acquire(sizeof(quint32) + MessageCodec::ChunkHeaderSize + size);
+            char *out = frame.data();
+            qToBigEndian<quint32>(quint32(MessageCodec::ChunkHeaderSize + size), out);
+            out += sizeof(quint32);
+            MessageCodec::writeChunkHeader(out, quint8(lane), last);
+            memcpy(out + MessageCodec::ChunkHeaderSize, payload.constData() + offset, size);
+            offset += size;
+        } else {
+            frame = pool.acquire(sizeof(quint32) + payload.size());
+            qToBigEndian<quint32>(quint32(payload.size()), frame.data());
+            memcpy(frame.data() + sizeof(quint32), payload.constData(), payload.size());
+            offset = payload.size();
+        }
+        m_serverSocket->write(frame);
+        m_frames.fetchAndAddRelaxed(1);
+        m_bytes.fetchAndAddRelaxed(frame.size());
+        pool.release(std::move(frame));
+        if (offset == payload.size()) {
+            if (outbound.numbered)
+                numberFrame(payload);
+            if (MessageCodec::isFileData(payload))
+                m_fileBytesQueued -= payload.size();
+            offset = 0;
+            m_queuedBytes -= payload.size();
+            m_lanes[lane].dequeue();
+        }
+    }
+    if (m_spill && !m_refilling && m_fileBytesQueued < FileWindowBytes / 2)
+        refillFileData();
+    // File data has its own window and does not hold events back
+    const qint64 backlog = m_serverSocket->bytesToWrite() + m_queuedBytes - m_fileBytesQueued;
+    m_eventsBlocked.storeRelaxed(backlog >= EventBacklogBytes);
+}
+
+void ServerWorker::sendEvent(quint64 key, const QByteArray &payload)
+{
+    if (m_detached || m_resuming || eventsBlocked()) {
+        // An older state must not go out after the newer one was dropped
+        m_pendingEvents.remove(key);
+        m_server->m_droppedEvents.fetchAndAddRelaxed(1);
+        return;
+    }
+    QByteArray &pending = m_pendingEvents[key];
+    if (!pending.isNull())
+        m_server->m_coalescedEvents.fetchAndAddRelaxed(1);
+    pending = payload;
+    writeFrames();
+}
+
+bool ServerWorker::eventsBlocked() const
+{
+    return m_eventsBlocked.loadRelaxed() != 0;
+}
+
+void ServerWorker::writeEvents()
+{
+    FrameBufferPool &pool = FrameBufferPool::local();
+    for (const QByteArray &payload : std::as_const(m_pendingEvents)) {
+        QByteArray frame = pool.acquire(sizeof(quint32) + payload.size());
+        qToBigEndian<quint32>(quint32(payload.size()), frame.data());
+        memcpy(frame.data() + sizeof(quint32), payload.constData(), payload.size());
+        m_serverSocket->write(frame);
+        m_frames.fetchAndAddRelaxed(1);
+        m_bytes.fetchAndAddRelaxed(frame.size());
+        pool.release(std::move(frame));
+    }
+    m_pendingEvents.clear();
+}
+
+bool ServerWorker::hasQueuedFrames() const
+{
+    return std::any_of(m_lanes.cbegin(), m_lanes.cend(), [](const QQueue<OutboundFrame> &lane) {
+        return !lane.isEmpty();
+    });
+}
+
+int ServerWorker::nextLane()
+{
+    if (!m_lanes[int(Lane::Control)].isEmpty())
+        return int(Lane::Control);
+    const bool bulkWaiting = !m_lanes[int(Lane::Bulk)].isEmpty();
+    if (!m_lanes[int(Lane::Interactive)].isEmpty()
+        && (!bulkWaiting || m_interactiveStreak < InteractivePerBulk)) {
+        ++m_interactiveStreak;
+        return int(Lane::Interactive);
+    }
+    m_interactiveStreak = 0;
+    return int(Lane::Bulk);
+}
+
+// File data would push every chat frame out of the replay buffer, and its
+// transfer is cancelled with the connection anyway
+void ServerWorker::numberFrame(const QByteArray &payload)
+{
+    if (!m_sessionActive || MessageCodec::isFileData(payload))
+        return;
+    ++m_sequence;
+    m_replay.enqueue(payload);
+    if (m_replay.size() > m_maxReplayFrames)
+        m_replay.dequeue();
+}
+
+void ServerWorker::startSession()
+{
+    m_sessionActive = true;
+    m_sequence = 0;
+    m_replay.clear();
+    m_maxReplayFrames = qMax(m_server->settings().replayFrames, 0);
+}
+
+// Complete if the client's last frame is still buffered or just before the
+// oldest one kept; either way this worker is done with the session
+bool ServerWorker::exportSession(quint64 lastSequence, QVector<QByteArray> *replay,
+                                 DedupWindow *messageIds)
+{
+    Q_ASSERT(replay && messageIds);
+    *messageIds = m_messageIds;
+    leaveThreadTable();
+    const quint64 oldest = m_sequence - quint64(m_replay.size());
+    const bool complete = m_sessionActive && lastSequence >= oldest && lastSequence <= m_sequence;
+    if (complete) {
+        for (qsizetype i = qsizetype(lastSequence - oldest); i < m_replay.size(); ++i)
+            replay->append(m_replay.at(i));
+    }
+    m_sessionActive = false;
+    m_replay.clear();
+    return complete;
+}
+
+// The server has already given this worker the session's handle
+void ServerWorker::beginResume()
+{
+    m_resuming = true;
+    enterThreadTable();
+}
+
+// The reply goes first and is not numbered, then the client gets what it
+// missed and what arrived for it since, numbered on from its last frame
+void ServerWorker::completeResume(const QJsonObject &reply, const QVector<QByteArray> &replay,
+                                  quint64 lastSequence, const DedupWindow &messageIds)
+{
+    m_resuming = false;
+    m_messageIds = messageIds;
+    sendJson(reply);
+    startSession();
+    m_sequence = lastSequence;
+    for (const QByteArray &payload : replay)
+        sendFrame(payload);
+    const QVector<QByteArray> heldFrames = std::exchange(m_heldFrames, {});
+    for (const QByteArray &payload : heldFrames)
+        sendFrame(payload);
+}
+
+bool ServerWorker::holdAck(quint32 senderHandle, quint32 messageId)
+{
+    if (!m_detached)
+        return false;
+    if (messageId != 0)
+        m_heldAcks.append(quint64(senderHandle) << 32 | messageId);
+    return true;
+}
+
+QVector<quint64> ServerWorker::takeHeldAcks()
+{
+    return std::exchange(m_heldAcks, {});
 }
 
 void ServerWorker::disconnectFromClient()
@@ -46,28 +652,407 @@ void ServerWorker::disconnectFromClient()
     m_serverSocket->disconnectFromHost();
 }
 
+void ServerWorker::abortConnection()
+{
+    m_serverSocket->abort();
+}
+
+// Calls into the server carry the handle rather than this pointer, the
+// server drops them if the connection is no longer registered
+void ServerWorker::onDisconnected()
+{
+    ChatServer *server = m_server;
+    const quint32 handle = m_handle.loadRelaxed();
+    // Not registered yet, activate() reports it
+    if (handle == 0)
+        return;
+    // The server may keep the session for a resume, until then sends are
+    // only buffered
+    if (m_sessionActive) {
+        m_detached = true;
+        m_resumeTimer.stop();
+        m_idleTimer.stop();
+        m_loginTimer.stop();
+        // What is still in the lanes never reached the client, so it is
+        // numbered now, in the order it would have gone out
+        while (hasQueuedFrames()) {
+            const int lane = nextLane();
+            const OutboundFrame outbound = m_lanes[lane].dequeue();
+            if (outbound.numbered)
+                numberFrame(outbound.payload);
+        }
+        m_queuedBytes = 0;
+        m_laneOffsets.fill(0);
+        m_pendingEvents.clear();
+        // The server cancels the client's transfers, their data is no use
+        m_fileBytesQueued = 0;
+        dropSpill();
+    }
+    QMetaObject::invokeMethod(server, [server, handle]() {
+        server->userDisconnected(handle);
+    }, Qt::QueuedConnection);
+}
+
+void ServerWorker::onErrorOccurred()
+{
+    ChatServer *server = m_server;
+    const quint32 handle = m_handle.loadRelaxed();
+    QMetaObject::invokeMethod(server, [server, handle]() {
+        server->userError(handle);
+    }, Qt::QueuedConnection);
+}
+
+void ServerWorker::resetInboundLimits()
+{
+    const ServerSettings &settings = m_server->settings();
+    const qint64 now = QDeadlineTimer::current().deadlineNSecs();
+    m_messageBucket = TokenBucket(quint32(qMax(settings.messagesPerSecond, 0)),
+                                  quint32(qMax(settings.messageBurst, 1)), now);
+    m_byteBucket = TokenBucket(quint32(qMax(settings.bytesPerSecond, 0)),
+                               quint32(qMax(settings.byteBurst, 1)), now);
+    m_floodPolicy = settings.floodPolicy;
+    m_maxFrameBytes = quint32(qMax(settings.maxFrameBytes, 0));
+}
+
+// Takes the frame's share of both limits, or nothing if either is short
+bool ServerWorker::admitFrame(quint32 frameBytes, quint32 messages)
+{
+    const qint64 now = QDeadlineTimer::current().deadlineNSecs();
+    if (m_messageBucket.nsecsUntilAvailable(now, messages) != 0
+        || m_byteBucket.nsecsUntilAvailable(now, frameBytes) != 0) {
+        return false;
+    }
+    m_messageBucket.tryTake(now, messages);
+    m_byteBucket.tryTake(now, frameBytes);
+    return true;
+}
+
+// Qt stops reading from the kernel once the socket buffer holds its limit.
+// The client's unread data then fills the TCP window and holds it back,
+// rather than piling up in our memory.
+void ServerWorker::pauseReading(quint32 frameBytes, quint32 messages)
+{
+    const qint64 now = QDeadlineTimer::current().deadlineNSecs();
+    const qint64 waitNsecs = qMax(m_messageBucket.nsecsUntilAvailable(now, messages),
+                                  m_byteBucket.nsecsUntilAvailable(now, frameBytes));
+    m_serverSocket->setReadBufferSize(qMax<qint64>(m_serverSocket->bytesAvailable(), 1));
+    m_resumeTimer.start((waitNsecs + 999999) / 1000000);
+    m_server->m_pausedReads.fetchAndAddRelaxed(1);
+}
+
+void ServerWorker::resumeReading()
+{
+    m_serverSocket->setReadBufferSize(0);
+    receiveJson();
+}
+
+void ServerWorker::startTimers()
+{
+    const ServerSettings &settings = m_server->settings();
+    m_pingIntervalMsecs = qint64(qMax(settings.pingIntervalSecs, 0)) * 1000;
+    m_pongTimeoutMsecs = qint64(qMax(settings.pongTimeoutSecs, 1)) * 1000;
+    m_heardFrom = false;
+    m_pingSent = false;
+    if (m_pingIntervalMsecs > 0)
+        m_idleTimer.start(m_pingIntervalMsecs);
+    if (settings.loginTimeoutSecs > 0)
+        m_loginTimer.start(qint64(settings.loginTimeoutSecs) * 1000);
+}
+
+// Traffic is only noted, not timed, so the timer is not moved for every
+// frame: a client is pinged after one to two intervals of silence
+void ServerWorker::onIdleTimeout()
+{
+    if (m_heardFrom || !(features() & MessageCodec::Heartbeats)) {
+        m_heardFrom = false;
+        m_pingSent = false;
+        m_idleTimer.start(m_pingIntervalMsecs);
+        return;
+    }
+    if (!m_pingSent) {
+        QJsonObject ping;
+        ping[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Ping);
+        sendJson(ping);
+        m_pingSent = true;
+        m_idleTimer.start(m_pongTimeoutMsecs);
+        return;
+    }
+    emit m_server->logMessage(userName() + QLatin1String(" did not answer a ping, disconnecting"));
+    m_serverSocket->abort();
+}
+
+void ServerWorker::onLoginTimeout()
+{
+    if (userId() != 0)
+        return;
+    emit m_server->logMessage(QStringLiteral("Client did not log in in time, disconnecting"));
+    m_serverSocket->abort();
+}
+
 void ServerWorker::receiveJson()
 {
-    QByteArray jsonData;
-    QDataStream socketStream(m_serverSocket);
+    // Frames wait in the socket until the server has registered us, or
+    // until the client is back within its limits
+    if (m_handle.loadRelaxed() == 0 || m_resumeTimer.isActive())
+        return;
+    m_heardFrom = true;
+    FrameBufferPool &pool = FrameBufferPool::local();
     for (;;) {
-        socketStream.startTransaction();
-        socketStream >> jsonData;
-        if (socketStream.commitTransaction()) {
-            QJsonParseError parseError;
-            const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData, &parseError);
-            if (parseError.error == QJsonParseError::NoError) {
-                if (jsonDoc.isObject())
-                    emit jsonReceived(jsonDoc.object());
-                else
-                    emit logMessage(QLatin1String("Invalid message: ")
-                                    + QString::fromUtf8(jsonData));
-            } else {
-                    emit logMessage(QLatin1String("Invalid message: ")
-                                + QString::fromUtf8(jsonData));
+        // Frames use the QDataStream QByteArray layout, where a length of
+        // 0xFFFFFFFF stands for a null array
+        char header[sizeof(quint32)];
+        if (m_serverSocket->peek(header, sizeof(header)) < qint64(sizeof(header)))
+            break;
+        quint32 frameSize = qFromBigEndian<quint32>(header);
+        if (frameSize == 0xFFFFFFFF)
+            frameSize = 0;
+        // Otherwise the socket would buffer whatever length it announced
+        if (m_maxFrameBytes != 0 && frameSize > m_maxFrameBytes) {
+            m_server->m_floodDisconnects.fetchAndAddRelaxed(1);
+            emit m_server->logMessage(QLatin1String("Disconnecting ") + userName()
+                                      + QLatin1String(", frame over the size limit"));
+            m_serverSocket->abort();
+            return;
+        }
+        if (m_serverSocket->bytesAvailable() < qint64(sizeof(header)) + frameSize)
+            break;
+        const quint32 frameBytes = quint32(qMin<quint64>(sizeof(header) + quint64(frameSize), 0xFFFFFFFF));
+        // File data only counts against the byte limit
+        char prefix[sizeof(header) + 1];
+        const bool fileData = frameSize > 0
+            && m_serverSocket->peek(prefix, sizeof(prefix)) == qint64(sizeof(prefix))
+            && MessageCodec::isFileData(QByteArray::fromRawData(prefix + sizeof(header), 1));
+        const quint32 messages = fileData ? 0 : 1;
+        if (!admitFrame(frameBytes, messages)) {
+            if (m_floodPolicy == ServerSettings::FloodPolicy::DelayReading) {
+                pauseReading(frameBytes, messages);
+                break;
+            }
+            if (m_floodPolicy == ServerSettings::FloodPolicy::Disconnect) {
+                m_server->m_floodDisconnects.fetchAndAddRelaxed(1);
+                emit m_server->logMessage(QLatin1String("Disconnecting ") + userName()
+                                          + QLatin1String(", over its message rate"));
+                m_serverSocket->abort();
+                return;
+            }
+            m_server->m_rejectedFrames.fetchAndAddRelaxed(1);
+            m_serverSocket->skip(frameBytes);
+            continue;
+        }
+        m_serverSocket->skip(sizeof(header));
+        QByteArray jsonData = pool.acquire(frameSize);
+        m_serverSocket->read(jsonData.data(), frameSize);
+        m_frames.fetchAndAddRelaxed(1);
+        m_bytes.fetchAndAddRelaxed(sizeof(header) + frameSize);
+
+        if (fileData) {
+            // The server thread knows where the transfer goes
+            ChatServer *server = m_server;
+            const quint32 handle = m_handle.loadRelaxed();
+            QMetaObject::invokeMethod(server, [server, handle, payload = std::move(jsonData)]() mutable {
+                server->fileDataReceived(handle, std::move(payload));
+            }, Qt::QueuedConnection);
+            continue;
+        }
+        if (MessageCodec::isRelay(jsonData)) {
+            MessageCodec::RelayFrame frame;
+            if (MessageCodec::decodeRelay(jsonData, &frame)) {
+                // Masked in place, the text is a slice of the frame
+                const qsizetype textOffset = frame.text.data() - jsonData.constData();
+                if (dropResent(frame.messageId)
+                    || filterText(jsonData.data() + textOffset, frame.text.size(), frame.messageId)
+                           == MessageFilter::Verdict::Blocked) {
+                    pool.release(std::move(jsonData));
+                    continue;
+                }
+            }
+            if (deliverLocally(jsonData))
+                continue;
+            // Routed on the header alone, the text stays opaque. The buffer
+            // goes with it to the server thread, so it is not recycled here.
+            ChatServer *server = m_server;
+            const quint32 handle = m_handle.loadRelaxed();
+            const bool counted = userId() != 0;
+            m_serverMessages += counted;
+            QMetaObject::invokeMethod(server, [server, handle, jsonData, counted]() {
+                server->relayReceived(handle, jsonData);
+                if (counted)
+                    server->messageRouted(handle);
+            }, Qt::QueuedConnection);
+            continue;
+        }
+        bool decoded = false;
+        QJsonObject json = MessageCodec::decode(jsonData, &decoded);
+        // Heartbeats are answered here, the server thread never sees them;
+        // a pong has done its job by arriving at all
+        const Protocol::MessageType type = decoded
+            ? Protocol::messageType(json.value(QLatin1String("type")).toString())
+            : Protocol::MessageType::Unknown;
+        if (type == Protocol::MessageType::Ping) {
+            QJsonObject pong;
+            pong[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Pong);
+            sendJson(pong);
+        } else if (decoded && type != Protocol::MessageType::Pong) {
+            const quint32 messageId = type == Protocol::MessageType::Message
+                ? quint32(json.value(QLatin1String("msgId")).toInteger())
+                : 0;
+            const bool message = type == Protocol::MessageType::Message;
+            bool routed = !message || !dropResent(messageId);
+            if (routed && message) {
+                const QJsonValue textVal = json.value(QLatin1String("text"));
+                QByteArray text = textVal.isString() ? textVal.toString().toUtf8() : QByteArray();
+                switch (filterText(text.data(), text.size(), messageId)) {
+                case MessageFilter::Verdict::Pass:
+                    break;
+                case MessageFilter::Verdict::Masked:
+                    json[QStringLiteral("text")] = QString::fromUtf8(text);
+                    break;
+                case MessageFilter::Verdict::Blocked:
+                    routed = false;
+                    break;
+                }
+            }
+            if (routed) {
+                ChatServer *server = m_server;
+                const quint32 handle = m_handle.loadRelaxed();
+                const bool counted = message && userId() != 0;
+                m_serverMessages += counted;
+                QMetaObject::invokeMethod(server, [server, handle, json, counted]() {
+                    server->jsonReceived(handle, json);
+                    if (counted)
+                        server->messageRouted(handle);
+                }, Qt::QueuedConnection);
             }
         } else {
-            break;
+            emit m_server->logMessage(QLatin1String("Invalid message: ")
+                                      + MessageCodec::toDisplayString(jsonData));
         }
+        pool.release(std::move(jsonData));
+    }
+}
+
+// Also before routing, so the server thread never pays for it. A blocked
+// message fails for its sender like one with no recipient.
+MessageFilter::Verdict ServerWorker::filterText(char *text, qsizetype size, quint32 messageId)
+{
+    const std::shared_ptr<const MessageFilter> filter = m_server->filter();
+    if (!filter || size == 0)
+        return MessageFilter::Verdict::Pass;
+    const MessageFilter::Verdict verdict = filter->apply(text, size);
+    if (verdict == MessageFilter::Verdict::Blocked) {
+        emit m_server->logMessage(QLatin1String("Blocked a message from ") + userName());
+        acknowledge(AckOutcome::Failed, messageId);
     }
+    return verdict;
+}
+
+// Checked before any routing, on the sender's thread. The first copy went
+// its way and was or will be acknowledged; the client resent it because it
+// missed that ack, so the copy is acknowledged again as delivered. Ids of
+// failed messages are forgotten, their copies are routed like new ones.
+bool ServerWorker::dropResent(quint32 messageId)
+{
+    if (messageId == 0 || m_messageIds.insert(messageId))
+        return false;
+    m_server->m_duplicateMessages.fetchAndAddRelaxed(1);
+    acknowledge(AckOutcome::Delivered, messageId);
+    return true;
+}
+
+// The server thread's checks for a relay frame by id, done here when the
+// recipient lives on this thread and takes the frame as it is. Anything
+// else, including every case the server would log or reject, goes the
+// usual way.
+bool ServerWorker::deliverLocally(const QByteArray &payload)
+{
+    MessageCodec::RelayFrame frame;
+    if (!MessageCodec::decodeRelay(payload, &frame) || frame.peerId == 0)
+        return false;
+    const quint32 senderId = userId();
+    if (senderId == 0)
+        return false;
+    if (m_serverMessages > 0)
+        return false;
+    // A released worker stays listed until its reset runs, with its
+    // identity still set but its handle cleared
+    ServerWorker *recipient = threadWorkers.value(frame.peerId);
+    if (!recipient || recipient->handle() != frame.peerId || recipient->userId() == 0)
+        return false;
+    const int recipientFeatures = recipient->features();
+    if (!(recipientFeatures & MessageCodec::RelayFrames) || !(recipientFeatures & MessageCodec::UserIds))
+        return false;
+    if (!Utf8::isValid(frame.text))
+        return false;
+    const QByteArrayView text = Utf8::trimmed(frame.text);
+    if (text.isEmpty()) {
+        acknowledge(AckOutcome::Failed, frame.messageId);
+        return true;
+    }
+    recipient->sendFrame(recipient->compressedIfSmaller(MessageCodec::encodeRelay(senderId, text)));
+    notePeer(frame.peerId);
+    m_localDeliveries.fetchAndAddRelaxed(1);
+    if (!recipient->holdAck(m_handle.loadRelaxed(), frame.messageId))
+        acknowledge(AckOutcome::Delivered, frame.messageId);
+    return true;
+}
+
+void ServerWorker::Acks::append(AckOutcome outcome, quint32 messageId)
+{
+    switch (outcome) {
+    case AckOutcome::Accepted:
+        accepted.append(messageId);
+        break;
+    case AckOutcome::Delivered:
+        delivered.append(messageId);
+        break;
+    case AckOutcome::Failed:
+        failed.append(messageId);
+        break;
+    }
+}
+
+QJsonObject ServerWorker::Acks::toJson() const
+{
+    const auto toArray = [](const QVector<quint32> &ids) {
+        QJsonArray array;
+        for (quint32 id : ids)
+            array.append(qint64(id));
+        return array;
+    };
+    QJsonObject message;
+    message[QStringLiteral("type")] = Protocol::typeName(Protocol::MessageType::Ack);
+    if (!accepted.isEmpty())
+        message[QStringLiteral("accepted")] = toArray(accepted);
+    if (!delivered.isEmpty())
+        message[QStringLiteral("delivered")] = toArray(delivered);
+    if (!failed.isEmpty())
+        message[QStringLiteral("failed")] = toArray(failed);
+    return message;
+}
+
+// The first ack of a pass queues the flush behind everything already posted
+// to this thread, so the acks of a whole pass go out as one message
+void ServerWorker::acknowledge(AckOutcome outcome, quint32 messageId)
+{
+    if (messageId == 0)
+        return;
+    if (outcome == AckOutcome::Failed)
+        m_messageIds.forget(messageId);
+    if (m_acks.isEmpty())
+        QMetaObject::invokeMethod(this, &ServerWorker::flushAcks, Qt::QueuedConnection);
+    m_acks.append(outcome, messageId);
+}
+
+void ServerWorker::forgetMessages(const QVector<quint32> &messageIds)
+{
+    for (quint32 messageId : messageIds)
+        m_messageIds.forget(messageId);
+}
+
+void ServerWorker::flushAcks()
+{
+    if (m_acks.isEmpty())
+        return;
+    sendJson(m_acks.toJson());
+    m_acks = Acks();
 }
@@ -1,32 +1,253 @@
 #ifndef SERVERWORKER_H
 #define SERVERWORKER_H
 
+#include "dedupwindow.h"
+#include "messagecodec.h"
+#include "messagefilter.h"
+#include "serversettings.h"
+#include "timerwheel.h"
+#include "tokenbucket.h"
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QHash>
 #include <QObject>
+#include <QQueue>
 #include <QTcpSocket>
-#include <QReadWriteLock>
+#include <QVector>
+#include <array>
 
+class ChatServer;
+class QTemporaryFile;
 class ServerWorker : public QObject
 {
     Q_OBJECT
 public:
-    explicit ServerWorker(QObject *parent = nullptr);
+    // Frames and bytes moved since the last takeWork()
+    struct Work
+    {
+        quint32 frames;
+        quint64 bytes;
+    };
+    // Messages sent to one peer since the last takePeers()
+    struct PeerCount
+    {
+        quint32 handle;
+        quint32 messages;
+    };
+    static constexpr int PeerSlots = 4;
+    // Outbound frames wait in one queue per lane and are written as the
+    // socket drains. Control frames always go first, bulk frames get a turn
+    // after every few interactive ones.
+    enum class Lane {
+        // Login replies, presence, acks and heartbeats
+        Control,
+        Interactive,
+        // Anything large
+        Bulk
+    };
+    static constexpr int LaneCount = 3;
+    static Lane laneFor(const QJsonObject &message);
+    // Client message ids waiting to be acknowledged, sent as one "ack"
+    // message per event loop pass
+    enum class AckOutcome {
+        // The server found the recipient and routes the message
+        Accepted,
+        // Handed to the recipient's socket, or replayed to it once it
+        // resumed; to every recipient's thread for a broadcast
+        Delivered,
+        Failed
+    };
+    struct Acks
+    {
+        QVector<quint32> accepted;
+        QVector<quint32> delivered;
+        QVector<quint32> failed;
+
+        void append(AckOutcome outcome, quint32 messageId);
+        bool isEmpty() const { return accepted.isEmpty() && delivered.isEmpty() && failed.isEmpty(); }
+        QJsonObject toJson() const;
+    };
+
+    explicit ServerWorker(ChatServer *server, QObject *parent = nullptr);
+    ~ServerWorker();
     virtual bool setSocketDescriptor(qintptr socketDescriptor);
-    QString userName() const;
-    void setUserName(const QString &userName);
+    // Registry handle of the current connection, 0 while the worker is idle
+    // in the pool. Only the ChatServer thread changes it.
+    quint32 handle() const;
+    void setHandle(quint32 handle);
+    // Thread the server last assigned; only used by the ChatServer thread
+    int threadIndex() const;
+    void setThreadIndex(int threadIndex);
+    Work takeWork();
+    // Keeps the few peers this connection writes to most; callable from any
+    // thread
+    void notePeer(quint32 peerHandle);
+    int takePeers(PeerCount *peers);
+    // Relay frames this connection delivered on its own thread
+    quint64 localDeliveries() const;
+    // Queued by the server thread once a message this connection posted
+    // there is routed, behind the deliveries it made
+    void messageRouted();
+    // Empty and 0 until login, fixed afterwards
+    const QString &userName() const;
+    const QByteArray &userNameUtf8() const;
+    quint32 userId() const;
+    void setIdentity(const QString &userName, quint32 userId);
+    MessageCodec::Codec codec() const;
+    void setCodec(MessageCodec::Codec codec);
+    int features() const;
+    void setFeatures(int features);
+    // Whether a payload this large goes to the client compressed; callable
+    // from any thread
+    bool wantsCompressed(qsizetype payloadSize) const;
     void sendJson(const QJsonObject &json);
+    void sendFrame(const QByteArray &payload, Lane lane = Lane::Interactive);
+    // A slice of a file on its way to this worker's client. What the lanes
+    // cannot take yet waits in a temporary file rather than in memory.
+    void relayFileData(const QByteArray &payload);
+    // An ephemeral frame, kept only until the next one with the same key and
+    // written whenever no real message waits. Dropped while the client is
+    // behind, see eventsBlocked().
+    void sendEvent(quint64 key, const QByteArray &payload);
+    // Callable from any thread, so a fan-out can skip the worker early
+    bool eventsBlocked() const;
+    // Session resume, each run on the worker's own thread. Frames sent
+    // after the login reply are numbered from 1 and the last few are kept.
+    // Once the client is gone they are only kept, until another worker
+    // takes over the session with the frames the client has not seen.
+    void startSession();
+    bool exportSession(quint64 lastSequence, QVector<QByteArray> *replay,
+                       DedupWindow *messageIds);
+    void beginResume();
+    void completeResume(const QJsonObject &reply, const QVector<QByteArray> &replay,
+                        quint64 lastSequence, const DedupWindow &messageIds);
+    // A message for a detached client is only buffered, so its ack waits
+    // until the session is resumed or over. False while the client is
+    // connected. Run on the worker's own thread.
+    bool holdAck(quint32 senderHandle, quint32 messageId);
+    // Sender handle in the high half, message id in the low half
+    QVector<quint64> takeHeldAcks();
+    // Failed messages are routed again if the client resends them. Run on
+    // the worker's own thread.
+    void forgetMessages(const QVector<quint32> &messageIds);
 public slots:
     void disconnectFromClient();
+    // Without waiting for unsent data, for a connection that may be dead
+    void abortConnection();
+    // Both run on the worker's own thread: take over a connection, and get
+    // back to a clean state before the worker returns to the pool
+    void start(qintptr socketDescriptor);
+    void reset();
+    // For a connection accepted on this thread, once the server registered it
+    void activate();
+    void moveTo(QThread *thread);
 private slots:
     void receiveJson();
-signals:
-    void jsonReceived(const QJsonObject &jsonDoc);
-    void disconnectedFromClient();
-    void error();
-    void logMessage(const QString &msg);
+    void onDisconnected();
+    void onErrorOccurred();
+    void writeFrames();
 private:
+    // For payloads only this client gets
+    QByteArray compressedIfSmaller(QByteArray payload) const;
+    bool hasQueuedFrames() const;
+    void writeEvents();
+    void refillFileData();
+    void dropSpill();
+    int nextLane();
+    void numberFrame(const QByteArray &payload);
+    bool dropResent(quint32 messageId);
+    MessageFilter::Verdict filterText(char *text, qsizetype size, quint32 messageId);
+    bool deliverLocally(const QByteArray &payload);
+    void acknowledge(AckOutcome outcome, quint32 messageId);
+    void flushAcks();
+    void resetInboundLimits();
+    bool admitFrame(quint32 frameBytes, quint32 messages);
+    void pauseReading(quint32 frameBytes, quint32 messages);
+    void resumeReading();
+    void startTimers();
+    void onIdleTimeout();
+    void onLoginTimeout();
+    void enterThreadTable();
+    void leaveThreadTable();
+
+    ChatServer *m_server;
     QTcpSocket *m_serverSocket;
-    QString m_userName;
-    mutable QReadWriteLock m_userNameLock;
+    QAtomicInteger<quint32> m_handle;
+    int m_threadIndex;
+    QAtomicInteger<quint32> m_frames;
+    QAtomicInteger<quint64> m_bytes;
+    // Peer handle in the high half, message count in the low half
+    std::array<QAtomicInteger<quint64>, PeerSlots> m_peers;
+    QAtomicInteger<quint64> m_localDeliveries;
+    // Messages of a logged in client posted to the server thread and not
+    // routed yet; none are delivered locally meanwhile, they could overtake
+    // those. Only used on the worker's own thread.
+    int m_serverMessages;
+    // Handle this worker is listed under on its thread, 0 if it is not
+    quint32 m_tableHandle;
+    struct Identity
+    {
+        QString userName;
+        QByteArray userNameUtf8;
+        quint32 userId;
+    };
+    // Published once at login and never changed while the connection
+    // lasts, so any thread can read it without taking a lock. Besides the
+    // worker's own thread only the server thread reads it, so a reset hands
+    // it there to be deleted once references taken there are gone.
+    QAtomicPointer<const Identity> m_identity;
+    QAtomicInt m_codec;
+    QAtomicInt m_features;
+    // Inbound limits, only used on the worker's own thread
+    TokenBucket m_messageBucket;
+    TokenBucket m_byteBucket;
+    ServerSettings::FloodPolicy m_floodPolicy;
+    // 0 for no limit
+    quint32 m_maxFrameBytes;
+    // Deadlines on the thread's timer wheel rather than a QTimer each
+    TimerWheel::Timer m_resumeTimer;
+    TimerWheel::Timer m_idleTimer;
+    TimerWheel::Timer m_loginTimer;
+    qint64 m_pingIntervalMsecs;
+    qint64 m_pongTimeoutMsecs;
+    // Anything read since the idle timer last fired
+    bool m_heardFrom;
+    bool m_pingSent;
+    // Messages delivered on this thread, acknowledged from here
+    Acks m_acks;
+    // Ids of the messages this client sent lately, so a resend after a
+    // reconnect is not delivered twice
+    DedupWindow m_messageIds;
+    bool m_sessionActive;
+    // The client's socket is gone, frames are only kept for a resume
+    bool m_detached;
+    // Frames are held back until the resumed session's replay is out
+    bool m_resuming;
+    quint64 m_sequence;
+    QQueue<QByteArray> m_replay;
+    int m_maxReplayFrames;
+    QVector<QByteArray> m_heldFrames;
+    // Failed if the worker is reset with them
+    QVector<quint64> m_heldAcks;
+    struct OutboundFrame
+    {
+        QByteArray payload;
+        // Sent after the login reply, so it counts for a resume
+        bool numbered;
+    };
+    std::array<QQueue<OutboundFrame>, LaneCount> m_lanes;
+    qint64 m_queuedBytes;
+    // How much of each lane's first payload went out in chunks
+    std::array<qsizetype, LaneCount> m_laneOffsets;
+    int m_interactiveStreak;
+    // File data in the lanes, and the records of what did not fit there
+    qint64 m_fileBytesQueued;
+    QTemporaryFile *m_spill;
+    qint64 m_spillReadPos;
+    bool m_refilling;
+    // Latest ephemeral frame by key
+    QHash<quint64, QByteArray> m_pendingEvents;
+    QAtomicInt m_eventsBlocked;
 };
 
 #endif // SERVERWORKER_H
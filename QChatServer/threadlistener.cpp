@@ -0,0 +1,113 @@
+#include "threadlistener.h"
+#include "chatserver.h"
+#include "serverworker.h"
+
+#ifdef Q_OS_LINUX
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+ThreadListener::ThreadListener(ChatServer *server, int threadIdx, QObject *parent)
+    : QTcpServer(parent)
+    , m_server(server)
+    , m_threadIdx(threadIdx)
+    , m_poolHits(0)
+    , m_poolMisses(0)
+{}
+
+ThreadListener::~ThreadListener()
+{
+    qDeleteAll(m_idleWorkers);
+}
+
+bool ThreadListener::listenShared(const QHostAddress &address, quint16 port)
+{
+#ifdef Q_OS_LINUX
+    // QTcpServer has no way to set SO_REUSEPORT before binding, so the
+    // socket is set up here and handed over already listening
+    sockaddr_storage storage;
+    memset(&storage, 0, sizeof(storage));
+    socklen_t storageSize;
+    int family;
+    if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+        sockaddr_in *ipv4 = reinterpret_cast<sockaddr_in *>(&storage);
+        ipv4->sin_family = family = AF_INET;
+        ipv4->sin_port = htons(port);
+        ipv4->sin_addr.s_addr = htonl(address.toIPv4Address());
+        storageSize = sizeof(sockaddr_in);
+    } else {
+        // QHostAddress::Any is dual stack, like QTcpServer::listen()
+        sockaddr_in6 *ipv6 = reinterpret_cast<sockaddr_in6 *>(&storage);
+        ipv6->sin6_family = family = AF_INET6;
+        ipv6->sin6_port = htons(port);
+        const Q_IPV6ADDR ipv6Address = address == QHostAddress::Any
+                                           ? QHostAddress(QHostAddress::AnyIPv6).toIPv6Address()
+                                           : address.toIPv6Address();
+        memcpy(&ipv6->sin6_addr, &ipv6Address, sizeof(ipv6Address));
+        storageSize = sizeof(sockaddr_in6);
+    }
+
+    const int fd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    const int enable = 1;
+    const int disable = 0;
+    bool ok = ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == 0
+              && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == 0;
+    if (ok && family == AF_INET6 && address == QHostAddress::Any)
+        ok = ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable)) == 0;
+    ok = ok && ::bind(fd, reinterpret_cast<sockaddr *>(&storage), storageSize) == 0
+         && ::listen(fd, SOMAXCONN) == 0 && setSocketDescriptor(fd);
+    if (!ok)
+        ::close(fd);
+    return ok;
+#else
+    Q_UNUSED(address)
+    Q_UNUSED(port)
+    return false;
+#endif
+}
+
+void ThreadListener::recycle(ServerWorker *worker)
+{
+    if (m_idleWorkers.size() >= ChatServer::MaxIdleWorkersPerThread) {
+        delete worker;
+        return;
+    }
+    m_idleWorkers.append(worker);
+}
+
+quint64 ThreadListener::poolHits() const
+{
+    return m_poolHits.loadRelaxed();
+}
+
+quint64 ThreadListener::poolMisses() const
+{
+    return m_poolMisses.loadRelaxed();
+}
+
+// The socket is live right away, but the worker leaves incoming frames in
+// the socket buffer until the ChatServer has registered it
+void ThreadListener::incomingConnection(qintptr socketDescriptor)
+{
+    ServerWorker *worker;
+    if (!m_idleWorkers.isEmpty()) {
+        m_poolHits.fetchAndAddRelaxed(1);
+        worker = m_idleWorkers.takeLast();
+    } else {
+        m_poolMisses.fetchAndAddRelaxed(1);
+        worker = new ServerWorker(m_server);
+    }
+    if (!worker->setSocketDescriptor(socketDescriptor)) {
+        recycle(worker);
+        return;
+    }
+    ChatServer *server = m_server;
+    const int threadIdx = m_threadIdx;
+    QMetaObject::invokeMethod(server, [server, worker, threadIdx]() {
+        server->adoptWorker(worker, threadIdx);
+    }, Qt::QueuedConnection);
+}
@@ -0,0 +1,35 @@
+#ifndef THREADLISTENER_H
+#define THREADLISTENER_H
+
+#include <QAtomicInteger>
+#include <QHostAddress>
+#include <QTcpServer>
+#include <QVector>
+
+class ChatServer;
+class ServerWorker;
+// Accepts connections on a worker thread. Each listener binds its own
+// SO_REUSEPORT socket to the shared port, builds the ServerWorker for a new
+// connection on its thread and only asks the ChatServer to register it.
+class ThreadListener : public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit ThreadListener(ChatServer *server, int threadIdx, QObject *parent = nullptr);
+    ~ThreadListener();
+    // Both run on the listener's thread
+    bool listenShared(const QHostAddress &address, quint16 port);
+    void recycle(ServerWorker *worker);
+    quint64 poolHits() const;
+    quint64 poolMisses() const;
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+private:
+    ChatServer *m_server;
+    const int m_threadIdx;
+    QVector<ServerWorker *> m_idleWorkers;
+    QAtomicInteger<quint64> m_poolHits;
+    QAtomicInteger<quint64> m_poolMisses;
+};
+
+#endif // THREADLISTENER_H
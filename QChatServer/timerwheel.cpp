@@ -0,0 +1,203 @@
+#include "timerwheel.h"
+
+#include <QThread>
+#include <QTimer>
+
+TimerWheel::Timer::Timer(std::function<void()> callback)
+    : Link{nullptr, nullptr}
+    , m_wheel(nullptr)
+    , m_expiryTick(0)
+    , m_callback(std::move(callback))
+{}
+
+TimerWheel::Timer::~Timer()
+{
+    stop();
+}
+
+void TimerWheel::Timer::start(qint64 msecs)
+{
+    stop();
+    TimerWheel::local().add(this, msecs);
+}
+
+void TimerWheel::Timer::stop()
+{
+    if (m_wheel)
+        m_wheel->remove(this);
+}
+
+qint64 TimerWheel::Timer::remainingMsecs() const
+{
+    if (!m_wheel)
+        return -1;
+    const quint64 now = m_wheel->clockTick();
+    return m_expiryTick > now ? qint64(m_expiryTick - now) * TickMsecs : 0;
+}
+
+TimerWheel::TimerWheel()
+    : m_currentTick(0)
+    , m_activeCount(0)
+    , m_ticker(nullptr)
+{
+    for (auto &level : m_slots) {
+        for (Link &slot : level)
+            slot = Link{&slot, &slot};
+    }
+    m_clock.start();
+}
+
+// Owners stop their timers before the thread ends, anything left over is
+// only detached. The ticker is gone by then on threads that QThread ran;
+// on the main thread the event dispatcher may already be destroyed, so it
+// is left to the process exit.
+TimerWheel::~TimerWheel()
+{
+    for (auto &level : m_slots) {
+        for (Link &slot : level) {
+            while (slot.next != &slot) {
+                Timer *timer = static_cast<Timer *>(slot.next);
+                unlink(timer);
+                timer->m_wheel = nullptr;
+            }
+        }
+    }
+}
+
+TimerWheel &TimerWheel::local()
+{
+    static thread_local TimerWheel wheel;
+    return wheel;
+}
+
+quint64 TimerWheel::clockTick() const
+{
+    return quint64(m_clock.elapsed() / TickMsecs);
+}
+
+void TimerWheel::link(Link *list, Link *link)
+{
+    link->prev = list->prev;
+    link->next = list;
+    list->prev->next = link;
+    list->prev = link;
+}
+
+void TimerWheel::unlink(Link *link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = link->next = nullptr;
+}
+
+void TimerWheel::add(Timer *timer, qint64 msecs)
+{
+    if (m_activeCount == 0) {
+        // Nothing is due while the wheel is empty, it just catches up
+        m_currentTick = clockTick();
+        if (!m_ticker) {
+            m_ticker = new QTimer;
+            m_ticker->setInterval(int(TickMsecs));
+            QObject::connect(m_ticker, &QTimer::timeout, m_ticker, [this]() { advance(); });
+            // While the thread's event dispatcher is still there; deferred
+            // deletes are delivered after finished()
+            QObject::connect(QThread::currentThread(), &QThread::finished, m_ticker, [this]() {
+                m_ticker->stop();
+                m_ticker->deleteLater();
+                m_ticker = nullptr;
+            }, Qt::DirectConnection);
+        }
+        m_ticker->start();
+    }
+    // Rounded up, a timer never fires early
+    const quint64 ticks = quint64(qMax<qint64>((msecs + TickMsecs - 1) / TickMsecs, 1));
+    timer->m_expiryTick = clockTick() + ticks;
+    timer->m_wheel = this;
+    ++m_activeCount;
+    insert(timer);
+}
+
+void TimerWheel::remove(Timer *timer)
+{
+    unlink(timer);
+    timer->m_wheel = nullptr;
+    if (--m_activeCount == 0 && m_ticker)
+        m_ticker->stop();
+}
+
+// The level is picked by how far away the expiry is, the slot by the
+// expiry's digit at that level. A slot above level 0 is moved down when
+// the lower digits of the current tick roll over to it, before the tick's
+// own slot expires, so a timer due on that very tick lands in the slot
+// about to expire.
+void TimerWheel::insert(Timer *timer)
+{
+    const quint64 expiry = qMax(timer->m_expiryTick, m_currentTick);
+    const quint64 delta = expiry - m_currentTick;
+    int level = 0;
+    while (level < LevelCount - 1 && delta >= (quint64(1) << (SlotBits * (level + 1))))
+        ++level;
+    quint64 slot;
+    if (delta >= (quint64(1) << (SlotBits * LevelCount))) {
+        // Beyond the last level: park it in the slot cascaded last, it is
+        // placed again from there
+        slot = ((m_currentTick >> (SlotBits * level)) - 1) & SlotMask;
+    } else {
+        slot = (expiry >> (SlotBits * level)) & SlotMask;
+    }
+    link(&m_slots[level][slot], timer);
+}
+
+void TimerWheel::cascade(int level)
+{
+    Link &slot = m_slots[level][(m_currentTick >> (SlotBits * level)) & SlotMask];
+    Link pending{&pending, &pending};
+    if (slot.next == &slot)
+        return;
+    // Moved aside first, insert() may put a timer back into this slot
+    pending.next = slot.next;
+    pending.prev = slot.prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    slot = Link{&slot, &slot};
+    while (pending.next != &pending) {
+        Link *link = pending.next;
+        unlink(link);
+        insert(static_cast<Timer *>(link));
+    }
+}
+
+// Catches up tick by tick when the thread was busy. Callbacks may start or
+// stop any timer, the one that expired included.
+void TimerWheel::advance()
+{
+    advanceTo(clockTick());
+}
+
+void TimerWheel::advanceTo(quint64 target)
+{
+    while (m_currentTick < target && m_activeCount > 0) {
+        ++m_currentTick;
+        for (int level = 1; level < LevelCount; ++level) {
+            if ((m_currentTick & ((quint64(1) << (SlotBits * level)) - 1)) != 0)
+                break;
+            cascade(level);
+        }
+        Link &slot = m_slots[0][m_currentTick & SlotMask];
+        Link expired{&expired, &expired};
+        if (slot.next == &slot)
+            continue;
+        expired.next = slot.next;
+        expired.prev = slot.prev;
+        expired.next->prev = &expired;
+        expired.prev->next = &expired;
+        slot = Link{&slot, &slot};
+        while (expired.next != &expired) {
+            Timer *timer = static_cast<Timer *>(expired.next);
+            remove(timer);
+            timer->m_callback();
+        }
+    }
+    if (m_activeCount == 0)
+        m_currentTick = target;
+}
@@ -0,0 +1,87 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QElapsedTimer>
+#include <array>
+#include <functional>
+
+class QTimer;
+
+// Hierarchical timer wheel, one per thread, for the many coarse per
+// connection deadlines (heartbeats, idle and login timeouts). Each thread
+// has a single QTimer that ticks the wheel while it holds timers. Starting
+// and stopping a timer are O(1); a tick expires the due timers and now and
+// then moves a slot of a higher level one level down, so each timer is
+// touched at most once per level.
+//
+// Resolution is one tick. A Timer belongs to the wheel of the thread it was
+// started on and must be stopped there, e.g. before its owner moves to
+// another thread.
+class TimerWheel
+{
+    friend class ProtocolBenchmark;
+
+    // Timers in a slot form a circular list around the slot itself
+    struct Link
+    {
+        Link *prev;
+        Link *next;
+    };
+
+public:
+    static constexpr qint64 TickMsecs = 100;
+
+    class Timer : private Link
+    {
+    public:
+        explicit Timer(std::function<void()> callback);
+        ~Timer();
+        Q_DISABLE_COPY(Timer)
+
+        // Restarts the timer if it is already running
+        void start(qint64 msecs);
+        void stop();
+        bool isActive() const { return m_wheel != nullptr; }
+        qint64 remainingMsecs() const;
+
+    private:
+        friend class TimerWheel;
+        friend class ProtocolBenchmark;
+        TimerWheel *m_wheel;
+        quint64 m_expiryTick;
+        std::function<void()> m_callback;
+    };
+
+    static TimerWheel &local();
+    int activeCount() const { return m_activeCount; }
+
+private:
+    // Four levels of 64 slots: 6.4 s at tick resolution, then 6.8 min,
+    // 7.3 h and 19 days. Anything later waits in the last level.
+    static constexpr int SlotBits = 6;
+    static constexpr int SlotCount = 1 << SlotBits;
+    static constexpr quint64 SlotMask = SlotCount - 1;
+    static constexpr int LevelCount = 4;
+
+    TimerWheel();
+    ~TimerWheel();
+    Q_DISABLE_COPY(TimerWheel)
+
+    quint64 clockTick() const;
+    void add(Timer *timer, qint64 msecs);
+    void remove(Timer *timer);
+    void insert(Timer *timer);
+    void advance();
+    void advanceTo(quint64 target);
+    void cascade(int level);
+    static void link(Link *list, Link *link);
+    static void unlink(Link *link);
+
+    std::array<std::array<Link, SlotCount>, LevelCount> m_slots;
+    QElapsedTimer m_clock;
+    quint64 m_currentTick;
+    int m_activeCount;
+    QTimer *m_ticker;
+};
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,57 @@
+#include "tokenbucket.h"
+
+static constexpr quint64 TokenUnit = 1000000000;
+
+TokenBucket::TokenBucket()
+    : m_perSecond(0)
+    , m_capacity(0)
+    , m_level(0)
+    , m_lastNsecs(0)
+{}
+
+TokenBucket::TokenBucket(quint32 perSecond, quint32 burst, qint64 nowNsecs)
+    : m_perSecond(perSecond)
+    , m_capacity(quint64(qMax<quint32>(burst, 1)) * TokenUnit)
+    , m_level(m_capacity)
+    , m_lastNsecs(nowNsecs)
+{}
+
+void TokenBucket::refill(qint64 nowNsecs)
+{
+    if (nowNsecs <= m_lastNsecs)
+        return;
+    // Capped before multiplying, a long quiet spell cannot overflow
+    const quint64 elapsed = qMin<quint64>(quint64(nowNsecs - m_lastNsecs),
+                                          m_capacity / m_perSecond + 1);
+    m_level = qMin(m_capacity, m_level + elapsed * m_perSecond);
+    m_lastNsecs = nowNsecs;
+}
+
+// More than the bucket holds costs a full bucket, else it could never pass
+quint64 TokenBucket::cost(quint32 tokens) const
+{
+    return qMin(quint64(tokens) * TokenUnit, m_capacity);
+}
+
+bool TokenBucket::tryTake(qint64 nowNsecs, quint32 tokens)
+{
+    if (!isLimited())
+        return true;
+    refill(nowNsecs);
+    const quint64 needed = cost(tokens);
+    if (m_level < needed)
+        return false;
+    m_level -= needed;
+    return true;
+}
+
+qint64 TokenBucket::nsecsUntilAvailable(qint64 nowNsecs, quint32 tokens)
+{
+    if (!isLimited())
+        return 0;
+    refill(nowNsecs);
+    const quint64 needed = cost(tokens);
+    if (m_level >= needed)
+        return 0;
+    return qint64((needed - m_level + m_perSecond - 1) / m_perSecond);
+}
@@ -0,0 +1,33 @@
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <QtGlobal>
+
+// Rate limiter that allows bursts: the bucket holds up to burst tokens and
+// refills at perSecond tokens a second. Times are nanoseconds on any
+// monotonic clock. A rate of 0 never limits. Not thread safe, each bucket
+// belongs to one thread.
+class TokenBucket
+{
+public:
+    TokenBucket();
+    TokenBucket(quint32 perSecond, quint32 burst, qint64 nowNsecs);
+
+    bool isLimited() const { return m_perSecond != 0; }
+    bool tryTake(qint64 nowNsecs, quint32 tokens = 1);
+    // How long until tryTake() of that many tokens would succeed
+    qint64 nsecsUntilAvailable(qint64 nowNsecs, quint32 tokens = 1);
+
+private:
+    void refill(qint64 nowNsecs);
+    quint64 cost(quint32 tokens) const;
+
+    quint64 m_perSecond;
+    // Tokens are counted in billionths, so a refill is exact to the
+    // nanosecond without floating point
+    quint64 m_capacity;
+    quint64 m_level;
+    qint64 m_lastNsecs;
+};
+
+#endif // TOKENBUCKET_H
@@ -0,0 +1,340 @@
+#include "utf8.h"
+
+#include <QtAlgorithms>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define QCHAT_UTF8_SSE2
+#  include <emmintrin.h>
+#endif
+// GCC on Windows does not align 32-byte stack spills (GCC bug 54412), so
+// MinGW builds stay on SSE2
+#if defined(QCHAT_UTF8_SSE2) && defined(__GNUC__) && (!defined(Q_OS_WIN) || defined(__clang__))
+#  define QCHAT_UTF8_AVX2
+#  define QCHAT_AVX2_TARGET __attribute__((target("avx2")))
+#  include <immintrin.h>
+#endif
+
+namespace Utf8
+{
+// Returns the position after the character at p, or nullptr if it is not
+// well formed (overlong forms, surrogates and code points past U+10FFFF
+// are rejected like QString::fromUtf8 would replace them)
+static const uchar *nextCharacter(const uchar *p, const uchar *end)
+{
+    const uchar lead = *p;
+    if (lead < 0x80)
+        return p + 1;
+    qsizetype length;
+    uchar low = 0x80;
+    uchar high = 0xBF;
+    if (lead < 0xC2) {
+        return nullptr;
+    } else if (lead < 0xE0) {
+        length = 2;
+    } else if (lead < 0xF0) {
+        length = 3;
+        if (lead == 0xE0)
+            low = 0xA0;
+        else if (lead == 0xED)
+            high = 0x9F;
+    } else if (lead < 0xF5) {
+        length = 4;
+        if (lead == 0xF0)
+            low = 0x90;
+        else if (lead == 0xF4)
+            high = 0x8F;
+    } else {
+        return nullptr;
+    }
+    if (end - p < length || p[1] < low || p[1] > high)
+        return nullptr;
+    for (qsizetype i = 2; i < length; ++i) {
+        if ((p[i] & 0xC0) != 0x80)
+            return nullptr;
+    }
+    return p + length;
+}
+
+static bool isValidScalar(const uchar *p, const uchar *end)
+{
+    while (p < end) {
+        while (end - p >= 8) {
+            quint64 word;
+            memcpy(&word, p, sizeof(word));
+            if (word & Q_UINT64_C(0x8080808080808080))
+                break;
+            p += 8;
+        }
+        if (p == end)
+            break;
+        p = nextCharacter(p, end);
+        if (!p)
+            return false;
+    }
+    return true;
+}
+
+#ifdef QCHAT_UTF8_SSE2
+// Skips ASCII 16 bytes at a time, multi-byte characters go through the
+// scalar decoder
+static bool isValidSse2(const uchar *p, const uchar *end)
+{
+    while (p < end) {
+        if (end - p >= 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            const uint mask = uint(_mm_movemask_epi8(chunk));
+            if (mask == 0) {
+                p += 16;
+                continue;
+            }
+            p += qCountTrailingZeroBits(mask);
+        }
+        p = nextCharacter(p, end);
+        if (!p)
+            return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef QCHAT_UTF8_AVX2
+// Lookup table validation after Keiser and Lemire, "Validating UTF-8 In
+// Less Than One Instruction Per Byte": every byte pair is classified by
+// three 16 entry tables indexed by nibbles, and the 3rd/4th byte
+// continuation rules are checked with saturated subtractions.
+enum : char {
+    TooShort = 1 << 0,
+    TooLong = 1 << 1,
+    Overlong3 = 1 << 2,
+    TooLarge = 1 << 3,
+    Surrogate = 1 << 4,
+    Overlong2 = 1 << 5,
+    TooLarge1000 = 1 << 6,
+    Overlong4 = 1 << 6,
+    TwoConts = char(1 << 7),
+    Carry = TooShort | TooLong | TwoConts
+};
+
+#define QCHAT_TABLE16(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+    _mm256_setr_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, \
+                     a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+QCHAT_AVX2_TARGET static inline __m256i highNibbles(__m256i v)
+{
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+template <int N>
+QCHAT_AVX2_TARGET static inline __m256i previousBytes(__m256i input, __m256i previousInput)
+{
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previousInput, input, 0x21), 16 - N);
+}
+
+QCHAT_AVX2_TARGET static inline __m256i specialCases(__m256i input, __m256i previous1)
+{
+    const __m256i byte1High = _mm256_shuffle_epi8(QCHAT_TABLE16(
+        TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+        TwoConts, TwoConts, TwoConts, TwoConts,
+        TooShort | Overlong2,
+        TooShort,
+        TooShort | Overlong3 | Surrogate,
+        TooShort | TooLarge | TooLarge1000 | Overlong4), highNibbles(previous1));
+    const __m256i byte1Low = _mm256_shuffle_epi8(QCHAT_TABLE16(
+        Carry | Overlong3 | Overlong2 | Overlong4,
+        Carry | Overlong2,
+        Carry,
+        Carry,
+        Carry | TooLarge,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000 | Surrogate,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000),
+        _mm256_and_si256(previous1, _mm256_set1_epi8(0x0F)));
+    const __m256i byte2High = _mm256_shuffle_epi8(QCHAT_TABLE16(
+        TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooShort, TooShort, TooShort, TooShort), highNibbles(input));
+    return _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+}
+
+QCHAT_AVX2_TARGET static inline void checkBlock(__m256i input, __m256i &previousInput,
+                                                __m256i &previousIncomplete, __m256i &error)
+{
+    if (_mm256_movemask_epi8(input) == 0) {
+        error = _mm256_or_si256(error, previousIncomplete);
+        previousIncomplete = _mm256_setzero_si256();
+    } else {
+        const __m256i previous1 = previousBytes<1>(input, previousInput);
+        const __m256i previous2 = previousBytes<2>(input, previousInput);
+        const __m256i previous3 = previousBytes<3>(input, previousInput);
+        // Only 111xxxxx two bytes back and 1111xxxx three bytes back end up >= 0x80
+        const __m256i mustBeContinuation = _mm256_and_si256(
+            _mm256_or_si256(_mm256_subs_epu8(previous2, _mm256_set1_epi8(char(0xE0 - 0x80))),
+                            _mm256_subs_epu8(previous3, _mm256_set1_epi8(char(0xF0 - 0x80)))),
+            _mm256_set1_epi8(char(0x80)));
+        error = _mm256_or_si256(error, _mm256_xor_si256(mustBeContinuation,
+                                                        specialCases(input, previous1)));
+        // A lead byte in the last three positions needs the next block
+        previousIncomplete = _mm256_subs_epu8(input, _mm256_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1)));
+    }
+    previousInput = input;
+}
+
+QCHAT_AVX2_TARGET static bool isValidAvx2(const uchar *p, const uchar *end)
+{
+    __m256i error = _mm256_setzero_si256();
+    __m256i previousInput = _mm256_setzero_si256();
+    __m256i previousIncomplete = _mm256_setzero_si256();
+    for (; end - p >= 32; p += 32) {
+        const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        checkBlock(input, previousInput, previousIncomplete, error);
+    }
+    if (p < end) {
+        // Zero padding is ASCII, so a truncated tail still reports TooShort
+        uchar tail[32] = {};
+        memcpy(tail, p, end - p);
+        const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tail));
+        checkBlock(input, previousInput, previousIncomplete, error);
+    }
+    error = _mm256_or_si256(error, previousIncomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+#undef QCHAT_TABLE16
+#endif
+
+bool isValid(QByteArrayView text)
+{
+    const uchar *begin = reinterpret_cast<const uchar *>(text.data());
+    const uchar *end = begin + text.size();
+#ifdef QCHAT_UTF8_AVX2
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2)
+        return isValidAvx2(begin, end);
+#endif
+#ifdef QCHAT_UTF8_SSE2
+    return isValidSse2(begin, end);
+#else
+    return isValidScalar(begin, end);
+#endif
+}
+
+bool isValidScalar(QByteArrayView text)
+{
+    const uchar *begin = reinterpret_cast<const uchar *>(text.data());
+    return isValidScalar(begin, begin + text.size());
+}
+
+static bool isAsciiSpace(uchar c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// U+0085, U+00A0, U+1680, U+2000..U+200A, U+2028, U+2029, U+202F, U+205F
+// and U+3000 are the non-ASCII characters QChar::isSpace() accepts
+static bool isMultiByteSpace(const uchar *p)
+{
+    switch (p[0]) {
+    case 0xC2:
+        return p[1] == 0x85 || p[1] == 0xA0;
+    case 0xE1:
+        return p[1] == 0x9A && p[2] == 0x80;
+    case 0xE2:
+        if (p[1] == 0x80)
+            return p[2] <= 0x8A || p[2] == 0xA8 || p[2] == 0xA9 || p[2] == 0xAF;
+        return p[1] == 0x81 && p[2] == 0x9F;
+    case 0xE3:
+        return p[1] == 0x80 && p[2] == 0x80;
+    default:
+        return false;
+    }
+}
+
+static qsizetype leadingSpace(const uchar *p, const uchar *end)
+{
+    if (isAsciiSpace(*p))
+        return 1;
+    const qsizetype length = *p == 0xC2 ? 2 : 3;
+    if (end - p >= length && *p >= 0xC2 && isMultiByteSpace(p))
+        return length;
+    return 0;
+}
+
+static qsizetype trailingSpace(const uchar *begin, const uchar *end)
+{
+    if (isAsciiSpace(end[-1]))
+        return 1;
+    // Valid UTF-8 never has a lead byte in continuation position, so
+    // matching on the lead byte of the tail is enough
+    if (end - begin >= 2 && end[-2] == 0xC2 && isMultiByteSpace(end - 2))
+        return 2;
+    if (end - begin >= 3 && end[-3] != 0xC2 && isMultiByteSpace(end - 3))
+        return 3;
+    return 0;
+}
+
+#ifdef QCHAT_UTF8_SSE2
+static inline uint asciiSpaceMask(__m128i chunk)
+{
+    const __m128i isBlank = _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '));
+    const __m128i isControl = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('\t' - 1)),
+                                            _mm_cmplt_epi8(chunk, _mm_set1_epi8('\r' + 1)));
+    return uint(_mm_movemask_epi8(_mm_or_si128(isBlank, isControl)));
+}
+#endif
+
+QByteArrayView trimmed(QByteArrayView text)
+{
+    const uchar *begin = reinterpret_cast<const uchar *>(text.data());
+    const uchar *end = begin + text.size();
+    for (;;) {
+#ifdef QCHAT_UTF8_SSE2
+        while (end - begin >= 16) {
+            const uint mask = asciiSpaceMask(_mm_loadu_si128(reinterpret_cast<const __m128i *>(begin)));
+            if (mask != 0xFFFF) {
+                begin += qCountTrailingZeroBits(~mask);
+                break;
+            }
+            begin += 16;
+        }
+#endif
+        if (begin == end)
+            return QByteArrayView();
+        const qsizetype length = leadingSpace(begin, end);
+        if (length == 0)
+            break;
+        begin += length;
+    }
+    for (;;) {
+#ifdef QCHAT_UTF8_SSE2
+        while (end - begin >= 16) {
+            const uint mask = asciiSpaceMask(_mm_loadu_si128(reinterpret_cast<const __m128i *>(end - 16)));
+            if (mask != 0xFFFF) {
+                end -= qCountLeadingZeroBits(quint16(~mask));
+                break;
+            }
+            end -= 16;
+        }
+#endif
+        const qsizetype length = trailingSpace(begin, end);
+        if (length == 0)
+            break;
+        end -= length;
+    }
+    return QByteArrayView(reinterpret_cast<const char *>(begin), end - begin);
+}
+}
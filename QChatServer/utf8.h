@@ -0,0 +1,18 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <QByteArrayView>
+
+// Checks and trims UTF-8 text in place on the byte buffer, so the server
+// can route message text without converting it to QString.
+namespace Utf8
+{
+// Picks the widest implementation the CPU supports (AVX2, SSE2, scalar)
+bool isValid(QByteArrayView text);
+bool isValidScalar(QByteArrayView text);
+
+// Same set of spaces as QString::trimmed()
+QByteArrayView trimmed(QByteArrayView text);
+}
+
+#endif // UTF8_H